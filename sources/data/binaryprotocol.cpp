@@ -0,0 +1,514 @@
+#include "binaryprotocol.h"
+#include <limits>
+#include <algorithm>
+
+
+/*-----------------------------------------------------------------------------
+	BinaryWriter
+-----------------------------------------------------------------------------*/
+
+void BinaryWriter::Attribute(const ClientAttribute& value)
+{
+	Byte(uint8_t(value.GetType()));
+	switch (value.GetType())
+	{
+		case ClientAttributeType::T_STR: String(value.GetStringData(), value.GetStringLength()); break;
+		case ClientAttributeType::T_INT: Signed(value.GetInt());                                break;
+		case ClientAttributeType::T_UNS: Varint(value.GetUnsigned());                           break;
+		case ClientAttributeType::T_DBL: Double(value.GetDouble());                             break;
+		case ClientAttributeType::T_BOL: Byte(value.GetBool());                                 break;
+		default:                                                                                break;
+	}
+}
+
+void BinaryWriter::Attributes(const ClientAttributeMap& attributes)
+{
+	Varint(attributes.Size());
+	for (auto& entry : attributes)
+	{
+		Key(entry.first);
+		Attribute(entry.second);
+	}
+}
+
+
+/*-----------------------------------------------------------------------------
+	BinaryReader
+-----------------------------------------------------------------------------*/
+
+bool BinaryReader::Byte(uint8_t& value)
+{
+	if (mCursor == mEnd)
+	{
+		return false;
+	}
+
+	value = uint8_t(*mCursor++);
+	return true;
+}
+
+bool BinaryReader::Varint(uint64_t& value)
+{
+	value = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		if (mCursor == mEnd)
+		{
+			return false;
+		}
+
+		uint8_t byte = uint8_t(*mCursor++);
+		value |= uint64_t(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool BinaryReader::Signed(int64_t& value)
+{
+	uint64_t encoded;
+	if (!Varint(encoded))
+	{
+		return false;
+	}
+
+	value = int64_t(encoded >> 1) ^ -int64_t(encoded & 1);
+	return true;
+}
+
+bool BinaryReader::Double(double& value)
+{
+	if (mEnd - mCursor < 8)
+	{
+		return false;
+	}
+
+	uint64_t bits = 0;
+	for (int i = 0; i < 8; i++)
+	{
+		bits |= uint64_t(uint8_t(*mCursor++)) << (8 * i);
+	}
+	memcpy(&value, &bits, sizeof(value));
+	return true;
+}
+
+bool BinaryReader::String(StringView& value)
+{
+	uint64_t length;
+	if (!Varint(length) || length > uint64_t(mEnd - mCursor))
+	{
+		return false;
+	}
+
+	value = StringView(mCursor, size_t(length));
+	mCursor += length;
+	return true;
+}
+
+bool BinaryReader::Key(RequestKey& key)
+{
+	uint64_t encoded;
+	if (!Varint(encoded))
+	{
+		return false;
+	}
+
+	// Zero announces a name, other values are identifiers plus one
+	key = RequestKey();
+	if (encoded == 0)
+	{
+		return String(key.name);
+	}
+	key.id = (encoded <= AttributeKeys::cMaxKeys) ? AttributeKey(encoded - 1) : AttributeKeys::cInvalidKey;
+	return true;
+}
+
+bool BinaryReader::Value(RequestValue& value)
+{
+	uint8_t type;
+	if (!Byte(type))
+	{
+		return false;
+	}
+
+	// Types are those of ClientAttributeType
+	value = RequestValue();
+	value.isEmpty = false;
+	switch (ClientAttributeType(type))
+	{
+		case ClientAttributeType::T_NONE:
+			value.isEmpty = true;
+			return true;
+
+		case ClientAttributeType::T_STR:
+			value.type = RequestValueType::T_STR;
+			return String(value.string);
+
+		case ClientAttributeType::T_INT:
+			value.type = RequestValueType::T_INT;
+			return Signed(value.integer)
+				&& value.integer >= std::numeric_limits<int32_t>::min() && value.integer <= std::numeric_limits<int32_t>::max();
+
+		case ClientAttributeType::T_UNS:
+		{
+			uint64_t integer;
+			value.type = RequestValueType::T_UNS;
+			bool isValid = Varint(integer) && integer <= std::numeric_limits<uint32_t>::max();
+			value.integer = int64_t(integer);
+			return isValid;
+		}
+
+		case ClientAttributeType::T_DBL:
+			value.type = RequestValueType::T_DBL;
+			return Double(value.number);
+
+		case ClientAttributeType::T_BOL:
+		{
+			uint8_t boolean;
+			value.type = RequestValueType::T_BOL;
+			bool isValid = Byte(boolean);
+			value.integer = (boolean != 0);
+			return isValid;
+		}
+	}
+
+	return false;
+}
+
+
+/*-----------------------------------------------------------------------------
+	BinaryRequestParser
+-----------------------------------------------------------------------------*/
+
+bool BinaryRequestParser::Parse(const char* data, size_t length, ClientRequest& request)
+{
+	BinaryReader reader(data, length);
+	request.Clear();
+
+	uint8_t magic;
+	if (!reader.Byte(magic) || magic != cBinaryMagic)
+	{
+		return false;
+	}
+
+	while (!reader.IsEnd())
+	{
+		uint8_t command;
+		uint64_t count;
+		reader.Byte(command);
+
+		switch (BinaryCommand(command))
+		{
+			// Identifiers, then the session number plus one, or zero
+			case BinaryCommand::T_CONNECT:
+			{
+				uint64_t session;
+				request.hasConnect = true;
+				if (!reader.String(request.connectPrivateId) || !reader.String(request.connectPublicId) || !reader.Varint(session))
+				{
+					return false;
+				}
+				request.hasConnectSession = (session > 0);
+				request.connectSession = uint32_t(std::min<uint64_t>(session - 1, UINT32_MAX));
+				break;
+			}
+
+			case BinaryCommand::T_DISCONNECT:
+				request.hasDisconnect = true;
+				if (!ParseTarget(reader, request.disconnect))
+				{
+					return false;
+				}
+				break;
+
+			case BinaryCommand::T_HEARTBEAT:
+				request.hasHeartbeat = true;
+				if (!ParseTarget(reader, request.heartbeat))
+				{
+					return false;
+				}
+				break;
+
+			// Target, values to set, numbers to add, keys to remove
+			case BinaryCommand::T_UPDATE:
+				request.hasUpdate = true;
+				request.updateData.clear();
+				request.updateIncrement.clear();
+				request.updateRemove.clear();
+				if (!ParseUpdate(reader, request.update, request.updateData, request.updateIncrement, request.updateRemove))
+				{
+					return false;
+				}
+				break;
+
+			case BinaryCommand::T_QUERY:
+				request.hasQuery = true;
+				if (!reader.String(request.queryTargetId))
+				{
+					return false;
+				}
+				break;
+
+			// Public identifiers, then the count of keys to reply with plus one, or zero for all, and each key
+			case BinaryCommand::T_MULTI_QUERY:
+				request.hasMultiQuery = true;
+				request.multiQueryIds.clear();
+				request.multiQueryKeys.clear();
+				if (!ParseIdentifiers(reader, request.multiQueryIds) || !reader.Varint(count))
+				{
+					return false;
+				}
+				request.hasMultiQueryKeys = (count > 0);
+				for (uint64_t i = 1; i < count; i++)
+				{
+					request.multiQueryKeys.push_back(RequestKey());
+					if (!reader.Key(request.multiQueryKeys.back()))
+					{
+						return false;
+					}
+				}
+				break;
+
+			case BinaryCommand::T_SUBSCRIBE:
+				request.hasSubscribe = true;
+				request.subscribeIds.clear();
+				if (!ParseIdentifiers(reader, request.subscribeIds))
+				{
+					return false;
+				}
+				break;
+
+			case BinaryCommand::T_UNSUBSCRIBE:
+				request.hasUnsubscribe = true;
+				request.unsubscribeIds.clear();
+				if (!ParseIdentifiers(reader, request.unsubscribeIds))
+				{
+					return false;
+				}
+				break;
+
+			// Criteria as key, condition and value, then whether to explain the plan
+			case BinaryCommand::T_SEARCH:
+			{
+				uint8_t explain;
+				request.search.clear();
+				if (!reader.Varint(count))
+				{
+					return false;
+				}
+				for (uint64_t i = 0; i < count; i++)
+				{
+					uint8_t condition;
+					request.search.push_back(RequestCriterion());
+					RequestCriterion& criterion = request.search.back();
+					if (!reader.Key(criterion.key) || !reader.Byte(condition) || !reader.Value(criterion.value)
+						|| condition > uint8_t(ClientSearchCondition::T_GREATER_EQ))
+					{
+						return false;
+					}
+					criterion.conditionValue = condition;
+				}
+				if (!reader.Byte(explain))
+				{
+					return false;
+				}
+				request.hasSearch = (count > 0);
+				request.explain = (explain != 0);
+				break;
+			}
+
+			case BinaryCommand::T_STATS:
+				request.hasStats = true;
+				break;
+
+			case BinaryCommand::T_KEYS:
+				request.hasKeys = true;
+				request.keyNames.clear();
+				if (!reader.Varint(count))
+				{
+					return false;
+				}
+				for (uint64_t i = 0; i < count; i++)
+				{
+					request.keyNames.push_back(StringView());
+					if (!reader.String(request.keyNames.back()))
+					{
+						return false;
+					}
+				}
+				break;
+
+			case BinaryCommand::T_KEY_NAMES:
+				request.hasKeyNames = true;
+				request.keyIds.clear();
+				if (!reader.Varint(count))
+				{
+					return false;
+				}
+				for (uint64_t i = 0; i < count; i++)
+				{
+					uint64_t key;
+					if (!reader.Varint(key))
+					{
+						return false;
+					}
+					request.keyIds.push_back(key < AttributeKeys::cMaxKeys ? AttributeKey(key) : AttributeKeys::cInvalidKey);
+				}
+				break;
+
+			// Operations, each a heartbeat or update command with its arguments
+			case BinaryCommand::T_BATCH:
+				request.hasBatch = true;
+				request.batch.clear();
+				request.batchData.clear();
+				request.batchIncrement.clear();
+				request.batchRemove.clear();
+				if (!reader.Varint(count))
+				{
+					return false;
+				}
+				for (uint64_t i = 0; i < count; i++)
+				{
+					if (!ParseOperation(reader, request))
+					{
+						return false;
+					}
+				}
+				break;
+
+			default:
+				return false;
+		}
+	}
+
+	return true;
+}
+
+bool BinaryRequestParser::ParseTarget(BinaryReader& reader, RequestTarget& target)
+{
+	uint8_t kind;
+	uint64_t session;
+	target = RequestTarget();
+	if (!reader.Byte(kind))
+	{
+		return false;
+	}
+
+	switch (BinaryTarget(kind))
+	{
+		case BinaryTarget::T_BOUND:
+			return true;
+
+		case BinaryTarget::T_PRIVATE_ID:
+			target.hasPrivateId = true;
+			return reader.String(target.privateId);
+
+		case BinaryTarget::T_SESSION:
+			target.hasSession = true;
+			if (!reader.Varint(session))
+			{
+				return false;
+			}
+			target.session = uint32_t(std::min<uint64_t>(session, UINT32_MAX));
+			return true;
+
+		case BinaryTarget::T_ALL_SESSIONS:
+			target.isAllSessions = true;
+			return true;
+	}
+
+	return false;
+}
+
+bool BinaryRequestParser::ParseUpdate(BinaryReader& reader, RequestTarget& target, std::vector<RequestAttribute>& data,
+	std::vector<RequestAttribute>& increment, std::vector<RequestKey>& remove)
+{
+	uint64_t count;
+	if (!ParseTarget(reader, target) || !ParseAttributes(reader, data) || !ParseAttributes(reader, increment) || !reader.Varint(count))
+	{
+		return false;
+	}
+
+	for (uint64_t i = 0; i < count; i++)
+	{
+		remove.push_back(RequestKey());
+		if (!reader.Key(remove.back()))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool BinaryRequestParser::ParseAttributes(BinaryReader& reader, std::vector<RequestAttribute>& attributes)
+{
+	uint64_t count;
+	if (!reader.Varint(count))
+	{
+		return false;
+	}
+
+	for (uint64_t i = 0; i < count; i++)
+	{
+		attributes.push_back(RequestAttribute());
+		if (!reader.Key(attributes.back().key) || !reader.Value(attributes.back().value))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool BinaryRequestParser::ParseIdentifiers(BinaryReader& reader, std::vector<StringView>& identifiers)
+{
+	uint64_t count;
+	if (!reader.Varint(count))
+	{
+		return false;
+	}
+
+	for (uint64_t i = 0; i < count; i++)
+	{
+		identifiers.push_back(StringView());
+		if (!reader.String(identifiers.back()))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool BinaryRequestParser::ParseOperation(BinaryReader& reader, ClientRequest& request)
+{
+	uint8_t command;
+	if (!reader.Byte(command))
+	{
+		return false;
+	}
+
+	request.batch.push_back(RequestOperation());
+	RequestOperation& operation = request.batch.back();
+	operation.data.begin = request.batchData.size();
+	operation.increment.begin = request.batchIncrement.size();
+	operation.remove.begin = request.batchRemove.size();
+
+	bool isValid = false;
+	if (BinaryCommand(command) == BinaryCommand::T_HEARTBEAT)
+	{
+		operation.type = RequestOperationType::T_HEARTBEAT;
+		isValid = ParseTarget(reader, operation.target);
+	}
+	else if (BinaryCommand(command) == BinaryCommand::T_UPDATE)
+	{
+		operation.type = RequestOperationType::T_UPDATE;
+		isValid = ParseUpdate(reader, operation.target, request.batchData, request.batchIncrement, request.batchRemove);
+	}
+
+	operation.data.end = request.batchData.size();
+	operation.increment.end = request.batchIncrement.size();
+	operation.remove.end = request.batchRemove.size();
+	return isValid;
+}
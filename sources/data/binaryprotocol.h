@@ -0,0 +1,204 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include "request.h"
+#include "clientattribute.h"
+#include "clientsearch.h"
+
+
+/*-----------------------------------------------------------------------------
+	Binary protocol types
+-----------------------------------------------------------------------------*/
+
+// First byte of binary messages, which JSON text never starts with
+const uint8_t cBinaryMagic = 0xEC;
+
+// Kinds of command targets in binary requests
+enum class BinaryTarget : uint8_t { T_BOUND = 0, T_PRIVATE_ID, T_SESSION, T_ALL_SESSIONS };
+
+// Commands of binary requests, which also tag the sections of the replies they produce
+enum class BinaryCommand : uint8_t { T_CONNECT = 1, T_DISCONNECT, T_HEARTBEAT, T_UPDATE, T_QUERY, T_SEARCH, T_STATS, T_KEYS, T_KEY_NAMES, T_PLAN, T_BATCH, T_MULTI_QUERY, T_SUBSCRIBE, T_UNSUBSCRIBE };
+
+
+/*-----------------------------------------------------------------------------
+	BinaryWriter class definition
+-----------------------------------------------------------------------------*/
+
+// Writer of binary messages, appending to a string : integers are little-endian base-128 varints, signed
+// ones zigzag-encoded first, doubles are 8 little-endian bytes and strings have their length first
+class BinaryWriter
+{
+public:
+
+	BinaryWriter(std::string& output)
+		: mOutput(output)
+	{}
+
+	// Write a byte
+	void Byte(uint8_t value)
+	{
+		mOutput.push_back(char(value));
+	}
+
+	// Write an unsigned integer
+	void Varint(uint64_t value)
+	{
+		char buffer[10];
+		size_t length = 0;
+		while (value >= 0x80)
+		{
+			buffer[length++] = char(0x80 | (value & 0x7F));
+			value >>= 7;
+		}
+		buffer[length++] = char(value);
+		mOutput.append(buffer, length);
+	}
+
+	// Write a signed integer
+	void Signed(int64_t value)
+	{
+		Varint((uint64_t(value) << 1) ^ uint64_t(value >> 63));
+	}
+
+	// Write a floating-point number
+	void Double(double value)
+	{
+		uint64_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		char buffer[8];
+		for (int i = 0; i < 8; i++)
+		{
+			buffer[i] = char(bits >> (8 * i));
+		}
+		mOutput.append(buffer, sizeof(buffer));
+	}
+
+	// Write a string
+	void String(const char* data, size_t length)
+	{
+		Varint(length);
+		mOutput.append(data, length);
+	}
+	void String(const std::string& value)
+	{
+		String(value.data(), value.length());
+	}
+
+	// Write an attribute key by identifier
+	void Key(AttributeKey key)
+	{
+		Varint(uint64_t(key) + 1);
+	}
+
+	// Write an attribute key by name
+	void Key(const std::string& name)
+	{
+		Varint(0);
+		String(name);
+	}
+
+	// Write an attribute value : its type, then its value
+	void Attribute(const ClientAttribute& value);
+
+	// Write client attributes : their count, then each key and value
+	void Attributes(const ClientAttributeMap& attributes);
+
+
+private:
+
+	std::string&                                    mOutput;
+
+};
+
+
+/*-----------------------------------------------------------------------------
+	BinaryReader class definition
+-----------------------------------------------------------------------------*/
+
+// Reader of binary messages, each method returning false if the message ends or is invalid
+class BinaryReader
+{
+public:
+
+	BinaryReader(const char* data, size_t length)
+		: mCursor(data)
+		, mEnd(data + length)
+	{}
+
+	// Read a byte
+	bool Byte(uint8_t& value);
+
+	// Read an unsigned integer
+	bool Varint(uint64_t& value);
+
+	// Read a signed integer
+	bool Signed(int64_t& value);
+
+	// Read a floating-point number
+	bool Double(double& value);
+
+	// Read a string, pointing into the message
+	bool String(StringView& value);
+
+	// Read an attribute key, by identifier or by name
+	bool Key(RequestKey& key);
+
+	// Read an attribute value
+	bool Value(RequestValue& value);
+
+	// Check if the whole message was read
+	bool IsEnd() const
+	{
+		return mCursor == mEnd;
+	}
+
+
+private:
+
+	const char*                                     mCursor;
+	const char*                                     mEnd;
+
+};
+
+
+/*-----------------------------------------------------------------------------
+	BinaryRequestParser class definition
+-----------------------------------------------------------------------------*/
+
+// Parser for binary requests : the magic byte, then commands until the end, each a command byte followed
+// by its arguments. It fills the same ClientRequest as RequestParser, so that both protocols share handlers.
+class BinaryRequestParser
+{
+public:
+
+	// Parse a request, return false if it is not valid. Strings point into the request.
+	bool Parse(const char* data, size_t length, ClientRequest& request);
+
+	// Parse a request from a string
+	bool Parse(const std::string& data, ClientRequest& request)
+	{
+		return Parse(data.data(), data.length(), request);
+	}
+
+
+private:
+
+	// Parse the target of a command : its kind, then a private identifier or session number if it has one
+	bool ParseTarget(BinaryReader& reader, RequestTarget& target);
+
+	// Parse the arguments of an update, adding its changes to the lists
+	bool ParseUpdate(BinaryReader& reader, RequestTarget& target, std::vector<RequestAttribute>& data,
+		std::vector<RequestAttribute>& increment, std::vector<RequestKey>& remove);
+
+	// Parse a count of attributes, then each key and value, adding them to the list
+	bool ParseAttributes(BinaryReader& reader, std::vector<RequestAttribute>& attributes);
+
+	// Parse a count of identifiers, then each identifier, adding them to the list
+	bool ParseIdentifiers(BinaryReader& reader, std::vector<StringView>& identifiers);
+
+	// Parse an operation of a batch : a heartbeat or update command byte, then its arguments
+	bool ParseOperation(BinaryReader& reader, ClientRequest& request);
+
+};
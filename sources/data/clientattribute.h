@@ -1,6 +1,12 @@
 #pragma once
 
 #include <string>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include "interning.h"
 
 
 /*-----------------------------------------------------------------------------
@@ -8,47 +14,195 @@
 -----------------------------------------------------------------------------*/
 
 // Type of attribute
-enum class ClientAttributeType {T_NONE = 0, T_STR, T_INT, T_UNS, T_DBL, T_BOL};
+enum class ClientAttributeType : uint8_t {T_NONE = 0, T_STR, T_INT, T_UNS, T_DBL, T_BOL};
 
 
-// Client attribute value
+// Client attribute value, in 16 bytes : numbers are stored in place, strings too when they are short,
+// longer ones point to their shared copy in InternedStrings. Equal strings thus always have the same
+// representation, and compare as a pointer or a few bytes.
 class ClientAttribute
 {
 public:
 
 	// Constructors
-	ClientAttribute()               : type(ClientAttributeType::T_NONE)      {}
-	ClientAttribute(std::string  v) : type(ClientAttributeType::T_STR), s(v) {}
-	ClientAttribute(int          v) : type(ClientAttributeType::T_INT), i(v) {}
-	ClientAttribute(unsigned int v) : type(ClientAttributeType::T_UNS), u(v) {}
-	ClientAttribute(double       v) : type(ClientAttributeType::T_DBL), d(v) {}
-	ClientAttribute(bool         v) : type(ClientAttributeType::T_BOL), b(v) {}
+	ClientAttribute()                      { Reset(ClientAttributeType::T_NONE); }
+	ClientAttribute(const std::string&  v) { SetString(v.data(), v.length()); }
+	ClientAttribute(const char*         v) { SetString(v, strlen(v)); }
+	ClientAttribute(const char* v, size_t l) { SetString(v, l); }
+	ClientAttribute(int                 v) { Reset(ClientAttributeType::T_INT); memcpy(mData, &v, sizeof(v)); }
+	ClientAttribute(unsigned int        v) { Reset(ClientAttributeType::T_UNS); memcpy(mData, &v, sizeof(v)); }
+	ClientAttribute(double              v) { Reset(ClientAttributeType::T_DBL); memcpy(mData, &v, sizeof(v)); }
+	ClientAttribute(bool                v) { Reset(ClientAttributeType::T_BOL); mData[0] = v; }
 
+	ClientAttribute(const ClientAttribute& other)
+	{
+		Copy(other);
+		if (IsInterned())
+		{
+			InternedStrings::Get().AddReference(GetInterned());
+		}
+	}
+
+	ClientAttribute(ClientAttribute&& other)
+	{
+		Copy(other);
+		other.Reset(ClientAttributeType::T_NONE);
+	}
+
+	ClientAttribute& operator=(ClientAttribute other)
+	{
+		std::swap(mData, other.mData);
+		std::swap(mSize, other.mSize);
+		std::swap(mType, other.mType);
+		return *this;
+	}
+
+	~ClientAttribute()
+	{
+		if (IsInterned())
+		{
+			InternedStrings::Get().Release(GetInterned());
+		}
+	}
 
 public:
 
-	// Internal storage
-	ClientAttributeType                      type;
-	std::string                              s;
-	int                                      i;
-	unsigned int                             u;
-	double                                   d;
-	bool                                     b;
+	// Get the type
+	ClientAttributeType GetType() const
+	{
+		return mType;
+	}
+
+	// Get the value of an integer attribute
+	int GetInt() const
+	{
+		int v;
+		memcpy(&v, mData, sizeof(v));
+		return v;
+	}
+
+	// Get the value of an unsigned integer attribute
+	unsigned int GetUnsigned() const
+	{
+		unsigned int v;
+		memcpy(&v, mData, sizeof(v));
+		return v;
+	}
+
+	// Get the value of a floating-point attribute
+	double GetDouble() const
+	{
+		double v;
+		memcpy(&v, mData, sizeof(v));
+		return v;
+	}
+
+	// Get the value of a boolean attribute
+	bool GetBool() const
+	{
+		return mData[0] != 0;
+	}
+
+	// Get the characters of a string attribute, not null-terminated
+	const char* GetStringData() const
+	{
+		return IsInterned() ? GetInterned()->first.data() : mData;
+	}
+
+	// Get the length of a string attribute
+	size_t GetStringLength() const
+	{
+		return IsInterned() ? GetInterned()->first.length() : mSize;
+	}
+
+	// Get a copy of the value of a string attribute
+	std::string GetString() const
+	{
+		return std::string(GetStringData(), GetStringLength());
+	}
+
+	// Check if the value is a string stored in InternedStrings
+	bool IsInterned() const
+	{
+		return mType == ClientAttributeType::T_STR && mSize == cInternedSize;
+	}
+
+
+private:
+
+	// Empty the storage and set the type
+	void Reset(ClientAttributeType type)
+	{
+		memset(mData, 0, sizeof(mData));
+		mSize = 0;
+		mType = type;
+	}
+
+	// Copy the storage of another attribute, without counting a reference
+	void Copy(const ClientAttribute& other)
+	{
+		memcpy(mData, other.mData, sizeof(mData));
+		mSize = other.mSize;
+		mType = other.mType;
+	}
+
+	// Store a string in place, or intern it
+	void SetString(const char* data, size_t length)
+	{
+		Reset(ClientAttributeType::T_STR);
+		if (length <= cInlineSize)
+		{
+			memcpy(mData, data, length);
+			mSize = uint8_t(length);
+		}
+		else
+		{
+			const InternedString* pString = InternedStrings::Get().Acquire(data, length);
+			memcpy(mData, &pString, sizeof(pString));
+			mSize = cInternedSize;
+		}
+	}
+
+	// Get the shared copy of an interned string
+	const InternedString* GetInterned() const
+	{
+		const InternedString* pString;
+		memcpy(&pString, mData, sizeof(pString));
+		return pString;
+	}
+
+
+private:
+
+	friend bool operator== (const ClientAttribute& lhs, const ClientAttribute& rhs);
+	friend struct ClientAttributeHash;
+
+	static const size_t                             cInlineSize = 14;
+	static const uint8_t                            cInternedSize = 0xFF;
+
+	// Value, inline string or interned string pointer, then string length and type
+	alignas(8) char                                 mData[cInlineSize];
+	uint8_t                                         mSize;
+	ClientAttributeType                             mType;
 
 };
 
+static_assert(sizeof(ClientAttribute) == 16, "ClientAttribute should fit in 16 bytes");
+
+
 // ClientAttribute operator ==
 inline bool operator== (const ClientAttribute& lhs, const ClientAttribute& rhs)
 {
-	if (lhs.type == rhs.type)
+	if (lhs.GetType() == rhs.GetType())
 	{
-		switch (lhs.type)
+		switch (lhs.GetType())
 		{
-			case ClientAttributeType::T_STR: return (lhs.s == rhs.s);
-			case ClientAttributeType::T_INT: return (lhs.i == rhs.i);
-			case ClientAttributeType::T_UNS: return (lhs.u == rhs.u);
-			case ClientAttributeType::T_DBL: return (lhs.d == rhs.d);
-			case ClientAttributeType::T_BOL: return (lhs.b == rhs.b);
+			case ClientAttributeType::T_STR: return (lhs.mSize == rhs.mSize && memcmp(lhs.mData, rhs.mData, sizeof(lhs.mData)) == 0);
+			case ClientAttributeType::T_INT: return (lhs.GetInt() == rhs.GetInt());
+			case ClientAttributeType::T_UNS: return (lhs.GetUnsigned() == rhs.GetUnsigned());
+			case ClientAttributeType::T_DBL: return (lhs.GetDouble() == rhs.GetDouble());
+			case ClientAttributeType::T_BOL: return (lhs.GetBool() == rhs.GetBool());
+			default:                         return false;
 		}
 	}
 	return false;
@@ -57,15 +211,21 @@ inline bool operator== (const ClientAttribute& lhs, const ClientAttribute& rhs)
 // ClientAttribute operator <
 inline bool operator< (const ClientAttribute& lhs, const ClientAttribute& rhs)
 {
-	if (lhs.type == rhs.type)
+	if (lhs.GetType() == rhs.GetType())
 	{
-		switch (lhs.type)
+		switch (lhs.GetType())
 		{
-			case ClientAttributeType::T_STR: return (lhs.s < rhs.s);
-			case ClientAttributeType::T_INT: return (lhs.i < rhs.i);
-			case ClientAttributeType::T_UNS: return (lhs.u < rhs.u);
-			case ClientAttributeType::T_DBL: return (lhs.d < rhs.d);
-			case ClientAttributeType::T_BOL: return (lhs.b < rhs.b);
+			case ClientAttributeType::T_STR:
+			{
+				size_t lhsLength = lhs.GetStringLength(), rhsLength = rhs.GetStringLength();
+				int order = memcmp(lhs.GetStringData(), rhs.GetStringData(), std::min(lhsLength, rhsLength));
+				return (order != 0) ? (order < 0) : (lhsLength < rhsLength);
+			}
+			case ClientAttributeType::T_INT: return (lhs.GetInt() < rhs.GetInt());
+			case ClientAttributeType::T_UNS: return (lhs.GetUnsigned() < rhs.GetUnsigned());
+			case ClientAttributeType::T_DBL: return (lhs.GetDouble() < rhs.GetDouble());
+			case ClientAttributeType::T_BOL: return (lhs.GetBool() < rhs.GetBool());
+			default:                         return false;
 		}
 	}
 	return false;
@@ -77,3 +237,117 @@ inline bool operator>  (const ClientAttribute& lhs, const ClientAttribute& rhs){
 inline bool operator<= (const ClientAttribute& lhs, const ClientAttribute& rhs){ return !(rhs <  lhs);}
 inline bool operator>= (const ClientAttribute& lhs, const ClientAttribute& rhs){ return !(lhs <  rhs);}
 
+
+// Hash of attributes, consistent with operator ==
+struct ClientAttributeHash
+{
+	size_t operator()(const ClientAttribute& attr) const
+	{
+		if (attr.GetType() == ClientAttributeType::T_DBL)
+		{
+			return std::hash<double>()(attr.GetDouble());
+		}
+		uint64_t low = 0, high = 0;
+		memcpy(&low, attr.mData, sizeof(low));
+		memcpy(&high, attr.mData + sizeof(low), sizeof(attr.mData) - sizeof(low));
+		high |= (uint64_t(attr.mSize) << 48) | (uint64_t(attr.mType) << 56);
+		uint64_t h = (low * 0x9E3779B97F4A7C15ULL) ^ (high * 0xC2B2AE3D27D4EB4FULL);
+		return size_t(h ^ (h >> 32));
+	}
+};
+
+
+/*-----------------------------------------------------------------------------
+	ClientAttributeMap class definition
+-----------------------------------------------------------------------------*/
+
+// Attributes of a client, sorted by key identifier
+class ClientAttributeMap
+{
+public:
+
+	using Entry = std::pair<AttributeKey, ClientAttribute>;
+
+
+	// Get the value of a key, or null
+	const ClientAttribute* Find(AttributeKey key) const
+	{
+		auto it = LowerBound(key);
+		return (it != mEntries.end() && it->first == key) ? &it->second : nullptr;
+	}
+
+	// Set the value of a key
+	void Set(AttributeKey key, const ClientAttribute& value)
+	{
+		auto it = LowerBound(key);
+		if (it != mEntries.end() && it->first == key)
+		{
+			it->second = value;
+		}
+		else
+		{
+			mEntries.insert(it, Entry(key, value));
+		}
+	}
+
+	// Move a value in for a key
+	void Set(AttributeKey key, ClientAttribute&& value)
+	{
+		auto it = LowerBound(key);
+		if (it != mEntries.end() && it->first == key)
+		{
+			it->second = std::move(value);
+		}
+		else
+		{
+			mEntries.insert(it, Entry(key, std::move(value)));
+		}
+	}
+
+	// Remove the value of a key, return false if it was missing
+	bool Erase(AttributeKey key)
+	{
+		auto it = LowerBound(key);
+		if (it != mEntries.end() && it->first == key)
+		{
+			mEntries.erase(it);
+			return true;
+		}
+		return false;
+	}
+
+	// Iterate on entries in key order
+	std::vector<Entry>::const_iterator begin() const
+	{
+		return mEntries.begin();
+	}
+	std::vector<Entry>::const_iterator end() const
+	{
+		return mEntries.end();
+	}
+
+	// Get the number of keys
+	size_t Size() const
+	{
+		return mEntries.size();
+	}
+
+
+private:
+
+	// Find the first entry not before a key
+	std::vector<Entry>::iterator LowerBound(AttributeKey key)
+	{
+		return std::lower_bound(mEntries.begin(), mEntries.end(), key, [](const Entry& entry, AttributeKey k) { return entry.first < k; });
+	}
+	std::vector<Entry>::const_iterator LowerBound(AttributeKey key) const
+	{
+		return std::lower_bound(mEntries.begin(), mEntries.end(), key, [](const Entry& entry, AttributeKey k) { return entry.first < k; });
+	}
+
+
+private:
+
+	std::vector<Entry>                              mEntries;
+
+};
@@ -0,0 +1,362 @@
+#include "clientsearch.h"
+#include <limits>
+#include <algorithm>
+
+
+/*-----------------------------------------------------------------------------
+	Constants
+-----------------------------------------------------------------------------*/
+
+// Selectivity assumed without statistics, for equalities and ranges, or inequalities
+static const double cDefaultSelectivity = 0.1;
+static const double cDefaultNotEqualSelectivity = 0.9;
+
+
+/*-----------------------------------------------------------------------------
+	Constructors
+-----------------------------------------------------------------------------*/
+
+ClientAttributeRange::ClientAttributeRange()
+	: mIsEmpty(false)
+	, mHasType(false)
+	, mType(ClientAttributeType::T_NONE)
+	, mHasLower(false)
+	, mLowerInclusive(true)
+	, mHasUpper(false)
+	, mUpperInclusive(true)
+{
+}
+
+AttributeStatistics::AttributeStatistics()
+	: mPresence(0)
+	, mDistinct(0)
+{
+}
+
+ClientSearchPlan::ClientSearchPlan(const std::vector<ClientSearchCriterion>& searchCriteria, const SearchStatistics& stats,
+	const std::set<std::string>& indexedKeys, size_t clientCount, int maxCount, bool hasColumns)
+	: access(ClientSearchAccess::T_SCAN)
+	, isEmpty(false)
+	, estimatedRows(0)
+	, estimatedCost(0)
+	, visitedClients(0)
+{
+	double count = double(clientCount);
+
+	// Combine the criteria on each key into a range, a search with an empty range has no results
+	std::map<std::string, ClientAttributeRange> keyRanges;
+	for (auto& crit : searchCriteria)
+	{
+		keyRanges[crit.key].Restrict(crit);
+	}
+	for (auto& keyRange : keyRanges)
+	{
+		if (keyRange.second.IsEmpty())
+		{
+			criteria = searchCriteria;
+			isEmpty = true;
+			return;
+		}
+	}
+
+	// Estimate the selectivity of each criterion, and of the search assuming independent keys
+	double selectivity = 1;
+	std::vector<std::pair<double, size_t>> order;
+	for (size_t i = 0; i < searchCriteria.size(); i++)
+	{
+		order.push_back(std::make_pair(stats.EstimateSelectivity(searchCriteria[i]), i));
+		if (searchCriteria[i].condition == ClientSearchCondition::T_NEQUAL)
+		{
+			selectivity *= order.back().first;
+		}
+	}
+	std::vector<std::pair<double, std::string>> indexCandidates;
+	for (auto& keyRange : keyRanges)
+	{
+		if (keyRange.second.IsSet())
+		{
+			double keySelectivity = stats.EstimateSelectivity(keyRange.first, keyRange.second);
+			selectivity *= keySelectivity;
+			if (indexedKeys.count(keyRange.first))
+			{
+				indexCandidates.push_back(std::make_pair(keySelectivity * count, keyRange.first));
+			}
+		}
+	}
+	estimatedRows = selectivity * count;
+
+	// Check the most selective criteria first, so that most clients fail early
+	std::stable_sort(order.begin(), order.end(), [](const std::pair<double, size_t>& lhs, const std::pair<double, size_t>& rhs)
+	{
+		return lhs.first < rhs.first;
+	});
+	for (auto& entry : order)
+	{
+		criteria.push_back(searchCriteria[entry.second]);
+	}
+
+	// Searches stop after maxCount results
+	double stopFraction = (estimatedRows > maxCount) ? (maxCount / estimatedRows) : 1.0;
+
+	// Scan records, or columns then only load the matching clients
+	estimatedCost = count * (cVisitCost + cLoadCost) * stopFraction;
+	if (hasColumns)
+	{
+		access = ClientSearchAccess::T_COLUMNS;
+		estimatedCost = count * cColumnCost * criteria.size() + std::min(estimatedRows, double(maxCount)) * cLoadCost;
+	}
+
+	// Probe the most selective index
+	std::sort(indexCandidates.begin(), indexCandidates.end());
+	if (indexCandidates.size())
+	{
+		double cost = indexCandidates[0].first * (cVisitCost + cLoadCost) * stopFraction;
+		if (cost < estimatedCost)
+		{
+			access = ClientSearchAccess::T_INDEX;
+			indexKeys.assign(1, indexCandidates[0].second);
+			estimatedCost = cost;
+		}
+	}
+
+	// Intersect the most selective indexes, only loading clients that are in all ranges
+	double mergeCost = 0;
+	double mergedRows = count;
+	for (size_t i = 0; i < indexCandidates.size(); i++)
+	{
+		mergeCost += indexCandidates[i].first * (cVisitCost + cMergeCost);
+		mergedRows *= (count > 0) ? (indexCandidates[i].first / count) : 0;
+
+		double cost = mergeCost + mergedRows * cLoadCost * stopFraction;
+		if (i > 0 && cost < estimatedCost)
+		{
+			access = ClientSearchAccess::T_INTERSECTION;
+			indexKeys.clear();
+			for (size_t j = 0; j <= i; j++)
+			{
+				indexKeys.push_back(indexCandidates[j].second);
+			}
+			estimatedCost = cost;
+		}
+	}
+
+	for (auto& key : indexKeys)
+	{
+		ranges.push_back(keyRanges[key]);
+	}
+}
+
+
+/*-----------------------------------------------------------------------------
+	Public interface
+-----------------------------------------------------------------------------*/
+
+bool ClientAttributeRange::Restrict(const ClientSearchCriterion& criterion)
+{
+	const ClientAttribute& value = criterion.value;
+	bool narrowLower = false, narrowUpper = false, inclusive = true;
+
+	switch (criterion.condition)
+	{
+		case ClientSearchCondition::T_EQUAL:      narrowLower = true; narrowUpper = true; break;
+		case ClientSearchCondition::T_GREATER:    narrowLower = true; inclusive = false;  break;
+		case ClientSearchCondition::T_GREATER_EQ: narrowLower = true;                     break;
+		case ClientSearchCondition::T_LESSER:     narrowUpper = true; inclusive = false;  break;
+		case ClientSearchCondition::T_LESSER_EQ:  narrowUpper = true;                     break;
+		case ClientSearchCondition::T_NEQUAL:     return false;
+	}
+
+	// Values of another type never match, and NaN compares with nothing
+	if ((mHasType && value.GetType() != mType) || value.GetType() == ClientAttributeType::T_NONE
+	 || (value.GetType() == ClientAttributeType::T_DBL && value.GetDouble() != value.GetDouble()))
+	{
+		mIsEmpty = true;
+		return true;
+	}
+	mHasType = true;
+	mType = value.GetType();
+
+	// Keep the tightest bounds
+	if (narrowLower)
+	{
+		if (!mHasLower || mLower < value)
+		{
+			mHasLower = true;
+			mLower = value;
+			mLowerInclusive = inclusive;
+		}
+		else if (mLower == value)
+		{
+			mLowerInclusive = mLowerInclusive && inclusive;
+		}
+	}
+	if (narrowUpper)
+	{
+		if (!mHasUpper || value < mUpper)
+		{
+			mHasUpper = true;
+			mUpper = value;
+			mUpperInclusive = inclusive;
+		}
+		else if (mUpper == value)
+		{
+			mUpperInclusive = mUpperInclusive && inclusive;
+		}
+	}
+
+	// Check that the bounds still leave room
+	if (mHasLower && mHasUpper)
+	{
+		if (mUpper < mLower || (mLower == mUpper && !(mLowerInclusive && mUpperInclusive)))
+		{
+			mIsEmpty = true;
+		}
+	}
+
+	return true;
+}
+
+bool ClientAttributeRange::Contains(const ClientAttribute& attr) const
+{
+	if (mIsEmpty || (mHasType && attr.GetType() != mType))
+	{
+		return false;
+	}
+	if (mHasLower && (mLowerInclusive ? (attr < mLower) : (attr <= mLower)))
+	{
+		return false;
+	}
+	if (mHasUpper && (mUpperInclusive ? (attr > mUpper) : (attr >= mUpper)))
+	{
+		return false;
+	}
+	return true;
+}
+
+
+void AttributeStatistics::Build(std::vector<ClientAttribute>& values, size_t sampleCount)
+{
+	mPresence = sampleCount ? (double(values.size()) / sampleCount) : 0;
+	mDistinct = 0;
+	mQuantiles.clear();
+
+	std::sort(values.begin(), values.end(), ClientAttributeOrder());
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		if (i == 0 || ClientAttributeOrder()(values[i - 1], values[i]))
+		{
+			mDistinct++;
+		}
+	}
+
+	// Equi-depth histogram : evenly spaced values of the sorted sample
+	if (values.size() <= cHistogramSize)
+	{
+		mQuantiles = values;
+	}
+	else
+	{
+		for (size_t i = 0; i < cHistogramSize; i++)
+		{
+			mQuantiles.push_back(values[i * (values.size() - 1) / (cHistogramSize - 1)]);
+		}
+	}
+}
+
+double AttributeStatistics::EstimateSelectivity(const ClientSearchCriterion& criterion) const
+{
+	if (criterion.condition == ClientSearchCondition::T_NEQUAL)
+	{
+		return mPresence * (1.0 - EstimateEqualFraction(criterion.value));
+	}
+
+	ClientAttributeRange range;
+	range.Restrict(criterion);
+	return EstimateSelectivity(range);
+}
+
+double AttributeStatistics::EstimateSelectivity(const ClientAttributeRange& range) const
+{
+	if (range.IsEmpty() || mQuantiles.empty())
+	{
+		return 0;
+	}
+	else if (!range.IsSet())
+	{
+		return mPresence;
+	}
+	else if (range.GetSingleValue())
+	{
+		return mPresence * EstimateEqualFraction(*range.GetSingleValue());
+	}
+
+	// Fraction of the histogram in range, at least half a bucket
+	size_t matches = std::count_if(mQuantiles.begin(), mQuantiles.end(), [&](const ClientAttribute& value)
+	{
+		return range.Contains(value);
+	});
+	return mPresence * std::max(double(matches), 0.5) / mQuantiles.size();
+}
+
+double SearchStatistics::EstimateSelectivity(const ClientSearchCriterion& criterion) const
+{
+	if (sampleCount == 0)
+	{
+		return (criterion.condition == ClientSearchCondition::T_NEQUAL) ? cDefaultNotEqualSelectivity : cDefaultSelectivity;
+	}
+
+	auto it = keys.find(criterion.key);
+	return (it != keys.end()) ? it->second.EstimateSelectivity(criterion) : (0.5 / sampleCount);
+}
+
+double SearchStatistics::EstimateSelectivity(const std::string& key, const ClientAttributeRange& range) const
+{
+	if (sampleCount == 0)
+	{
+		return cDefaultSelectivity;
+	}
+
+	auto it = keys.find(key);
+	return (it != keys.end()) ? it->second.EstimateSelectivity(range) : (0.5 / sampleCount);
+}
+
+const char* ClientSearchPlan::GetAccessName() const
+{
+	switch (access)
+	{
+		case ClientSearchAccess::T_COLUMNS:      return "columns";
+		case ClientSearchAccess::T_INDEX:        return "index";
+		case ClientSearchAccess::T_INTERSECTION: return "intersection";
+		default:                                 return "scan";
+	}
+}
+
+
+/*-----------------------------------------------------------------------------
+	Private methods
+-----------------------------------------------------------------------------*/
+
+double AttributeStatistics::EstimateEqualFraction(const ClientAttribute& value) const
+{
+	if (mQuantiles.empty())
+	{
+		return 0;
+	}
+
+	// Frequent values span buckets, others are assumed uniformly distributed
+	size_t matches = std::count(mQuantiles.begin(), mQuantiles.end(), value);
+	return std::max(double(matches) / mQuantiles.size(), 1.0 / mDistinct);
+}
+
+ClientAttribute ClientAttributeRange::GetTypeMinimum() const
+{
+	switch (mType)
+	{
+		case ClientAttributeType::T_STR: return ClientAttribute(std::string());
+		case ClientAttributeType::T_INT: return ClientAttribute(std::numeric_limits<int>::min());
+		case ClientAttributeType::T_UNS: return ClientAttribute(0u);
+		case ClientAttributeType::T_DBL: return ClientAttribute(-std::numeric_limits<double>::infinity());
+		case ClientAttributeType::T_BOL: return ClientAttribute(false);
+		default:                         return ClientAttribute();
+	}
+}
@@ -0,0 +1,323 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <memory>
+#include <utility>
+#include "clientattribute.h"
+
+class ClientRecord;
+
+
+/*-----------------------------------------------------------------------------
+	Search types
+-----------------------------------------------------------------------------*/
+
+// Search criteria
+enum class ClientSearchCondition { T_EQUAL = 0, T_NEQUAL, T_LESSER, T_GREATER, T_LESSER_EQ, T_GREATER_EQ };
+
+// Criteria for a search
+class ClientSearchCriterion
+{
+public:
+
+	// The key is resolved here : a key that no client had yet matches no client
+	ClientSearchCriterion(const std::string& k, const ClientAttribute& v, ClientSearchCondition c)
+		: key(k)
+		, keyId(AttributeKeys::Get().Find(k))
+		, value(v)
+		, condition(c)
+	{}
+
+	// Check if an attribute value matches this criterion : only inequality holds between different types
+	bool Matches(const ClientAttribute& attr) const
+	{
+		switch (condition)
+		{
+			case ClientSearchCondition::T_EQUAL:      return (attr == value);
+			case ClientSearchCondition::T_NEQUAL:     return (attr != value);
+			case ClientSearchCondition::T_LESSER:     return (attr <  value);
+			case ClientSearchCondition::T_GREATER:    return (attr >  value);
+			case ClientSearchCondition::T_LESSER_EQ:  return (attr.GetType() == value.GetType()) && (attr <= value);
+			case ClientSearchCondition::T_GREATER_EQ: return (attr.GetType() == value.GetType()) && (attr >= value);
+		}
+		return false;
+	}
+
+public:
+
+	std::string                                     key;
+	AttributeKey                                    keyId;
+	ClientAttribute                                 value;
+	ClientSearchCondition                           condition;
+
+};
+
+
+// Total order on attributes of any type : by type first, then by value
+struct ClientAttributeOrder
+{
+	bool operator()(const ClientAttribute& lhs, const ClientAttribute& rhs) const
+	{
+		return (lhs.GetType() != rhs.GetType()) ? (lhs.GetType() < rhs.GetType()) : (lhs < rhs);
+	}
+};
+
+
+// Interval of attribute values of a single type, built from criteria on one key
+class ClientAttributeRange
+{
+public:
+
+	ClientAttributeRange();
+
+	// Narrow the range with a criterion, return false if the criterion is not a range (T_NEQUAL)
+	bool Restrict(const ClientSearchCriterion& criterion);
+
+	// Check if an attribute value is in the range
+	bool Contains(const ClientAttribute& attr) const;
+
+	// Check if no value can be in the range
+	bool IsEmpty() const
+	{
+		return mIsEmpty;
+	}
+
+	// Check if the range was restricted at all
+	bool IsSet() const
+	{
+		return mHasType;
+	}
+
+	// Get the only value in the range, or null if it has several
+	const ClientAttribute* GetSingleValue() const
+	{
+		bool isSingle = !mIsEmpty && mHasLower && mHasUpper && mLowerInclusive && mUpperInclusive && mLower == mUpper;
+		return isSingle ? &mLower : nullptr;
+	}
+
+
+private:
+
+	// Lowest value of the range's type, from which the range starts when it has no lower bound
+	ClientAttribute GetTypeMinimum() const;
+
+
+private:
+
+	friend class AttributeIndex;
+
+	bool                                            mIsEmpty;
+	bool                                            mHasType;
+	ClientAttributeType                             mType;
+
+	bool                                            mHasLower;
+	bool                                            mLowerInclusive;
+	ClientAttribute                                 mLower;
+
+	bool                                            mHasUpper;
+	bool                                            mUpperInclusive;
+	ClientAttribute                                 mUpper;
+
+};
+
+
+/*-----------------------------------------------------------------------------
+	AttributeIndex class definition
+-----------------------------------------------------------------------------*/
+
+// Sorted index of the clients of a shard by the value of one attribute
+class AttributeIndex
+{
+public:
+
+	using Entry = std::pair<ClientAttribute, std::shared_ptr<ClientRecord>>;
+
+
+	// Add a client with a value
+	void Insert(const ClientAttribute& value, const std::shared_ptr<ClientRecord>& record)
+	{
+		mEntries.insert(Entry(value, record));
+	}
+
+	// Remove a client with a value
+	void Erase(const ClientAttribute& value, const std::shared_ptr<ClientRecord>& record)
+	{
+		mEntries.erase(Entry(value, record));
+	}
+
+	// Call a function on each client with a value in range
+	template<typename Function>
+	void ForEachInRange(const ClientAttributeRange& range, Function function) const
+	{
+		if (range.IsEmpty() || !range.IsSet())
+		{
+			return;
+		}
+
+		// Start at the lower bound, or at the first value of the range's type
+		auto it = mEntries.lower_bound(Entry(range.mHasLower ? range.mLower : range.GetTypeMinimum(), nullptr));
+
+		for (; it != mEntries.end() && it->first.GetType() == range.mType; it++)
+		{
+			if (range.mHasLower && !range.mLowerInclusive && it->first == range.mLower)
+			{
+				continue;
+			}
+			if (range.mHasUpper && (range.mUpperInclusive ? (it->first > range.mUpper) : (it->first >= range.mUpper)))
+			{
+				break;
+			}
+			function(it->second);
+		}
+	}
+
+	// Get the number of clients
+	size_t Size() const
+	{
+		return mEntries.size();
+	}
+
+
+private:
+
+	// Entries are ordered by value, then by record address
+	struct EntryOrder
+	{
+		bool operator()(const Entry& lhs, const Entry& rhs) const
+		{
+			if (ClientAttributeOrder()(lhs.first, rhs.first))
+			{
+				return true;
+			}
+			else if (ClientAttributeOrder()(rhs.first, lhs.first))
+			{
+				return false;
+			}
+			return std::less<ClientRecord*>()(lhs.second.get(), rhs.second.get());
+		}
+	};
+
+
+private:
+
+	std::set<Entry, EntryOrder>                     mEntries;
+
+};
+
+
+/*-----------------------------------------------------------------------------
+	Search statistics
+-----------------------------------------------------------------------------*/
+
+// Distribution of the values of an attribute key, from a sample of clients
+class AttributeStatistics
+{
+public:
+
+	AttributeStatistics();
+
+	// Build from the values of the sampled clients that had the key, among sampleCount clients
+	void Build(std::vector<ClientAttribute>& values, size_t sampleCount);
+
+	// Estimate the fraction of all clients matching a criterion
+	double EstimateSelectivity(const ClientSearchCriterion& criterion) const;
+
+	// Estimate the fraction of all clients with a value in range
+	double EstimateSelectivity(const ClientAttributeRange& range) const;
+
+
+private:
+
+	// Estimate the fraction of clients having the key that are equal to a value
+	double EstimateEqualFraction(const ClientAttribute& value) const;
+
+
+private:
+
+	double                                          mPresence;
+	size_t                                          mDistinct;
+	std::vector<ClientAttribute>                    mQuantiles;
+
+	static const size_t                             cHistogramSize = 128;
+
+};
+
+
+// Statistics for all attribute keys
+class SearchStatistics
+{
+public:
+
+	SearchStatistics()
+		: sampleCount(0)
+	{}
+
+	// Estimate the fraction of all clients matching a criterion
+	double EstimateSelectivity(const ClientSearchCriterion& criterion) const;
+
+	// Estimate the fraction of all clients with a value in range for a key
+	double EstimateSelectivity(const std::string& key, const ClientAttributeRange& range) const;
+
+public:
+
+	size_t                                          sampleCount;
+	std::map<std::string, AttributeStatistics>      keys;
+
+};
+
+
+/*-----------------------------------------------------------------------------
+	ClientSearchPlan class definition
+-----------------------------------------------------------------------------*/
+
+// How a search finds its candidate clients
+enum class ClientSearchAccess { T_SCAN = 0, T_COLUMNS, T_INDEX, T_INTERSECTION };
+
+
+// Execution plan for a search : candidate clients come from a scan of records or columns, an index range
+// or the intersection of several index ranges, then are checked against criteria, most selective first.
+class ClientSearchPlan
+{
+public:
+
+	ClientSearchPlan()
+		: access(ClientSearchAccess::T_SCAN)
+		, isEmpty(false)
+		, estimatedRows(0)
+		, estimatedCost(0)
+		, visitedClients(0)
+	{}
+
+	// Plan a search with statistics, among the indexed keys, scanning columns instead of records if hasColumns
+	ClientSearchPlan(const std::vector<ClientSearchCriterion>& searchCriteria, const SearchStatistics& stats,
+		const std::set<std::string>& indexedKeys, size_t clientCount, int maxCount, bool hasColumns = false);
+
+	// Get the name of the access method
+	const char* GetAccessName() const;
+
+public:
+
+	ClientSearchAccess                              access;
+	std::vector<ClientSearchCriterion>              criteria;
+	std::vector<std::string>                        indexKeys;
+	std::vector<ClientAttributeRange>               ranges;
+
+	bool                                            isEmpty;
+	double                                          estimatedRows;
+	double                                          estimatedCost;
+	size_t                                          visitedClients;
+
+
+private:
+
+	// Relative costs, per client, of iterating an index, of loading and checking a snapshot,
+	// of collecting and merging candidates for an intersection, and of checking a criterion in columns
+	static constexpr double                         cVisitCost = 0.25;
+	static constexpr double                         cLoadCost = 1.0;
+	static constexpr double                         cMergeCost = 0.05;
+	static constexpr double                         cColumnCost = 0.002;
+
+};
@@ -0,0 +1,456 @@
+#include "columnstore.h"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define ECHORAM_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define ECHORAM_AVX2 1
+#include <immintrin.h>
+#endif
+
+
+/*-----------------------------------------------------------------------------
+	Comparison kernels
+-----------------------------------------------------------------------------*/
+
+// Comparisons computed by kernels, others are their negation
+enum CompareOp { C_EQUAL = 0, C_LESSER, C_GREATER, C_COUNT };
+
+// Compare 64 values with a value, return the bitmap of the matching values
+using IntegerKernel = uint64_t(*)(const int32_t* values, int32_t value);
+using DoubleKernel = uint64_t(*)(const double* values, double value);
+
+// Kernels for an instruction set
+struct ColumnKernels
+{
+	IntegerKernel                                   integer[C_COUNT];
+	DoubleKernel                                    real[C_COUNT];
+	const char*                                     name;
+};
+
+
+// Portable kernels
+template<int Op, typename T>
+static uint64_t CompareScalar(const T* values, T value)
+{
+	uint64_t bits = 0;
+	for (int i = 0; i < 64; i++)
+	{
+		bool match = (Op == C_EQUAL) ? (values[i] == value) : ((Op == C_LESSER) ? (values[i] < value) : (values[i] > value));
+		bits |= uint64_t(match) << i;
+	}
+	return bits;
+}
+
+
+#ifdef ECHORAM_SSE2
+
+// SSE2 kernels, 4 integers or 2 doubles at a time
+template<int Op>
+static uint64_t CompareIntegerSSE2(const int32_t* values, int32_t value)
+{
+	__m128i reference = _mm_set1_epi32(value);
+	uint64_t bits = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + 4 * i));
+		__m128i m = (Op == C_EQUAL) ? _mm_cmpeq_epi32(v, reference) : ((Op == C_LESSER) ? _mm_cmplt_epi32(v, reference) : _mm_cmpgt_epi32(v, reference));
+		bits |= uint64_t(_mm_movemask_ps(_mm_castsi128_ps(m))) << (4 * i);
+	}
+	return bits;
+}
+
+template<int Op>
+static uint64_t CompareDoubleSSE2(const double* values, double value)
+{
+	__m128d reference = _mm_set1_pd(value);
+	uint64_t bits = 0;
+	for (int i = 0; i < 32; i++)
+	{
+		__m128d v = _mm_loadu_pd(values + 2 * i);
+		__m128d m = (Op == C_EQUAL) ? _mm_cmpeq_pd(v, reference) : ((Op == C_LESSER) ? _mm_cmplt_pd(v, reference) : _mm_cmpgt_pd(v, reference));
+		bits |= uint64_t(_mm_movemask_pd(m)) << (2 * i);
+	}
+	return bits;
+}
+
+#endif
+
+
+#ifdef ECHORAM_AVX2
+
+// AVX2 kernels, 8 integers or 4 doubles at a time
+template<int Op>
+__attribute__((target("avx2")))
+static uint64_t CompareIntegerAVX2(const int32_t* values, int32_t value)
+{
+	__m256i reference = _mm256_set1_epi32(value);
+	uint64_t bits = 0;
+	for (int i = 0; i < 8; i++)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + 8 * i));
+		__m256i m = (Op == C_EQUAL) ? _mm256_cmpeq_epi32(v, reference) : ((Op == C_LESSER) ? _mm256_cmpgt_epi32(reference, v) : _mm256_cmpgt_epi32(v, reference));
+		bits |= uint64_t(uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(m)))) << (8 * i);
+	}
+	return bits;
+}
+
+template<int Op>
+__attribute__((target("avx2")))
+static uint64_t CompareDoubleAVX2(const double* values, double value)
+{
+	__m256d reference = _mm256_set1_pd(value);
+	uint64_t bits = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		__m256d v = _mm256_loadu_pd(values + 4 * i);
+		__m256d m = (Op == C_EQUAL) ? _mm256_cmp_pd(v, reference, _CMP_EQ_OQ) : ((Op == C_LESSER) ? _mm256_cmp_pd(v, reference, _CMP_LT_OQ) : _mm256_cmp_pd(v, reference, _CMP_GT_OQ));
+		bits |= uint64_t(uint32_t(_mm256_movemask_pd(m))) << (4 * i);
+	}
+	return bits;
+}
+
+#endif
+
+
+// Pick the best kernels for this CPU
+static ColumnKernels SelectKernels()
+{
+#ifdef ECHORAM_AVX2
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return ColumnKernels
+		{
+			{ CompareIntegerAVX2<C_EQUAL>, CompareIntegerAVX2<C_LESSER>, CompareIntegerAVX2<C_GREATER> },
+			{ CompareDoubleAVX2<C_EQUAL>, CompareDoubleAVX2<C_LESSER>, CompareDoubleAVX2<C_GREATER> },
+			"AVX2"
+		};
+	}
+#endif
+
+#ifdef ECHORAM_SSE2
+	return ColumnKernels
+	{
+		{ CompareIntegerSSE2<C_EQUAL>, CompareIntegerSSE2<C_LESSER>, CompareIntegerSSE2<C_GREATER> },
+		{ CompareDoubleSSE2<C_EQUAL>, CompareDoubleSSE2<C_LESSER>, CompareDoubleSSE2<C_GREATER> },
+		"SSE2"
+	};
+#else
+	return ColumnKernels
+	{
+		{ CompareScalar<C_EQUAL, int32_t>, CompareScalar<C_LESSER, int32_t>, CompareScalar<C_GREATER, int32_t> },
+		{ CompareScalar<C_EQUAL, double>, CompareScalar<C_LESSER, double>, CompareScalar<C_GREATER, double> },
+		"scalar"
+	};
+#endif
+}
+
+static const ColumnKernels& GetKernels()
+{
+	static const ColumnKernels sKernels = SelectKernels();
+	return sKernels;
+}
+
+
+/*-----------------------------------------------------------------------------
+	AttributeColumn
+-----------------------------------------------------------------------------*/
+
+TypedColumn<int32_t>* AttributeColumn::GetIntegerColumn(ClientAttributeType type)
+{
+	return const_cast<TypedColumn<int32_t>*>(static_cast<const AttributeColumn*>(this)->GetIntegerColumn(type));
+}
+
+const TypedColumn<int32_t>* AttributeColumn::GetIntegerColumn(ClientAttributeType type) const
+{
+	switch (type)
+	{
+		case ClientAttributeType::T_STR: return &strings;
+		case ClientAttributeType::T_INT: return &integers;
+		case ClientAttributeType::T_UNS: return &unsignedIntegers;
+		case ClientAttributeType::T_BOL: return &booleans;
+		default:                         return nullptr;
+	}
+}
+
+int32_t AttributeColumn::FindString(const ClientAttribute& value) const
+{
+	auto it = codes.find(value);
+	return (it != codes.end()) ? it->second : -1;
+}
+
+int32_t AttributeColumn::AddString(const ClientAttribute& value)
+{
+	auto it = codes.find(value);
+	if (it != codes.end())
+	{
+		dictionaryUses[it->second]++;
+		return it->second;
+	}
+
+	// Reuse a free code if possible
+	int32_t code;
+	if (freeCodes.size())
+	{
+		code = freeCodes.back();
+		freeCodes.pop_back();
+		dictionary[code] = value;
+		dictionaryUses[code] = 1;
+	}
+	else
+	{
+		code = int32_t(dictionary.size());
+		dictionary.push_back(value);
+		dictionaryUses.push_back(1);
+	}
+
+	codes[value] = code;
+	return code;
+}
+
+void AttributeColumn::ReleaseString(int32_t code)
+{
+	if (--dictionaryUses[code] == 0)
+	{
+		codes.erase(dictionary[code]);
+		dictionary[code] = ClientAttribute();
+		freeCodes.push_back(code);
+	}
+}
+
+
+/*-----------------------------------------------------------------------------
+	Public interface
+-----------------------------------------------------------------------------*/
+
+size_t ColumnStore::AddRow(const std::shared_ptr<ClientRecord>& record)
+{
+	mRows.push_back(record);
+	return mRows.size() - 1;
+}
+
+std::shared_ptr<ClientRecord> ColumnStore::RemoveRow(size_t row)
+{
+	size_t last = mRows.size() - 1;
+
+	for (auto& column : mColumns)
+	{
+		ClearValue(column.second, row);
+		if (row != last)
+		{
+			MoveValue(column.second, last, row);
+		}
+	}
+
+	mRows[row] = mRows[last];
+	mRows.pop_back();
+	return (row != last) ? mRows[row] : nullptr;
+}
+
+void ColumnStore::SetValue(size_t row, AttributeKey key, const ClientAttribute* pValue)
+{
+	auto it = mColumns.find(key);
+	if (it == mColumns.end())
+	{
+		if (pValue == nullptr)
+		{
+			return;
+		}
+		it = mColumns.insert(std::make_pair(key, AttributeColumn())).first;
+	}
+
+	AttributeColumn& column = it->second;
+	ClearValue(column, row);
+
+	if (pValue)
+	{
+		switch (pValue->GetType())
+		{
+			case ClientAttributeType::T_STR: column.strings.Set(row, column.AddString(*pValue));                       break;
+			case ClientAttributeType::T_INT: column.integers.Set(row, pValue->GetInt());                               break;
+			case ClientAttributeType::T_UNS: column.unsignedIntegers.Set(row, int32_t(pValue->GetUnsigned() ^ 0x80000000u)); break;
+			case ClientAttributeType::T_DBL: column.doubles.Set(row, pValue->GetDouble());                             break;
+			case ClientAttributeType::T_BOL: column.booleans.Set(row, pValue->GetBool() ? 1 : 0);                      break;
+			default:                                                                                                   break;
+		}
+	}
+}
+
+void ColumnStore::Select(const std::vector<ClientSearchCriterion>& criteria, std::vector<uint64_t>& selection) const
+{
+	// Start with all rows
+	size_t words = (mRows.size() + 63) / 64;
+	selection.assign(words, ~0ULL);
+	if (mRows.size() % 64)
+	{
+		selection.back() = (1ULL << (mRows.size() % 64)) - 1;
+	}
+
+	// Narrow the selection with each criterion
+	for (auto& crit : criteria)
+	{
+		Match(crit, selection);
+	}
+}
+
+const char* ColumnStore::GetInstructionSet()
+{
+	return GetKernels().name;
+}
+
+
+/*-----------------------------------------------------------------------------
+	Private methods
+-----------------------------------------------------------------------------*/
+
+void ColumnStore::ClearValue(AttributeColumn& column, size_t row)
+{
+	if (column.strings.IsSet(row))
+	{
+		column.ReleaseString(column.strings.values[row]);
+	}
+
+	column.strings.Clear(row);
+	column.integers.Clear(row);
+	column.unsignedIntegers.Clear(row);
+	column.doubles.Clear(row);
+	column.booleans.Clear(row);
+}
+
+void ColumnStore::MoveValue(AttributeColumn& column, size_t from, size_t to)
+{
+	for (ClientAttributeType type : { ClientAttributeType::T_STR, ClientAttributeType::T_INT, ClientAttributeType::T_UNS, ClientAttributeType::T_BOL })
+	{
+		TypedColumn<int32_t>& typed = *column.GetIntegerColumn(type);
+		if (typed.IsSet(from))
+		{
+			typed.Set(to, typed.values[from]);
+			typed.Clear(from);
+		}
+	}
+
+	if (column.doubles.IsSet(from))
+	{
+		column.doubles.Set(to, column.doubles.values[from]);
+		column.doubles.Clear(from);
+	}
+}
+
+void ColumnStore::Match(const ClientSearchCriterion& criterion, std::vector<uint64_t>& selection) const
+{
+	// Only inequality matches clients without the key
+	auto columnIt = mColumns.find(criterion.keyId);
+	if (columnIt == mColumns.end())
+	{
+		std::fill(selection.begin(), selection.end(), 0);
+		return;
+	}
+	const AttributeColumn& column = columnIt->second;
+	const ClientAttribute& value = criterion.value;
+
+	// Kernels compute ==, < and >, other conditions are negations
+	int op = C_EQUAL;
+	bool isNegated = false;
+	switch (criterion.condition)
+	{
+		case ClientSearchCondition::T_EQUAL:      op = C_EQUAL;                     break;
+		case ClientSearchCondition::T_NEQUAL:     op = C_EQUAL;   isNegated = true; break;
+		case ClientSearchCondition::T_LESSER:     op = C_LESSER;                    break;
+		case ClientSearchCondition::T_GREATER:    op = C_GREATER;                   break;
+		case ClientSearchCondition::T_LESSER_EQ:  op = C_GREATER; isNegated = true; break;
+		case ClientSearchCondition::T_GREATER_EQ: op = C_LESSER;  isNegated = true; break;
+	}
+	bool isNotEqual = (criterion.condition == ClientSearchCondition::T_NEQUAL);
+
+	// Find the column of the value's type, and the kernel input
+	const TypedColumn<int32_t>* pIntegers = column.GetIntegerColumn(value.GetType());
+	const std::vector<uint64_t>* pPresence = nullptr;
+	int32_t integerValue = 0;
+	bool isStringRange = false;
+	std::vector<bool> codeMatches;
+
+	switch (value.GetType())
+	{
+		case ClientAttributeType::T_STR:
+		{
+			// Strings codes are not ordered : ranges check the code of each selected row
+			if (op == C_EQUAL)
+			{
+				integerValue = column.FindString(value);
+				pPresence = (integerValue >= 0) ? &pIntegers->presence : nullptr;
+			}
+			else
+			{
+				isStringRange = true;
+				pPresence = &pIntegers->presence;
+				codeMatches.resize(column.dictionary.size());
+				for (size_t code = 0; code < column.dictionary.size(); code++)
+				{
+					codeMatches[code] = criterion.Matches(column.dictionary[code]);
+				}
+			}
+			break;
+		}
+		case ClientAttributeType::T_INT: integerValue = value.GetInt();                             pPresence = &pIntegers->presence;      break;
+		case ClientAttributeType::T_UNS: integerValue = int32_t(value.GetUnsigned() ^ 0x80000000u); pPresence = &pIntegers->presence;      break;
+		case ClientAttributeType::T_BOL: integerValue = value.GetBool() ? 1 : 0;                    pPresence = &pIntegers->presence;      break;
+		case ClientAttributeType::T_DBL:                                                            pPresence = &column.doubles.presence;  break;
+		default:                                                                                                                           break;
+	}
+
+	const ColumnKernels& kernels = GetKernels();
+	for (size_t w = 0; w < selection.size(); w++)
+	{
+		if (selection[w] == 0)
+		{
+			continue;
+		}
+
+		// Rows that have a value of the criterion's type, and those of them that compare true
+		uint64_t typed = (pPresence && w < pPresence->size()) ? (*pPresence)[w] : 0;
+		uint64_t compared = 0;
+		if (typed & selection[w])
+		{
+			if (isStringRange)
+			{
+				for (uint64_t bits = typed & selection[w]; bits; bits &= bits - 1)
+				{
+					size_t row = w * 64 + ColumnStore::CountTrailingZeros(bits);
+					compared |= uint64_t(codeMatches[pIntegers->values[row]]) << (row % 64);
+				}
+			}
+			else if (value.GetType() == ClientAttributeType::T_DBL)
+			{
+				compared = kernels.real[op](&column.doubles.values[w * 64], value.GetDouble());
+			}
+			else
+			{
+				compared = kernels.integer[op](&pIntegers->values[w * 64], integerValue);
+			}
+
+			if (isNegated && !isStringRange)
+			{
+				compared = ~compared;
+			}
+		}
+
+		// Inequality also matches values of other types
+		if (isNotEqual)
+		{
+			uint64_t any = 0;
+			for (auto* pTyped : { &column.strings, &column.integers, &column.unsignedIntegers, &column.booleans })
+			{
+				any |= (w < pTyped->presence.size()) ? pTyped->presence[w] : 0;
+			}
+			any |= (w < column.doubles.presence.size()) ? column.doubles.presence[w] : 0;
+			selection[w] &= (any & ~typed) | (typed & compared);
+		}
+		else
+		{
+			selection[w] &= typed & compared;
+		}
+	}
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <unordered_map>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include "clientsearch.h"
+
+class ClientRecord;
+
+
+/*-----------------------------------------------------------------------------
+	Column types
+-----------------------------------------------------------------------------*/
+
+// Dense values of one type for all rows, with a bitmap of the rows that have a value.
+// Vectors grow by whole 64-row words, rows past their end have no value.
+template<typename T>
+class TypedColumn
+{
+public:
+
+	// Check if a row has a value
+	bool IsSet(size_t row) const
+	{
+		return (row / 64 < presence.size()) && (presence[row / 64] & (1ULL << (row % 64)));
+	}
+
+	// Set the value of a row
+	void Set(size_t row, T value)
+	{
+		if (row >= values.size())
+		{
+			values.resize((row / 64 + 1) * 64, T());
+			presence.resize(row / 64 + 1, 0);
+		}
+		values[row] = value;
+		presence[row / 64] |= (1ULL << (row % 64));
+	}
+
+	// Remove the value of a row
+	void Clear(size_t row)
+	{
+		if (row / 64 < presence.size())
+		{
+			presence[row / 64] &= ~(1ULL << (row % 64));
+		}
+	}
+
+public:
+
+	std::vector<T>                                  values;
+	std::vector<uint64_t>                           presence;
+
+};
+
+
+// All values of an attribute key. Values of each type are in their own column, encoded so that
+// numeric comparisons can run on whole words of rows : unsigned integers are offset into signed
+// ones, booleans are 0 or 1, and strings are codes in a dictionary.
+class AttributeColumn
+{
+public:
+
+	// Get the column holding values of a type, encoded as integers, or null
+	TypedColumn<int32_t>* GetIntegerColumn(ClientAttributeType type);
+	const TypedColumn<int32_t>* GetIntegerColumn(ClientAttributeType type) const;
+
+	// Get the dictionary code of a string, or -1 if no row has it
+	int32_t FindString(const ClientAttribute& value) const;
+
+	// Get the code of a string, adding it to the dictionary, and count one more use
+	int32_t AddString(const ClientAttribute& value);
+
+	// Count one less use of a string code, freeing it when unused
+	void ReleaseString(int32_t code);
+
+public:
+
+	TypedColumn<int32_t>                            strings;
+	TypedColumn<int32_t>                            integers;
+	TypedColumn<int32_t>                            unsignedIntegers;
+	TypedColumn<double>                             doubles;
+	TypedColumn<int32_t>                            booleans;
+
+	std::vector<ClientAttribute>                    dictionary;
+	std::vector<uint32_t>                           dictionaryUses;
+	std::vector<int32_t>                            freeCodes;
+	std::unordered_map<ClientAttribute, int32_t, ClientAttributeHash> codes;
+
+};
+
+
+/*-----------------------------------------------------------------------------
+	ColumnStore class definition
+-----------------------------------------------------------------------------*/
+
+// Column-oriented copy of the attributes of the clients of a shard, for fast scans.
+// Clients occupy dense rows : removing one moves the last row into its place.
+class ColumnStore
+{
+public:
+
+	// Add a client without attributes, return its row
+	size_t AddRow(const std::shared_ptr<ClientRecord>& record);
+
+	// Remove the client of a row, return the client moved into this row, or null
+	std::shared_ptr<ClientRecord> RemoveRow(size_t row);
+
+	// Set or remove, if pValue is null, the value of an attribute for a row
+	void SetValue(size_t row, AttributeKey key, const ClientAttribute* pValue);
+
+	// Compute the bitmap of the rows matching all criteria
+	void Select(const std::vector<ClientSearchCriterion>& criteria, std::vector<uint64_t>& selection) const;
+
+	// Call a function on the client of each selected row
+	template<typename Function>
+	void ForEachSelected(const std::vector<uint64_t>& selection, Function function) const
+	{
+		for (size_t w = 0; w < selection.size(); w++)
+		{
+			for (uint64_t bits = selection[w]; bits; bits &= bits - 1)
+			{
+				function(mRows[w * 64 + CountTrailingZeros(bits)]);
+			}
+		}
+	}
+
+	// Get the number of rows
+	size_t GetRowCount() const
+	{
+		return mRows.size();
+	}
+
+	// Get the name of the instruction set used for scans
+	static const char* GetInstructionSet();
+
+	// Get the index of the lowest set bit
+	static size_t CountTrailingZeros(uint64_t bits)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, bits);
+		return index;
+#else
+		return __builtin_ctzll(bits);
+#endif
+	}
+
+
+private:
+
+	// Remove the value of a row from all columns of a key
+	void ClearValue(AttributeColumn& column, size_t row);
+
+	// Move the value of a row into another row, in all columns of a key
+	void MoveValue(AttributeColumn& column, size_t from, size_t to);
+
+	// Compute the bitmap of the rows matching a criterion, only for the words set in selection
+	void Match(const ClientSearchCriterion& criterion, std::vector<uint64_t>& selection) const;
+
+
+private:
+
+	std::vector<std::shared_ptr<ClientRecord>>      mRows;
+	std::map<AttributeKey, AttributeColumn>         mColumns;
+
+};
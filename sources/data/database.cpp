@@ -1,25 +1,230 @@
 #include "database.h"
+#include "jsonwriter.h"
 #include <iostream>
 #include <cassert>
+#include <algorithm>
+#include <functional>
+
+
+/*-----------------------------------------------------------------------------
+	Helpers
+-----------------------------------------------------------------------------*/
+
+// Get the value a client is indexed with, or null if it can't be ordered
+static const ClientAttribute* GetIndexedValue(const ClientAttribute* pValue)
+{
+	if (pValue && pValue->GetType() != ClientAttributeType::T_NONE
+	 && !(pValue->GetType() == ClientAttributeType::T_DBL && pValue->GetDouble() != pValue->GetDouble()))
+	{
+		return pValue;
+	}
+	return nullptr;
+}
+
+// Get the value a client is indexed with for an attribute key, or null if it has none that can be ordered
+static const ClientAttribute* GetIndexedValue(const ClientData* pData, AttributeKey key)
+{
+	return GetIndexedValue(pData ? pData->attributes.Find(key) : nullptr);
+}
+
+// Check if an attribute is a number
+static bool IsNumber(const ClientAttribute& value)
+{
+	ClientAttributeType type = value.GetType();
+	return type == ClientAttributeType::T_INT || type == ClientAttributeType::T_UNS || type == ClientAttributeType::T_DBL;
+}
+
+// Get a number attribute as a double
+static double GetNumber(const ClientAttribute& value)
+{
+	switch (value.GetType())
+	{
+		case ClientAttributeType::T_INT: return value.GetInt();
+		case ClientAttributeType::T_UNS: return value.GetUnsigned();
+		default:                         return value.GetDouble();
+	}
+}
+
+// Note a change of a client that has subscribers, with the shard of its public ID locked
+static void AddChange(std::vector<ClientChange>& changes, const ClientRecordPtr& record, ClientEvent event)
+{
+	if (record->subscribers)
+	{
+		changes.push_back(ClientChange(record, event));
+	}
+}
+
+// Send noted changes to their subscribers, with no shard locked so that large lists don't stall the shard
+static void NotifySubscribers(const std::vector<ClientChange>& changes)
+{
+	for (auto& change : changes)
+	{
+		for (auto& subscriber : *change.subscribers)
+		{
+			subscriber->Push(change.record, change.event);
+		}
+	}
+}
+
+// Apply a change to attributes, moving its value in
+static void ApplyPatch(ClientAttributeMap& attributes, ClientPatch& patch)
+{
+	const ClientAttribute* pValue = attributes.Find(patch.key);
+
+	if (patch.operation == ClientPatchOperation::T_REMOVE)
+	{
+		attributes.Erase(patch.key);
+	}
+
+	// Integers stay integers and wrap around, other numbers become doubles
+	else if (patch.operation == ClientPatchOperation::T_INCREMENT && pValue && IsNumber(*pValue) && IsNumber(patch.value))
+	{
+		ClientAttributeType type = pValue->GetType();
+		if (type != ClientAttributeType::T_DBL && patch.value.GetType() != ClientAttributeType::T_DBL)
+		{
+			unsigned int increment = (patch.value.GetType() == ClientAttributeType::T_INT) ? unsigned(patch.value.GetInt()) : patch.value.GetUnsigned();
+			if (type == ClientAttributeType::T_INT)
+			{
+				attributes.Set(patch.key, ClientAttribute(int(unsigned(pValue->GetInt()) + increment)));
+			}
+			else
+			{
+				attributes.Set(patch.key, ClientAttribute(pValue->GetUnsigned() + increment));
+			}
+		}
+		else
+		{
+			attributes.Set(patch.key, ClientAttribute(GetNumber(*pValue) + GetNumber(patch.value)));
+		}
+	}
+
+	else
+	{
+		attributes.Set(patch.key, std::move(patch.value));
+	}
+}
+
+
+/*-----------------------------------------------------------------------------
+	ClientData
+-----------------------------------------------------------------------------*/
+
+const std::string& ClientData::GetPayload() const
+{
+	const std::string* pPayload = mPayload.Get();
+	if (pPayload)
+	{
+		return *pPayload;
+	}
+
+	std::shared_ptr<std::string> payload = std::make_shared<std::string>();
+	JsonWriter writer(*payload);
+	writer.BeginObject();
+	for (auto& entry : attributes)
+	{
+		writer.Key(AttributeKeys::Get().GetName(entry.first));
+		writer.Attribute(entry.second);
+	}
+	writer.EndObject();
+
+	return mPayload.Set(payload);
+}
+
+
+/*-----------------------------------------------------------------------------
+	ClientSubscriber
+-----------------------------------------------------------------------------*/
+
+void ClientSubscriber::Push(const ClientRecordPtr& record, ClientEvent event)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mIsClosed)
+	{
+		return;
+	}
+
+	// A disconnection is final, and a connection stays one when the client updates before it is sent
+	auto it = mPositions.find(record.get());
+	if (it != mPositions.end())
+	{
+		ClientNotification& notification = mQueue[it->second];
+		if (notification.event == ClientEvent::T_UPDATED || event == ClientEvent::T_DISCONNECTED)
+		{
+			notification.event = event;
+		}
+		return;
+	}
+
+	bool isWaking = mQueue.empty();
+	mPositions[record.get()] = mQueue.size();
+	mQueue.push_back(ClientNotification());
+	mQueue.back().record = record;
+	mQueue.back().event = event;
+
+	// Waking under the lock lets Close guarantee that the wake function is never called afterwards
+	if (isWaking && mWake)
+	{
+		mWake();
+	}
+}
+
+void ClientSubscriber::Pop(std::vector<ClientNotification>& notifications)
+{
+	notifications.clear();
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	notifications.swap(mQueue);
+	mPositions.clear();
+}
+
+void ClientSubscriber::Close()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	mIsClosed = true;
+	mQueue.clear();
+	mPositions.clear();
+	mWake = nullptr;
+}
 
 
 /*-----------------------------------------------------------------------------
 	Constructors & destructor
 -----------------------------------------------------------------------------*/
 
-Database::Database(int updatePeriod, int clientIdleTime)
+Database::Database(int updatePeriod, int clientIdleTime, int shardCount, int autoIndexSearches, DatabaseEngine engine)
 {
 	mStartupTime = std::chrono::system_clock::now();
 	mUpdatePeriod = updatePeriod;
 	mClientIdleTime = clientIdleTime;
+	mAutoIndexSearches = autoIndexSearches;
+	mAutoIndexCount = 0;
+	mEngine = engine;
+	mIndexedKeys = std::make_shared<const std::set<std::string>>();
+	mStatistics = std::make_shared<const SearchStatistics>();
+	mClientCount.store(0);
 	mRunning.store(true);
 
+	mKeySearchCounts = std::vector<std::atomic<int>>(AttributeKeys::cMaxKeys);
+	for (auto& count : mKeySearchCounts)
+	{
+		count.store(0, std::memory_order_relaxed);
+	}
+
+	for (int i = 0; i < std::max(shardCount, 1); i++)
+	{
+		mShards.push_back(std::unique_ptr<DatabaseShard>(new DatabaseShard(clientIdleTime + 2, GetExpiryTick(ActivityClock::now()))));
+	}
+
 	mThread = std::thread(&Database::BackgroundRefresh, this);
 }
 
 Database::~Database()
 {
-	mRunning.store(false);
+	{
+		std::lock_guard<std::mutex> lock(mRunningMutex);
+		mRunning.store(false);
+	}
+	mRunningCondition.notify_all();
 
 	mThread.join();
 }
@@ -31,21 +236,17 @@ Database::~Database()
 
 bool Database::IsConnectedPublic(const std::string& publicId)
 {
-	std::lock_guard<std::mutex> lock(mMutex);
-
-	return (mData.find(publicId) != mData.end());
+	return FindPublic(publicId) != nullptr;
 }
 
 bool Database::IsConnectedPrivate(const std::string& privateId)
 {
-	std::lock_guard<std::mutex> lock(mMutex);
-
-	return (mPrivateToPublic.find(privateId) != mPrivateToPublic.end());
+	return FindPrivate(privateId) != nullptr;
 }
 
 int Database::GetConnectedClientsCount() const
 {
-	return static_cast<int>(mData.size());
+	return mClientCount.load();
 }
 
 std::chrono::seconds Database::GetUptime() const
@@ -55,106 +256,566 @@ std::chrono::seconds Database::GetUptime() const
 	return std::chrono::duration_cast<std::chrono::seconds>(diff);
 }
 
-void Database::ConnectClient(const std::string& privateId, const std::string& publicId, const std::string& clientAddress)
+ClientRecordPtr Database::ConnectClient(const std::string& privateId, const std::string& publicId, const std::string& clientAddress)
 {
-	std::lock_guard<std::mutex> lock(mMutex);
+	ClientDataPtr data(new ClientData(privateId, clientAddress));
+	ClientRecordPtr record(new ClientRecord(privateId, publicId, data));
+	ClientRecordPtr previousPublic;
+	ClientRecordPtr previousPrivate;
+	std::vector<ClientChange> changes;
+
+	assert(data->privateId.length());
+
+	// Index the client by public ID first, so that a known private ID always has data
+	{
+		ClientKey key(publicId);
+		DatabaseShard& shard = GetShard(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		ClientRecordPtr& entry = shard.data.Insert(key, publicId);
+		previousPublic = entry;
+		entry = record;
+
+		if (previousPublic)
+		{
+			shard.expiry.Erase(previousPublic);
+			UpdateIndexes(shard, previousPublic, previousPublic->GetData().get(), nullptr);
+			previousPublic->subscribers = nullptr;
+		}
+		UpdateIndexes(shard, record, nullptr, data.get());
+
+		// Subscribers may have waited for this public ID
+		if (shard.subscriptions.size())
+		{
+			auto it = shard.subscriptions.find(publicId);
+			if (it != shard.subscriptions.end())
+			{
+				record->subscribers = it->second;
+				AddChange(changes, record, ClientEvent::T_CONNECTED);
+			}
+		}
+
+		// Check its activity once it can have been idle for more than mClientIdleTime whole seconds
+		shard.expiry.Insert(record, GetExpiryTick(record->GetLastActivity()) + mClientIdleTime + 2);
+	}
+	NotifySubscribers(changes);
+
+	// Then by private ID
+	{
+		ClientKey key(privateId);
+		DatabaseShard& shard = GetShard(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
 
-	mPrivateToPublic[privateId] = publicId;
-	mData[publicId] = ClientData(privateId, clientAddress);
+		ClientRecordPtr& entry = shard.privateToRecord.Insert(key, privateId);
+		previousPrivate = entry;
+		entry = record;
+		if (previousPrivate)
+		{
+			previousPrivate->SetDisconnected();
+		}
+	}
+
+	// Another client used this public ID : it is replaced
+	if (previousPublic == nullptr)
+	{
+		mClientCount++;
+	}
+	else if (previousPublic->privateId != privateId)
+	{
+		RemovePrivate(previousPublic);
+	}
 
-	assert(mData[publicId].privateId.length());
+	// This client used another public ID : it is replaced
+	if (previousPrivate && previousPrivate->publicId != publicId)
+	{
+		RemovePublic(previousPrivate);
+	}
+
+	return record;
 }
 
 void Database::DisconnectClient(const std::string& privateId)
 {
-	std::lock_guard<std::mutex> lock(mMutex);
+	ClientRecordPtr record;
+
+	// Remove the private ID first, so that the client can't be modified anymore
+	{
+		ClientKey key(privateId);
+		DatabaseShard& shard = GetShard(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		ClientRecordPtr* pEntry = shard.privateToRecord.Find(key, privateId);
+		if (pEntry == nullptr)
+		{
+			return;
+		}
+		record = *pEntry;
+		record->SetDisconnected();
+		shard.privateToRecord.Erase(key, privateId);
+	}
 
-	mData.erase(mData.find(mPrivateToPublic[privateId]));
-	mPrivateToPublic.erase(mPrivateToPublic.find(privateId));
+	RemovePublic(record);
 }
 
-void Database::HeartbeatClient(const std::string& privateId)
+bool Database::DisconnectClient(const ClientRecordPtr& record)
 {
-	std::lock_guard<std::mutex> lock(mMutex);
+	if (record && RemovePrivate(record))
+	{
+		RemovePublic(record);
+		return true;
+	}
+	return false;
+}
 
-	mData[mPrivateToPublic[privateId]].lastUpdateTime = std::chrono::system_clock::now();
+bool Database::HeartbeatClient(const std::string& privateId)
+{
+	return HeartbeatClient(FindPrivate(privateId));
+}
+
+bool Database::HeartbeatClient(const ClientRecordPtr& record)
+{
+	if (record && record->IsConnected())
+	{
+		record->Touch();
+		return true;
+	}
+	return false;
+}
+
+ClientRecordPtr Database::GetClientRecord(const std::string& privateId)
+{
+	return FindPrivate(privateId);
 }
 
 void Database::UpdateClient(const std::string& privateId, const ClientData& data)
 {
-	std::lock_guard<std::mutex> lock(mMutex);
+	UpdateClient(FindPrivate(privateId), data);
+}
 
-	mData[mPrivateToPublic[privateId]] = data;
-	mData[mPrivateToPublic[privateId]].lastUpdateTime = std::chrono::system_clock::now();
+bool Database::UpdateClient(const ClientRecordPtr& record, ClientData data)
+{
+	if (record && record->IsConnected())
+	{
+		// Build the new snapshot without holding any lock
+		ClientData* pNewData = new ClientData(std::move(data));
+		pNewData->lastUpdateTime = std::chrono::system_clock::now();
+		ClientDataPtr newData(pNewData);
+		ClientDataPtr oldData;
+
+		// Publish it under the public ID shard lock, so that secondary indexes stay in sync
+		ClientKey key(record->publicId);
+		DatabaseShard& shard = GetShard(key);
+		std::vector<ClientChange> changes;
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+
+			oldData = record->GetData();
+			record->SetData(newData);
+
+			bool hasSecondaryData = shard.indexes.size() || mEngine == DatabaseEngine::T_COLUMNS;
+			ClientRecordPtr* pEntry = hasSecondaryData ? shard.data.Find(key, record->publicId) : nullptr;
+			if (pEntry && *pEntry == record)
+			{
+				UpdateIndexes(shard, record, oldData.get(), newData.get());
+			}
+			AddChange(changes, record, ClientEvent::T_UPDATED);
+		}
+		NotifySubscribers(changes);
+		return true;
+	}
+	return false;
 }
 
-const ClientData& Database::QueryClientPublic(const std::string& publicId)
+bool Database::PatchClient(const ClientRecordPtr& record, std::vector<ClientPatch>& patches)
 {
-	std::lock_guard<std::mutex> lock(mMutex);
+	if (record == nullptr || !record->IsConnected())
+	{
+		return false;
+	}
 
-	return mData[publicId];
+	ClientKey key(record->publicId);
+	DatabaseShard& shard = GetShard(key);
+	std::vector<ClientChange> changes;
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		PatchRecord(shard, key, record, patches.data(), patches.data() + patches.size(), changes);
+	}
+	NotifySubscribers(changes);
+	return true;
 }
 
-const ClientData& Database::QueryClientPrivate(const std::string& privateId)
+void Database::RunOperations(std::vector<ClientOperation>& operations, std::vector<ClientPatch>& patches)
 {
-	std::lock_guard<std::mutex> lock(mMutex);
+	std::vector<ShardEntry> order;
+	order.reserve(operations.size());
+
+	// Find the clients given by private ID
+	for (size_t i = 0; i < operations.size(); i++)
+	{
+		if (operations[i].record == nullptr && operations[i].privateId.length())
+		{
+			ClientKey key(operations[i].privateId);
+			order.push_back(ShardEntry(GetShardIndex(key), i, key));
+		}
+	}
+	RunByShard(order, [&](DatabaseShard& shard, const ShardEntry& entry)
+	{
+		ClientOperation& operation = operations[entry.index];
+		ClientRecordPtr* pEntry = shard.privateToRecord.Find(entry.key, operation.privateId);
+		operation.record = pEntry ? *pEntry : nullptr;
+	});
 
-	return mData[mPrivateToPublic[privateId]];
+	// Heartbeats need no lock, patches are grouped by the shard of the public ID
+	std::vector<ClientChange> changes;
+	order.clear();
+	for (size_t i = 0; i < operations.size(); i++)
+	{
+		ClientOperation& operation = operations[i];
+		operation.isSuccess = operation.record && operation.record->IsConnected();
+		if (operation.isSuccess && operation.isPatch)
+		{
+			ClientKey key(operation.record->publicId);
+			order.push_back(ShardEntry(GetShardIndex(key), i, key));
+		}
+		else if (operation.isSuccess)
+		{
+			operation.record->Touch();
+		}
+	}
+	RunByShard(order, [&](DatabaseShard& shard, const ShardEntry& entry)
+	{
+		ClientOperation& operation = operations[entry.index];
+		PatchRecord(shard, entry.key, operation.record, patches.data() + operation.patchBegin, patches.data() + operation.patchEnd, changes);
+	});
+	NotifySubscribers(changes);
 }
 
-ClientSearchResult Database::SearchClients(const std::vector<ClientSearchCriterion>& criteria, int maxCount)
+ClientDataPtr Database::QueryClientPublic(const std::string& publicId)
+{
+	ClientRecordPtr record = FindPublic(publicId);
+	return record ? record->GetData() : nullptr;
+}
+
+ClientDataPtr Database::QueryClientPrivate(const std::string& privateId)
+{
+	ClientRecordPtr record = FindPrivate(privateId);
+	return record ? record->GetData() : nullptr;
+}
+
+void Database::QueryClientsPublic(const std::vector<std::string>& publicIds, std::vector<ClientDataPtr>& results)
+{
+	std::vector<ShardEntry> order;
+	GetShardEntries(publicIds, order);
+
+	results.assign(publicIds.size(), nullptr);
+	RunByShard(order, [&](DatabaseShard& shard, const ShardEntry& entry)
+	{
+		ClientRecordPtr* pEntry = shard.data.Find(entry.key, publicIds[entry.index]);
+		if (pEntry)
+		{
+			results[entry.index] = (*pEntry)->GetData();
+		}
+	});
+}
+
+void Database::Subscribe(const ClientSubscriberPtr& subscriber, const std::vector<std::string>& publicIds)
+{
+	std::vector<ShardEntry> order;
+	GetShardEntries(publicIds, order);
+
+	RunByShard(order, [&](DatabaseShard& shard, const ShardEntry& entry)
+	{
+		const std::string& publicId = publicIds[entry.index];
+		ClientSubscriberListPtr& subscribers = shard.subscriptions[publicId];
+		if (subscribers && std::find(subscribers->begin(), subscribers->end(), subscriber) != subscribers->end())
+		{
+			return;
+		}
+
+		// Writers may still be pushing to the current list : replace it
+		std::shared_ptr<ClientSubscriberList> newSubscribers = subscribers ? std::make_shared<ClientSubscriberList>(*subscribers) : std::make_shared<ClientSubscriberList>();
+		newSubscribers->push_back(subscriber);
+		subscribers = newSubscribers;
+
+		ClientRecordPtr* pEntry = shard.data.Find(entry.key, publicId);
+		if (pEntry)
+		{
+			(*pEntry)->subscribers = subscribers;
+		}
+	});
+}
+
+void Database::Unsubscribe(const ClientSubscriberPtr& subscriber, const std::vector<std::string>& publicIds)
+{
+	std::vector<ShardEntry> order;
+	GetShardEntries(publicIds, order);
+
+	RunByShard(order, [&](DatabaseShard& shard, const ShardEntry& entry)
+	{
+		const std::string& publicId = publicIds[entry.index];
+		auto it = shard.subscriptions.find(publicId);
+		if (it == shard.subscriptions.end())
+		{
+			return;
+		}
+
+		const ClientSubscriberList& subscribers = *it->second;
+		if (std::find(subscribers.begin(), subscribers.end(), subscriber) == subscribers.end())
+		{
+			return;
+		}
+
+		// The last subscriber left : the client no longer has a list
+		ClientSubscriberListPtr newSubscribers;
+		if (subscribers.size() > 1)
+		{
+			std::shared_ptr<ClientSubscriberList> remaining = std::make_shared<ClientSubscriberList>(subscribers);
+			remaining->erase(std::remove(remaining->begin(), remaining->end(), subscriber), remaining->end());
+			newSubscribers = remaining;
+		}
+
+		ClientRecordPtr* pEntry = shard.data.Find(entry.key, publicId);
+		if (pEntry)
+		{
+			(*pEntry)->subscribers = newSubscribers;
+		}
+		if (newSubscribers)
+		{
+			it->second = newSubscribers;
+		}
+		else
+		{
+			shard.subscriptions.erase(it);
+		}
+	});
+}
+
+ClientSearchResult Database::SearchClients(const std::vector<ClientSearchCriterion>& criteria, int maxCount, ClientSearchPlan* pPlan)
 {
-	std::lock_guard<std::mutex> lock(mMutex);
 	ClientSearchResult result;
+	std::vector<ClientRecordPtr> records;
+	std::vector<ClientDataPtr> snapshots;
+	std::vector<ClientRecordPtr> otherRecords;
+	std::vector<uint64_t> selection;
 	int count = 0;
 
-	for (auto& client : mData)
+	// Plan the search from the current statistics and indexes
+	std::shared_ptr<const std::set<std::string>> indexedKeys = std::atomic_load(&mIndexedKeys);
+	std::shared_ptr<const SearchStatistics> statistics = std::atomic_load(&mStatistics);
+	ClientSearchPlan plan(criteria, *statistics, *indexedKeys, mClientCount.load(), maxCount, mEngine == DatabaseEngine::T_COLUMNS);
+	for (auto& crit : criteria)
 	{
-		bool match = true;
+		if (indexedKeys->count(crit.key) == 0)
+		{
+			CountKeySearch(crit.key);
+		}
+	}
+	if (plan.isEmpty)
+	{
+		if (pPlan)
+		{
+			*pPlan = plan;
+		}
+		return result;
+	}
+
+	// Records are intersected in address order
+	auto addressOrder = [](const ClientRecordPtr& lhs, const ClientRecordPtr& rhs)
+	{
+		return lhs.get() < rhs.get();
+	};
 
-		// Get client data
-		for (auto& crit : criteria)
+	// Identifiers of the indexed keys, that were interned when their index was added
+	std::vector<AttributeKey> indexKeyIds;
+	for (auto& key : plan.indexKeys)
+	{
+		indexKeyIds.push_back(AttributeKeys::Get().Find(key));
+	}
+
+	// Search shards one at a time
+	for (auto& shardPtr : mShards)
+	{
+		DatabaseShard& shard = *shardPtr;
+
+		// Take a consistent list of the shard's candidate clients and snapshots
 		{
-			// Client doesn't have that attribute
-			if (client.second.attributes.find(crit.key) == client.second.attributes.end())
+			std::lock_guard<std::mutex> lock(shard.mutex);
+
+			records.clear();
+			snapshots.clear();
+			auto addCandidate = [&](const ClientRecordPtr& record)
 			{
-				match = false;
-				break;
+				records.push_back(record);
+				snapshots.push_back(record->GetData());
+			};
+
+			// Scan all clients
+			if (plan.access == ClientSearchAccess::T_SCAN)
+			{
+				records.reserve(shard.data.Size());
+				snapshots.reserve(shard.data.Size());
+				shard.data.ForEach(addCandidate);
+			}
+
+			// Select rows from columns
+			else if (plan.access == ClientSearchAccess::T_COLUMNS)
+			{
+				shard.columns.Select(plan.criteria, selection);
+				shard.columns.ForEachSelected(selection, addCandidate);
+			}
+
+			// Walk an index range
+			else if (plan.access == ClientSearchAccess::T_INDEX)
+			{
+				shard.indexes[indexKeyIds[0]].ForEachInRange(plan.ranges[0], addCandidate);
 			}
 
-			// Client has attribute, check if it matches
+			// Keep the clients that are in the ranges of all indexes, then load their snapshots
 			else
 			{
-				const ClientAttribute& attr = client.second.attributes[crit.key];
-				switch (crit.condition)
+				for (size_t i = 0; i < plan.indexKeys.size(); i++)
 				{
-					case ClientSearchCondition::T_EQUAL:      match = match && (attr == crit.value); break;
-					case ClientSearchCondition::T_NEQUAL:     match = match && (attr != crit.value); break;
-					case ClientSearchCondition::T_LESSER:     match = match && (attr <  crit.value); break;
-					case ClientSearchCondition::T_GREATER:    match = match && (attr >  crit.value); break;
-					case ClientSearchCondition::T_LESSER_EQ:  match = match && (attr <= crit.value); break;
-					case ClientSearchCondition::T_GREATER_EQ: match = match && (attr >= crit.value); break;
+					std::vector<ClientRecordPtr>& target = (i == 0) ? records : otherRecords;
+					target.clear();
+					shard.indexes[indexKeyIds[i]].ForEachInRange(plan.ranges[i], [&](const ClientRecordPtr& record)
+					{
+						target.push_back(record);
+					});
+					std::sort(target.begin(), target.end(), addressOrder);
+
+					if (i > 0)
+					{
+						auto end = std::set_intersection(records.begin(), records.end(), otherRecords.begin(), otherRecords.end(), records.begin(), addressOrder);
+						records.erase(end, records.end());
+					}
+				}
+				for (auto& record : records)
+				{
+					snapshots.push_back(record->GetData());
 				}
 			}
 		}
 
-		// Result matches !
-		if (match)
+		// Match them against all criteria, most selective first, without holding the lock
+		plan.visitedClients += records.size();
+		for (size_t i = 0; i < records.size(); i++)
 		{
-			result[client.first] = client.second;
-			count++;
-		}
+			const ClientDataPtr& data = snapshots[i];
+			bool match = true;
+
+			for (auto& crit : plan.criteria)
+			{
+				// Client doesn't have that attribute, or it doesn't match
+				const ClientAttribute* pValue = data->attributes.Find(crit.keyId);
+				if (pValue == nullptr || !crit.Matches(*pValue))
+				{
+					match = false;
+					break;
+				}
+			}
+
+			// Result matches !
+			if (match)
+			{
+				result[records[i]->publicId] = data;
+				count++;
+			}
 
-		// Limit
+			// Limit
+			if (count >= maxCount)
+			{
+				break;
+			}
+		}
 		if (count >= maxCount)
 		{
 			break;
 		}
 	}
 
+	if (pPlan)
+	{
+		*pPlan = plan;
+	}
 	return result;
 }
 
+void Database::AddIndex(const std::string& key)
+{
+	AttributeKey keyId = AttributeKeys::Get().Intern(key);
+	if (keyId == AttributeKeys::cInvalidKey)
+	{
+		std::cout << "Database::AddIndex failed : too many attribute keys" << std::endl;
+		return;
+	}
+
+	// Build the index of each shard from its current clients, the shard lock keeps it in sync from then on
+	for (auto& shardPtr : mShards)
+	{
+		DatabaseShard& shard = *shardPtr;
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		if (shard.indexes.count(keyId) == 0)
+		{
+			AttributeIndex& index = shard.indexes[keyId];
+			shard.data.ForEach([&](const ClientRecordPtr& record)
+			{
+				ClientDataPtr data = record->GetData();
+				const ClientAttribute* pValue = GetIndexedValue(data.get(), keyId);
+				if (pValue)
+				{
+					index.Insert(*pValue, record);
+				}
+			});
+		}
+	}
+
+	// Searches can use it once all shards have it
+	std::lock_guard<std::mutex> lock(mIndexMutex);
+	std::shared_ptr<std::set<std::string>> indexedKeys = std::make_shared<std::set<std::string>>(*mIndexedKeys);
+	indexedKeys->insert(key);
+	std::atomic_store(&mIndexedKeys, std::shared_ptr<const std::set<std::string>>(indexedKeys));
+}
+
+void Database::RefreshStatistics()
+{
+	std::vector<ClientDataPtr> samples;
+	size_t shardSamples = std::max<size_t>(cStatisticsSamples / mShards.size(), 1);
+	std::minstd_rand random(unsigned(ActivityClock::now().time_since_epoch().count()));
+
+	// Take clients from evenly spaced slots of each shard, only visiting those slots, from a different start each time
+	for (auto& shardPtr : mShards)
+	{
+		DatabaseShard& shard = *shardPtr;
+		size_t start = random();
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		shard.data.Sample(shardSamples, start, [&](const ClientRecordPtr& record)
+		{
+			samples.push_back(record->GetData());
+		});
+	}
+
+	// Gather the values of each key
+	std::map<AttributeKey, std::vector<ClientAttribute>> values;
+	for (auto& data : samples)
+	{
+		for (auto& attribute : data->attributes)
+		{
+			values[attribute.first].push_back(attribute.second);
+		}
+	}
+
+	// Publish the statistics
+	std::shared_ptr<SearchStatistics> statistics = std::make_shared<SearchStatistics>();
+	statistics->sampleCount = samples.size();
+	for (auto& keyValues : values)
+	{
+		statistics->keys[AttributeKeys::Get().GetName(keyValues.first)].Build(keyValues.second, samples.size());
+	}
+	std::atomic_store(&mStatistics, std::shared_ptr<const SearchStatistics>(statistics));
+}
+
 
 /*-----------------------------------------------------------------------------
 	Background process
@@ -164,28 +825,363 @@ void Database::BackgroundRefresh()
 {
 	while (mRunning.load())
 	{
-		// Every second, update the database
-		std::this_thread::sleep_for(std::chrono::seconds(mUpdatePeriod));
-		std::lock_guard<std::mutex> lock(mMutex);
-		DatabaseTime now = std::chrono::system_clock::now();
+		// Every second, update the database, unless stopped while waiting
+		{
+			std::unique_lock<std::mutex> lock(mRunningMutex);
+			if (mRunningCondition.wait_for(lock, std::chrono::seconds(mUpdatePeriod), [&]() { return !mRunning.load(); }))
+			{
+				break;
+			}
+		}
 
-		// Detect idle clients
-		std::vector<std::string> idleClients;
-		for (auto& client : mData)
+		// Build indexes for frequently searched keys, up to cMaxAutoIndexes as each one slows writes down
+		std::vector<std::string> pendingIndexes;
 		{
-			auto diff = (now - client.second.lastUpdateTime);
-			if (std::chrono::duration_cast<std::chrono::seconds>(diff).count() > mClientIdleTime)
+			std::lock_guard<std::mutex> lock(mIndexMutex);
+			pendingIndexes.swap(mPendingIndexes);
+		}
+		for (auto& key : pendingIndexes)
+		{
+			if (mAutoIndexCount < cMaxAutoIndexes && std::atomic_load(&mIndexedKeys)->count(key) == 0)
 			{
-				idleClients.push_back(client.second.privateId);
+				AddIndex(key);
+				mAutoIndexCount++;
 			}
 		}
+		DecayKeySearches();
+
+		// Sweep shards one at a time, so that other shards stay available
+		for (auto& shardPtr : mShards)
+		{
+			ExpireClients(*shardPtr);
+		}
+
+		RefreshStatistics();
+	}
+}
+
+
+/*-----------------------------------------------------------------------------
+	Private methods
+-----------------------------------------------------------------------------*/
+
+DatabaseShard& Database::GetShard(const ClientKey& key)
+{
+	return *mShards[GetShardIndex(key)];
+}
+
+size_t Database::GetShardIndex(const ClientKey& key) const
+{
+	return key.tag % mShards.size();
+}
 
-		// Disconnect idle clients
-		for (auto& privateId : idleClients)
+void Database::GetShardEntries(const std::vector<std::string>& identifiers, std::vector<ShardEntry>& entries) const
+{
+	entries.reserve(identifiers.size());
+	for (size_t i = 0; i < identifiers.size(); i++)
+	{
+		ClientKey key(identifiers[i]);
+		entries.push_back(ShardEntry(GetShardIndex(key), i, key));
+	}
+}
+
+template<typename Function>
+void Database::RunByShard(std::vector<ShardEntry>& entries, Function function)
+{
+	std::sort(entries.begin(), entries.end());
+	for (size_t start = 0; start < entries.size();)
+	{
+		DatabaseShard& shard = *mShards[entries[start].shard];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		size_t end = start;
+		for (; end < entries.size() && entries[end].shard == entries[start].shard; end++)
 		{
-			mData.erase(mData.find(mPrivateToPublic[privateId]));
-			mPrivateToPublic.erase(mPrivateToPublic.find(privateId));
+			function(shard, entries[end]);
 		}
+		start = end;
+	}
+}
+
+ClientRecordPtr Database::FindPrivate(const std::string& privateId)
+{
+	ClientKey key(privateId);
+	DatabaseShard& shard = GetShard(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	ClientRecordPtr* pEntry = shard.privateToRecord.Find(key, privateId);
+	return pEntry ? *pEntry : nullptr;
+}
 
+ClientRecordPtr Database::FindPublic(const std::string& publicId)
+{
+	ClientKey key(publicId);
+	DatabaseShard& shard = GetShard(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	ClientRecordPtr* pEntry = shard.data.Find(key, publicId);
+	return pEntry ? *pEntry : nullptr;
+}
+
+bool Database::RemovePrivate(const ClientRecordPtr& record)
+{
+	ClientKey key(record->privateId);
+	DatabaseShard& shard = GetShard(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	ClientRecordPtr* pEntry = shard.privateToRecord.Find(key, record->privateId);
+	if (pEntry && *pEntry == record)
+	{
+		record->SetDisconnected();
+		shard.privateToRecord.Erase(key, record->privateId);
+		return true;
 	}
+	return false;
+}
+
+void Database::RemovePublic(const ClientRecordPtr& record)
+{
+	ClientKey key(record->publicId);
+	DatabaseShard& shard = GetShard(key);
+	std::vector<ClientChange> changes;
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		ClientRecordPtr* pEntry = shard.data.Find(key, record->publicId);
+		if (pEntry && *pEntry == record)
+		{
+			shard.data.Erase(key, record->publicId);
+			shard.expiry.Erase(record);
+			UpdateIndexes(shard, record, record->GetData().get(), nullptr);
+			AddChange(changes, record, ClientEvent::T_DISCONNECTED);
+			record->subscribers = nullptr;
+			mClientCount--;
+		}
+	}
+	NotifySubscribers(changes);
+}
+
+void Database::PatchRecord(DatabaseShard& shard, const ClientKey& key, const ClientRecordPtr& record, ClientPatch* pBegin, ClientPatch* pEnd, std::vector<ClientChange>& changes)
+{
+	// Reuse the storage of a snapshot that readers released, copying the current one into it
+	std::shared_ptr<ClientData> newData;
+	if (shard.spareData.size())
+	{
+		newData = std::move(shard.spareData.back());
+		shard.spareData.pop_back();
+	}
+	else
+	{
+		newData = std::make_shared<ClientData>();
+	}
+
+	ClientDataPtr oldData = record->GetData();
+	*newData = *oldData;
+	newData->lastUpdateTime = std::chrono::system_clock::now();
+	for (ClientPatch* pPatch = pBegin; pPatch != pEnd; pPatch++)
+	{
+		ApplyPatch(newData->attributes, *pPatch);
+	}
+
+	record->SetData(newData);
+
+	// Only update the secondary indexes and columns of the changed keys
+	bool hasSecondaryData = shard.indexes.size() || mEngine == DatabaseEngine::T_COLUMNS;
+	ClientRecordPtr* pEntry = hasSecondaryData ? shard.data.Find(key, record->publicId) : nullptr;
+	if (pEntry && *pEntry == record)
+	{
+		for (ClientPatch* pPatch = pBegin; pPatch != pEnd; pPatch++)
+		{
+			UpdateIndexedKey(shard, record, pPatch->key, oldData->attributes.Find(pPatch->key), newData->attributes.Find(pPatch->key));
+		}
+	}
+	AddChange(changes, record, ClientEvent::T_UPDATED);
+
+	// Once no reader holds the previous snapshot, it can't get it anymore : keep it for a later patch.
+	// use_count is a relaxed load, so the fence orders the last reads of the readers that released it
+	// before this thread overwrites it, as the shared_ptr destructor does before deleting.
+	if (oldData.use_count() == 1 && shard.spareData.size() < cMaxSpareData)
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		shard.spareData.push_back(std::const_pointer_cast<ClientData>(oldData));
+	}
+}
+
+void Database::UpdateIndexes(DatabaseShard& shard, const ClientRecordPtr& record, const ClientData* pOldData, const ClientData* pNewData)
+{
+	for (auto& index : shard.indexes)
+	{
+		const ClientAttribute* pOldValue = GetIndexedValue(pOldData, index.first);
+		const ClientAttribute* pNewValue = GetIndexedValue(pNewData, index.first);
+
+		// Unchanged value
+		if (pOldValue && pNewValue && *pOldValue == *pNewValue)
+		{
+			continue;
+		}
+
+		if (pOldValue)
+		{
+			index.second.Erase(*pOldValue, record);
+		}
+		if (pNewValue)
+		{
+			index.second.Insert(*pNewValue, record);
+		}
+	}
+
+	if (mEngine != DatabaseEngine::T_COLUMNS)
+	{
+		return;
+	}
+
+	// Add or remove the row
+	if (pOldData == nullptr)
+	{
+		record->columnRow = shard.columns.AddRow(record);
+	}
+	if (pNewData == nullptr)
+	{
+		ClientRecordPtr moved = shard.columns.RemoveRow(record->columnRow);
+		if (moved)
+		{
+			moved->columnRow = record->columnRow;
+		}
+		return;
+	}
+
+	// Update the values that changed, walking both sorted attribute maps
+	static const ClientAttributeMap sNoAttributes;
+	const ClientAttributeMap& oldAttributes = pOldData ? pOldData->attributes : sNoAttributes;
+	auto oldIt = oldAttributes.begin();
+	auto newIt = pNewData->attributes.begin();
+	while (oldIt != oldAttributes.end() || newIt != pNewData->attributes.end())
+	{
+		if (newIt == pNewData->attributes.end() || (oldIt != oldAttributes.end() && oldIt->first < newIt->first))
+		{
+			shard.columns.SetValue(record->columnRow, oldIt->first, nullptr);
+			oldIt++;
+		}
+		else if (oldIt == oldAttributes.end() || newIt->first < oldIt->first)
+		{
+			shard.columns.SetValue(record->columnRow, newIt->first, &newIt->second);
+			newIt++;
+		}
+		else
+		{
+			if (oldIt->second != newIt->second)
+			{
+				shard.columns.SetValue(record->columnRow, newIt->first, &newIt->second);
+			}
+			oldIt++;
+			newIt++;
+		}
+	}
+}
+
+void Database::UpdateIndexedKey(DatabaseShard& shard, const ClientRecordPtr& record, AttributeKey key, const ClientAttribute* pOldValue, const ClientAttribute* pNewValue)
+{
+	if (pOldValue == pNewValue || (pOldValue && pNewValue && *pOldValue == *pNewValue))
+	{
+		return;
+	}
+
+	auto indexIt = shard.indexes.find(key);
+	if (indexIt != shard.indexes.end())
+	{
+		if (GetIndexedValue(pOldValue))
+		{
+			indexIt->second.Erase(*pOldValue, record);
+		}
+		if (GetIndexedValue(pNewValue))
+		{
+			indexIt->second.Insert(*pNewValue, record);
+		}
+	}
+
+	if (mEngine == DatabaseEngine::T_COLUMNS)
+	{
+		shard.columns.SetValue(record->columnRow, key, pNewValue);
+	}
+}
+
+void Database::CountKeySearch(const std::string& key)
+{
+	if (mAutoIndexSearches <= 0)
+	{
+		return;
+	}
+
+	// Keys that were never added have no client to index
+	AttributeKey keyId = AttributeKeys::Get().Find(key);
+	if (keyId == AttributeKeys::cInvalidKey)
+	{
+		return;
+	}
+
+	// Only the search that reaches the count queues the index
+	if (mKeySearchCounts[keyId].fetch_add(1, std::memory_order_relaxed) + 1 == mAutoIndexSearches)
+	{
+		std::lock_guard<std::mutex> lock(mIndexMutex);
+		mPendingIndexes.push_back(key);
+	}
+}
+
+void Database::DecayKeySearches()
+{
+	// Searches counted in the meantime may be lost, counts only need to be approximate
+	for (auto& count : mKeySearchCounts)
+	{
+		int value = count.load(std::memory_order_relaxed);
+		if (value)
+		{
+			count.store(value / 2, std::memory_order_relaxed);
+		}
+	}
+}
+
+void Database::ExpireClients(DatabaseShard& shard)
+{
+	std::vector<ClientRecordPtr> idleClients;
+	std::vector<ClientChange> changes;
+	size_t count = cExpiryBatch;
+
+	// Only visit the clients that were due for a check, and check them again later if they were active
+	while (count == cExpiryBatch)
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		ActivityClock::time_point now = ActivityClock::now();
+
+		count = shard.expiry.Expire(GetExpiryTick(now), cExpiryBatch, [&](const ClientRecordPtr& record)
+		{
+			ActivityClock::time_point lastActivity = record->GetLastActivity();
+			auto diff = (now - lastActivity);
+			if (std::chrono::duration_cast<std::chrono::seconds>(diff).count() > mClientIdleTime)
+			{
+				shard.data.Erase(ClientKey(record->publicId), record->publicId);
+				UpdateIndexes(shard, record, record->GetData().get(), nullptr);
+				AddChange(changes, record, ClientEvent::T_DISCONNECTED);
+				record->subscribers = nullptr;
+				idleClients.push_back(record);
+				mClientCount--;
+			}
+			else
+			{
+				shard.expiry.Insert(record, GetExpiryTick(lastActivity) + mClientIdleTime + 2);
+			}
+		});
+	}
+
+	NotifySubscribers(changes);
+
+	// Remove their private IDs, unless they reconnected in the meantime
+	for (auto& record : idleClients)
+	{
+		RemovePrivate(record);
+	}
+}
+
+int64_t Database::GetExpiryTick(ActivityClock::time_point time)
+{
+	return std::chrono::duration_cast<std::chrono::seconds>(time.time_since_epoch()).count();
 }
@@ -2,12 +2,22 @@
 
 #include <string>
 #include <map>
+#include <set>
 #include <vector>
+#include <memory>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <atomic>
 #include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <ctime>
 #include "clientattribute.h"
+#include "hashindex.h"
+#include "expirywheel.h"
+#include "clientsearch.h"
+#include "columnstore.h"
 
 
 /*-----------------------------------------------------------------------------
@@ -17,6 +27,75 @@
 // Time
 using DatabaseTime = std::chrono::time_point<std::chrono::system_clock>;
 
+// Coarse monotonic clock for client activity, read on every request : a few milliseconds of precision
+// are enough to expire clients, and much cheaper to get than from the precise clocks
+struct ActivityClock
+{
+	using duration = std::chrono::nanoseconds;
+	using rep = duration::rep;
+	using period = duration::period;
+	using time_point = std::chrono::time_point<ActivityClock>;
+	static const bool is_steady = true;
+
+	static time_point now()
+	{
+#ifdef CLOCK_MONOTONIC_COARSE
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+		return time_point(duration(ts.tv_sec * 1000000000LL + ts.tv_nsec));
+#else
+		return time_point(std::chrono::duration_cast<duration>(std::chrono::steady_clock::now().time_since_epoch()));
+#endif
+	}
+};
+
+// Storage engine for searches : client records only, or a copy of their attributes in columns
+enum class DatabaseEngine { T_RECORDS = 0, T_COLUMNS };
+
+
+// Client attributes serialized as a JSON object, built by the first reader of a snapshot and shared by the
+// others. Copies of client data are made to be changed, so they start without it.
+class ClientPayload
+{
+public:
+
+	ClientPayload()
+	{}
+
+	ClientPayload(const ClientPayload&)
+	{}
+
+	ClientPayload& operator=(const ClientPayload&)
+	{
+		std::atomic_store(&mPayload, std::shared_ptr<const std::string>());
+		return *this;
+	}
+
+	// Get the payload, or null if it was not built yet
+	const std::string* Get() const
+	{
+		return std::atomic_load(&mPayload).get();
+	}
+
+	// Keep a payload unless another reader built one first, return the one kept
+	const std::string& Set(std::shared_ptr<const std::string> payload) const
+	{
+		std::shared_ptr<const std::string> expected;
+		if (std::atomic_compare_exchange_strong(&mPayload, &expected, payload))
+		{
+			return *payload;
+		}
+		return *expected;
+	}
+
+
+private:
+
+	// Set once per snapshot, then never replaced while the snapshot is shared
+	mutable std::shared_ptr<const std::string>      mPayload;
+
+};
+
 
 // Map of client attributes
 class ClientData
@@ -35,40 +114,262 @@ public:
 		lastUpdateTime = std::chrono::system_clock::now();
 	}
 
+	// Get the attributes as a JSON object, serialized on first use
+	const std::string& GetPayload() const;
+
 public:
 
 	std::string                                     privateId;
 	std::string                                     clientAddress;
-	std::map<std::string, ClientAttribute>          attributes;
+	ClientAttributeMap                              attributes;
 	DatabaseTime                                    lastUpdateTime;
 
+
+private:
+
+	ClientPayload                                   mPayload;
+
 };
 
+// Immutable snapshot of client data, shared between the database and readers
+using ClientDataPtr = std::shared_ptr<const ClientData>;
 
-// Search criteria
-enum class ClientSearchCondition { T_EQUAL = 0, T_NEQUAL, T_LESSER, T_GREATER, T_LESSER_EQ, T_GREATER_EQ };
 
-// Criteria for a search
-class ClientSearchCriterion
+// Change to one attribute of a client
+enum class ClientPatchOperation { T_SET = 0, T_REMOVE, T_INCREMENT };
+
+class ClientPatch
 {
 public:
 
-	ClientSearchCriterion(const std::string& k, const ClientAttribute& v, ClientSearchCondition c)
+	ClientPatch(AttributeKey k, ClientPatchOperation o, ClientAttribute&& v = ClientAttribute())
 		: key(k)
-		, value(v)
-		, condition(c)
+		, operation(o)
+		, value(std::move(v))
 	{}
 
 public:
 
-	std::string                                     key;
+	AttributeKey                                    key;
+	ClientPatchOperation                            operation;
 	ClientAttribute                                 value;
-	ClientSearchCondition                           condition;
 
 };
 
+
+// Kind of change to a client that is subscribed to
+enum class ClientEvent : uint8_t { T_CONNECTED = 0, T_UPDATED, T_DISCONNECTED };
+
+class ClientRecord;
+
+// Change to a client that is subscribed to. The data is read from the record when the notification is sent,
+// so that changes pushed in any order still deliver the latest data.
+struct ClientNotification
+{
+	std::shared_ptr<ClientRecord>                   record;
+	ClientEvent                                     event;
+};
+
+
+// Outbound queue of the notifications of a connection. Clients that change push to it once their shard is unlocked,
+// and never wait for the connection : a client that changed again before its notification was sent only has
+// its latest change queued, so the queue never grows past the subscriptions of the connection.
+class ClientSubscriber
+{
+public:
+
+	// The wake function is called when notifications become pending, from the thread that changed the client
+	ClientSubscriber(std::function<void()> wake = nullptr)
+		: mWake(wake)
+		, mIsClosed(false)
+	{}
+
+	// Queue a notification, merging it with the one already pending for the same record
+	void Push(const std::shared_ptr<ClientRecord>& record, ClientEvent event);
+
+	// Take all pending notifications, in the order of their records' first change
+	void Pop(std::vector<ClientNotification>& notifications);
+
+	// Drop all later notifications and never call the wake function again, once the connection is gone
+	void Close();
+
+
+private:
+
+	std::mutex                                      mMutex;
+	std::vector<ClientNotification>                 mQueue;
+	std::unordered_map<const ClientRecord*, size_t> mPositions;
+	std::function<void()>                           mWake;
+	bool                                            mIsClosed;
+
+};
+
+using ClientSubscriberPtr = std::shared_ptr<ClientSubscriber>;
+
+// Subscribers to a public ID, never modified once shared : subscribing builds a new list
+using ClientSubscriberList = std::vector<ClientSubscriberPtr>;
+using ClientSubscriberListPtr = std::shared_ptr<const ClientSubscriberList>;
+
+
+// Connected client. Its data is never modified in place : updates publish a new snapshot,
+// so that readers can keep using the snapshot they got without holding any lock.
+class ClientRecord
+{
+public:
+
+	ClientRecord(const std::string& privId, const std::string& pubId, ClientDataPtr initialData)
+		: privateId(privId)
+		, publicId(pubId)
+		, columnRow(0)
+		, expiryBucket(ExpiryWheel<ClientRecord*>::cInvalidBucket)
+		, expiryPosition(0)
+		, mData(initialData)
+		, mConnected(true)
+	{
+		Touch();
+	}
+
+	// Get the current data snapshot
+	ClientDataPtr GetData() const
+	{
+		return std::atomic_load(&mData);
+	}
+
+	// Publish a new data snapshot
+	void SetData(ClientDataPtr data)
+	{
+		std::atomic_store(&mData, data);
+		Touch();
+	}
+
+	// Mark the client as active
+	void Touch()
+	{
+		mLastActivity.store(ActivityClock::now().time_since_epoch().count(), std::memory_order_relaxed);
+	}
+
+	// Get the last time this client was active
+	ActivityClock::time_point GetLastActivity() const
+	{
+		return ActivityClock::time_point(ActivityClock::duration(mLastActivity.load(std::memory_order_relaxed)));
+	}
+
+	// Check if the client is still indexed by its private ID, so that requests can reach it
+	bool IsConnected() const
+	{
+		return mConnected.load(std::memory_order_acquire);
+	}
+
+	// Mark the client as no longer indexed by its private ID, with the private ID shard locked
+	void SetDisconnected()
+	{
+		mConnected.store(false, std::memory_order_release);
+	}
+
+public:
+
+	const std::string                               privateId;
+	const std::string                               publicId;
+
+	// Row in the columns of the public ID shard, guarded by the shard lock
+	size_t                                          columnRow;
+
+	// Place in the expiry wheel of the public ID shard, guarded by the shard lock
+	size_t                                          expiryBucket;
+	size_t                                          expiryPosition;
+
+	// Subscribers to the public ID, while the client is indexed by it and has some, guarded by the shard lock
+	ClientSubscriberListPtr                         subscribers;
+
+private:
+
+	ClientDataPtr                                   mData;
+	std::atomic<ActivityClock::rep>                 mLastActivity;
+	std::atomic<bool>                               mConnected;
+
+};
+
+using ClientRecordPtr = std::shared_ptr<ClientRecord>;
+
+// Change to a client noted with its shard locked, and pushed to the subscribers once it is unlocked
+struct ClientChange
+{
+	ClientChange(const ClientRecordPtr& r, ClientEvent e)
+		: record(r)
+		, event(e)
+		, subscribers(r->subscribers)
+	{}
+
+	ClientRecordPtr                                 record;
+	ClientEvent                                     event;
+	ClientSubscriberListPtr                         subscribers;
+};
+
+// Identifiers of a client record, for indexing
+struct ClientPrivateIdOf
+{
+	const std::string& operator()(const ClientRecordPtr& record) const { return record->privateId; }
+};
+struct ClientPublicIdOf
+{
+	const std::string& operator()(const ClientRecordPtr& record) const { return record->publicId; }
+};
+
+
 // Search result for a value
-using ClientSearchResult = std::map<std::string, ClientData>;
+using ClientSearchResult = std::map<std::string, ClientDataPtr>;
+
+
+// Operation on a client in a batch : a heartbeat, or a patch made of a range of the batch's patches.
+// The client is the record if set, or the one with the private ID, and the operation fails if neither is.
+class ClientOperation
+{
+public:
+
+	ClientOperation()
+		: isPatch(false)
+		, patchBegin(0)
+		, patchEnd(0)
+		, isSuccess(false)
+	{}
+
+public:
+
+	ClientRecordPtr                                 record;
+	std::string                                     privateId;
+	bool                                            isPatch;
+	size_t                                          patchBegin;
+	size_t                                          patchEnd;
+	bool                                            isSuccess;
+
+};
+
+
+// Partition of the database, with its own lock, only held to find or replace records.
+// Clients are indexed in the shard of their public ID, and in the shard of their private ID.
+// Subscriptions are kept in the shard of their public ID, whether a client uses it or not.
+// Secondary indexes sort the clients of the shard's public IDs by attribute value, and the expiry
+// wheel orders them by the time they were last checked for activity.
+class DatabaseShard
+{
+public:
+
+	DatabaseShard(size_t expirySpan, int64_t startTick)
+		: expiry(expirySpan, startTick)
+	{}
+
+public:
+
+	HashIndex<ClientRecordPtr, ClientPrivateIdOf>   privateToRecord;
+	HashIndex<ClientRecordPtr, ClientPublicIdOf>    data;
+	std::map<AttributeKey, AttributeIndex>          indexes;
+	ColumnStore                                     columns;
+	ExpiryWheel<ClientRecordPtr>                    expiry;
+	std::vector<std::shared_ptr<ClientData>>        spareData;
+	std::unordered_map<std::string, ClientSubscriberListPtr> subscriptions;
+	std::mutex                                      mutex;
+
+};
 
 
 /*-----------------------------------------------------------------------------
@@ -79,7 +380,8 @@ class Database
 {
 public:
 
-	Database(int updatePeriod, int clientIdleTime);
+	// Attribute keys are indexed automatically once they appeared in autoIndexSearches recent searches, never if zero
+	Database(int updatePeriod, int clientIdleTime, int shardCount = 16, int autoIndexSearches = 100, DatabaseEngine engine = DatabaseEngine::T_RECORDS);
 
 	~Database();
 
@@ -98,27 +400,85 @@ public:
 	std::chrono::seconds GetUptime() const;
 
 
-	// Connect this client, adding the public + private IDs in database
-	void ConnectClient(const std::string& privateId, const std::string& publicId, const std::string& clientAddress);
+	// Connect this client, adding the public + private IDs in database, return its record
+	ClientRecordPtr ConnectClient(const std::string& privateId, const std::string& publicId, const std::string& clientAddress);
 
 	// Remove this client from database
 	void DisconnectClient(const std::string& privateId);
 
-	// Update this client's last connection time
-	void HeartbeatClient(const std::string& privateId);
+	// Remove this client from database, return false if it was not connected
+	bool DisconnectClient(const ClientRecordPtr& record);
+
+	// Update this client's last connection time, return false if not connected
+	bool HeartbeatClient(const std::string& privateId);
+
+	// Update this client's last connection time without any lookup nor lock, return false if not connected
+	bool HeartbeatClient(const ClientRecordPtr& record);
+
+	// Get a handle on a connected client, that stays valid after it disconnects, or null if not connected
+	ClientRecordPtr GetClientRecord(const std::string& privateId);
 
 	// Update client data
 	void UpdateClient(const std::string& privateId, const ClientData& data);
 
+	// Update client data without looking the client up, return false if it is not connected
+	bool UpdateClient(const ClientRecordPtr& record, ClientData data);
+
+	// Change some attributes of a client, moving the patch values in, return false if it is not connected.
+	// Setting a value replaces it, incrementing a number adds to it, incrementing anything else sets it.
+	bool PatchClient(const ClientRecordPtr& record, std::vector<ClientPatch>& patches);
+
+	// Run a batch of operations, moving the patch values in and setting whether each succeeded. Each shard is
+	// locked once to find the clients by private ID, and once to patch those it holds, instead of once per operation.
+	// Operations on the same client run in order.
+	void RunOperations(std::vector<ClientOperation>& operations, std::vector<ClientPatch>& patches);
 
-	// Get client data
-	const ClientData& QueryClientPublic(const std::string& publicId);
 
-	// Get client data
-	const ClientData& QueryClientPrivate(const std::string& privateId);
+	// Get a snapshot of client data, or null if not connected
+	ClientDataPtr QueryClientPublic(const std::string& publicId);
 
-	// List clients matching criteria
-	ClientSearchResult SearchClients(const std::vector<ClientSearchCriterion>& criteria, int maxCount = 10);
+	// Get a snapshot of client data, or null if not connected
+	ClientDataPtr QueryClientPrivate(const std::string& privateId);
+
+	// Get a snapshot of the data of each client, or null for those not connected, locking each shard once
+	void QueryClientsPublic(const std::vector<std::string>& publicIds, std::vector<ClientDataPtr>& results);
+
+	// Send the changes of these clients to a subscriber until it unsubscribes, locking each shard once
+	void Subscribe(const ClientSubscriberPtr& subscriber, const std::vector<std::string>& publicIds);
+
+	// Stop sending the changes of these clients to a subscriber, locking each shard once
+	void Unsubscribe(const ClientSubscriberPtr& subscriber, const std::vector<std::string>& publicIds);
+
+	// List clients matching criteria, reporting how the search was run in pPlan if not null
+	ClientSearchResult SearchClients(const std::vector<ClientSearchCriterion>& criteria, int maxCount = 10, ClientSearchPlan* pPlan = nullptr);
+
+	// Maintain a sorted index of clients for an attribute key, so that searches on it avoid a full scan
+	void AddIndex(const std::string& key);
+
+	// Sample clients to update the statistics used to plan searches, visiting a bounded number of them
+	void RefreshStatistics();
+
+
+private:
+
+	// Item of a call on many clients with the key of its client, ordered by shard then by position in the call
+	struct ShardEntry
+	{
+		ShardEntry(size_t s, size_t i, const ClientKey& k)
+			: shard(s)
+			, index(i)
+			, key(k)
+		{}
+
+		bool operator<(const ShardEntry& other) const
+		{
+			return shard < other.shard || (shard == other.shard && index < other.index);
+		}
+
+		size_t                                      shard;
+		size_t                                      index;
+		ClientKey                                   key;
+	};
 
 
 private:
@@ -126,21 +486,83 @@ private:
 	// Update the database
 	void BackgroundRefresh();
 
+	// Get the shard responsible for an identifier
+	DatabaseShard& GetShard(const ClientKey& key);
+
+	// Get the index of the shard responsible for an identifier
+	size_t GetShardIndex(const ClientKey& key) const;
+
+	// Add an entry for each identifier, in order
+	void GetShardEntries(const std::vector<std::string>& identifiers, std::vector<ShardEntry>& entries) const;
+
+	// Sort entries by shard, then call a function on each entry with its shard, locking each shard once
+	template<typename Function>
+	void RunByShard(std::vector<ShardEntry>& entries, Function function);
+
+	// Find a client record from its private ID, or null
+	ClientRecordPtr FindPrivate(const std::string& privateId);
+
+	// Find a client record from its public ID, or null
+	ClientRecordPtr FindPublic(const std::string& publicId);
+
+	// Remove a client record from the private ID index if it is still indexed, return false if it was not
+	bool RemovePrivate(const ClientRecordPtr& record);
+
+	// Remove a client record from the public ID index if it is still indexed
+	void RemovePublic(const ClientRecordPtr& record);
+
+	// Change some attributes of a connected client, with the shard of its public ID locked, noting the change for subscribers
+	void PatchRecord(DatabaseShard& shard, const ClientKey& key, const ClientRecordPtr& record, ClientPatch* pBegin, ClientPatch* pEnd, std::vector<ClientChange>& changes);
+
+	// Move a client between secondary index entries and columns when its data changes, with the shard locked.
+	// Either data may be null, when the client is added or removed.
+	void UpdateIndexes(DatabaseShard& shard, const ClientRecordPtr& record, const ClientData* pOldData, const ClientData* pNewData);
+
+	// Move a client between secondary index entries and columns when the value of a key changes, with the shard locked
+	void UpdateIndexedKey(DatabaseShard& shard, const ClientRecordPtr& record, AttributeKey key, const ClientAttribute* pOldValue, const ClientAttribute* pNewValue);
+
+	// Count a search on a key that has no index without locking, queuing the index after enough searches
+	void CountKeySearch(const std::string& key);
+
+	// Halve the search counts of all keys, so that only keys searched recently get indexed
+	void DecayKeySearches();
+
+	// Remove the idle clients of a shard, a batch at a time so that the shard stays available
+	void ExpireClients(DatabaseShard& shard);
+
+	// Get the expiry wheel tick of a time
+	static int64_t GetExpiryTick(ActivityClock::time_point time);
+
 
 private:
 
 	// Data
-	std::map<std::string, std::string>              mPrivateToPublic;
-	std::map<std::string, ClientData>               mData;
+	std::vector<std::unique_ptr<DatabaseShard>>     mShards;
+	std::atomic<int>                                mClientCount;
+
+	// Secondary indexes
+	std::shared_ptr<const std::set<std::string>>    mIndexedKeys;
+	std::vector<std::atomic<int>>                   mKeySearchCounts;
+	std::vector<std::string>                        mPendingIndexes;
+	size_t                                          mAutoIndexCount;
+	std::mutex                                      mIndexMutex;
+	std::shared_ptr<const SearchStatistics>         mStatistics;
 
 	// Settings
 	int                                             mUpdatePeriod;
 	int                                             mClientIdleTime;
+	int                                             mAutoIndexSearches;
+	DatabaseEngine                                  mEngine;
+	static const size_t                             cMaxAutoIndexes = 16;
+	static const size_t                             cStatisticsSamples = 4096;
+	static const size_t                             cExpiryBatch = 256;
+	static const size_t                             cMaxSpareData = 64;
 
 	// Utils
 	std::thread                                     mThread;
-	std::mutex                                      mMutex;
 	std::atomic<bool>                               mRunning;
+	std::mutex                                      mRunningMutex;
+	std::condition_variable                         mRunningCondition;
 	DatabaseTime                                    mStartupTime;
 
 };
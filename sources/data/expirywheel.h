@@ -0,0 +1,138 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+
+
+/*-----------------------------------------------------------------------------
+	ExpiryWheel class definition
+-----------------------------------------------------------------------------*/
+
+// Timing wheel of items waiting for a deadline, in ticks. Each bucket holds the items due at one tick
+// of the wheel's span, so that expiring only visits due items. Deadlines past the span are clamped to
+// its end : the caller checks each due item and inserts it again if its real deadline is later.
+// Items are pointers to objects with expiryBucket and expiryPosition members, which the wheel maintains
+// so that items can be removed without searching.
+template<typename Pointer>
+class ExpiryWheel
+{
+public:
+
+	// Cover deadlines up to span ticks after the current one, starting at startTick
+	ExpiryWheel(size_t span, int64_t startTick)
+		: mCount(0)
+		, mCursor(startTick)
+	{
+		size_t size = cMinBuckets;
+		while (size < span + 2 && size < cMaxBuckets)
+		{
+			size *= 2;
+		}
+		mBuckets.resize(size);
+	}
+
+
+	// Add an item due at a tick, or at the next tick if it is already past
+	void Insert(const Pointer& item, int64_t tick)
+	{
+		assert(item->expiryBucket == cInvalidBucket);
+
+		tick = std::min<int64_t>(std::max<int64_t>(tick, mCursor + 1), mCursor + mBuckets.size() - 1);
+		std::vector<Pointer>& bucket = mBuckets[size_t(tick) & (mBuckets.size() - 1)];
+
+		item->expiryBucket = size_t(tick) & (mBuckets.size() - 1);
+		item->expiryPosition = bucket.size();
+		bucket.push_back(item);
+		mCount++;
+	}
+
+	// Remove an item if it is in the wheel
+	void Erase(const Pointer& item)
+	{
+		if (item->expiryBucket == cInvalidBucket)
+		{
+			return;
+		}
+
+		// Move the last item of the bucket into its place
+		std::vector<Pointer>& bucket = mBuckets[item->expiryBucket];
+		size_t position = item->expiryPosition;
+		if (position != bucket.size() - 1)
+		{
+			bucket[position] = std::move(bucket.back());
+			bucket[position]->expiryPosition = position;
+		}
+
+		item->expiryBucket = cInvalidBucket;
+		bucket.pop_back();
+		mCount--;
+	}
+
+	// Remove up to maxCount items due at or before a tick, calling a function on each of them, which may
+	// insert them again at a later tick. Return the number of items removed : less than maxCount once
+	// all due items were removed.
+	template<typename Function>
+	size_t Expire(int64_t tick, size_t maxCount, Function function)
+	{
+		size_t count = 0;
+
+		// After a long pause, every bucket is due once
+		if (tick - mCursor >= int64_t(mBuckets.size()))
+		{
+			mCursor = tick - mBuckets.size() + 1;
+		}
+
+		while (mCursor <= tick)
+		{
+			std::vector<Pointer>& bucket = mBuckets[size_t(mCursor) & (mBuckets.size() - 1)];
+			while (bucket.size())
+			{
+				if (count == maxCount)
+				{
+					return count;
+				}
+
+				Pointer item = std::move(bucket.back());
+				bucket.pop_back();
+				item->expiryBucket = cInvalidBucket;
+				mCount--;
+				count++;
+
+				function(item);
+			}
+
+			// Release the memory of buckets that held a burst of items
+			if (bucket.capacity() > cMaxIdleCapacity)
+			{
+				std::vector<Pointer>().swap(bucket);
+			}
+			mCursor++;
+		}
+
+		return count;
+	}
+
+	// Get the number of items
+	size_t Size() const
+	{
+		return mCount;
+	}
+
+public:
+
+	static const size_t                             cInvalidBucket = SIZE_MAX;
+
+
+private:
+
+	size_t                                          mCount;
+	int64_t                                         mCursor;
+	std::vector<std::vector<Pointer>>               mBuckets;
+
+	static const size_t                             cMinBuckets = 16;
+	static const size_t                             cMaxBuckets = 4096;
+	static const size_t                             cMaxIdleCapacity = 1024;
+
+};
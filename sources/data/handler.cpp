@@ -1,5 +1,14 @@
 #include "handler.h"
+#include "network/networkstats.h"
 #include <iostream>
+#include <algorithm>
+
+
+/*-----------------------------------------------------------------------------
+	Constants
+-----------------------------------------------------------------------------*/
+
+const char Handler::cOKReply[] = "{\"reply\":{\"status\":\"OK\"}}";
 
 
 /*-----------------------------------------------------------------------------
@@ -9,11 +18,27 @@
 Handler::Handler(std::shared_ptr<Database> pDb, std::string clientAddress)
 	: mpDatabase(pDb)
 	, mClientAddress(clientAddress)
+	, mAddedKeyCount(0)
+	, mIsShared(false)
+	, mIsBinary(false)
+	, mIsBinaryNotifications(false)
+	, mStatus(RequestStatus::T_OK)
 {
 }
 
 Handler::~Handler()
 {
+	if (mSubscriber && mSubscriptions.size())
+	{
+		mTargetIds.assign(mSubscriptions.begin(), mSubscriptions.end());
+		mpDatabase->Unsubscribe(mSubscriber, mTargetIds);
+	}
+
+	// Writers that got the subscriber list before it was unsubscribed may still push to it
+	if (mSubscriber)
+	{
+		mSubscriber->Close();
+	}
 }
 
 
@@ -23,139 +48,759 @@ Handler::~Handler()
 
 bool Handler::ProcessClientRequest(const std::string& dataIn, std::string& dataOut)
 {
-	Json::Value request;
-	Json::Value reply;
-	Json::Value defValue;
-	bool isSuccess = true;
+	mIsBinary = dataIn.length() && uint8_t(dataIn[0]) == cBinaryMagic;
+	bool isSuccess = mIsBinary ? mBinaryParser.Parse(dataIn, mRequest) : mParser.Parse(dataIn, mRequest);
+
+	mStatus = RequestStatus::T_OK;
+	mQueryData = nullptr;
+	mMultiQueryData.clear();
+	mMultiQueryKeys.clear();
+	mSearchResults.clear();
+	mSearchPlan = ClientSearchPlan();
+	mKeys.clear();
+	mBatchStatus.clear();
+	mLostSessions.clear();
 
-	if (mReader.parse(dataIn, request))
+	// Disconnect if the request is not valid
+	if (isSuccess)
 	{
-		reply["reply"]["status"] = std::string("OK");
+		RunCommands();
+	}
+	else
+	{
+		mRequest.Clear();
+		mStatus = RequestStatus::T_INVALID;
+	}
 
-		// Connection request : add / update entry in database
-		if (!request["connect"].empty() && request["connect"]["privateId"].asString().length())
-		{
-			std::string privateId = request["connect"]["privateId"].asString();
-			std::string publicId = request["connect"]["publicId"].asString();
+	dataOut.clear();
+	if (mIsBinary)
+	{
+		WriteBinaryReply(dataOut);
+	}
+	else
+	{
+		WriteJsonReply(dataOut);
+	}
+	return isSuccess;
+}
+
+void Handler::SetNotificationWake(std::function<void()> wake)
+{
+	mNotificationWake = wake;
+}
 
-			mpDatabase->ConnectClient(privateId, publicId, mClientAddress);
+bool Handler::WriteNotifications(std::string& dataOut)
+{
+	if (mSubscriber == nullptr)
+	{
+		return false;
+	}
+
+	// Changes may have been queued just before their clients were unsubscribed. Writers push in any order, so a
+	// record that is no longer connected only reports its disconnection if no other record took its public ID since.
+	mSubscriber->Pop(mNotifications);
+	mNotifications.erase(std::remove_if(mNotifications.begin(), mNotifications.end(), [&](ClientNotification& notification)
+	{
+		const ClientRecord& record = *notification.record;
+		if (mSubscriptions.find(record.publicId) == mSubscriptions.end())
+		{
+			return true;
 		}
+		else if (notification.event == ClientEvent::T_DISCONNECTED || !record.IsConnected())
+		{
+			notification.event = ClientEvent::T_DISCONNECTED;
+			return mpDatabase->IsConnectedPublic(record.publicId);
+		}
+		return false;
+	}), mNotifications.end());
+	if (mNotifications.empty())
+	{
+		return false;
+	}
 
-		// Connection request : add / update entry in database
-		if (!request["disconnect"].empty())
+	dataOut.clear();
+	if (mIsBinaryNotifications)
+	{
+		BinaryWriter writer(dataOut);
+		writer.Byte(cBinaryMagic);
+		writer.Byte(uint8_t(BinaryCommand::T_SUBSCRIBE));
+		writer.Varint(mNotifications.size());
+		for (auto& notification : mNotifications)
 		{
-			std::string privateId = request["disconnect"]["privateId"].asString();
+			writer.String(notification.record->publicId);
+			writer.Byte(uint8_t(notification.event));
+			if (notification.event != ClientEvent::T_DISCONNECTED)
+			{
+				writer.Attributes(notification.record->GetData()->attributes);
+			}
+		}
+	}
+	else
+	{
+		JsonWriter writer(dataOut);
+		writer.BeginObject();
+		writer.Key("notify");
+		writer.BeginArray();
+		for (auto& notification : mNotifications)
+		{
+			writer.BeginObject();
+			writer.Key("publicId");
+			writer.String(notification.record->publicId);
+			writer.Key("event");
+			writer.String(GetEventText(notification.event));
+			if (notification.event != ClientEvent::T_DISCONNECTED)
+			{
+				ClientDataPtr data = notification.record->GetData();
+				const std::string& payload = data->GetPayload();
+				writer.Key("data");
+				writer.Raw(payload.data(), payload.length());
+			}
+			writer.EndObject();
+		}
+		writer.EndArray();
+		writer.EndObject();
+	}
 
-			if (mpDatabase->IsConnectedPrivate(privateId))
+	// Release the records
+	mNotifications.clear();
+	return true;
+}
+
+
+/*-----------------------------------------------------------------------------
+	Commands
+-----------------------------------------------------------------------------*/
+
+void Handler::RunCommands()
+{
+	const ClientRequest& request = mRequest;
+
+	// Any request from the client bound to this connection shows it is active
+	if (mClient)
+	{
+		mpDatabase->HeartbeatClient(mClient);
+	}
+
+	// Connection request : add / update entry in database, and bind this connection to the client
+	if (request.hasConnect && request.connectPrivateId.length)
+	{
+		std::string privateId = request.connectPrivateId.ToString();
+		std::string publicId = request.connectPublicId.ToString();
+
+		// Sessions are numbered by the client instead, so that a proxy can address its players without their identifiers
+		if (request.hasConnectSession)
+		{
+			uint32_t session = request.connectSession;
+			if (session < cMaxSessions)
 			{
-				mpDatabase->DisconnectClient(privateId);
+				if (mSessions.size() <= session)
+				{
+					mSessions.resize(session + 1);
+				}
+				mSessions[session] = mpDatabase->ConnectClient(privateId, publicId, mClientAddress);
 			}
 			else
 			{
-				reply["reply"]["status"] = std::string("Target is not connected");
+				mStatus = RequestStatus::T_INVALID_SESSION;
+			}
+		}
+		else
+		{
+			// A connection that connects several clients serves them all, and is bound to none
+			if (mClient && mClient->privateId != privateId && mClient->IsConnected())
+			{
+				mIsShared = true;
+			}
+
+			ClientRecordPtr client = mpDatabase->ConnectClient(privateId, publicId, mClientAddress);
+			mClient = mIsShared ? nullptr : client;
+		}
+	}
+
+	// Connection request : add / update entry in database
+	if (request.hasDisconnect)
+	{
+		ClientRecordPtr client = GetClient(request.disconnect);
+
+		if (request.disconnect.isAllSessions)
+		{
+			mStatus = RequestStatus::T_INVALID;
+		}
+		else if (mpDatabase->DisconnectClient(client))
+		{
+			if (client == mClient)
+			{
+				mClient = nullptr;
+			}
+			if (request.disconnect.hasSession)
+			{
+				mSessions[request.disconnect.session] = nullptr;
 			}
 		}
+		else
+		{
+			mStatus = RequestStatus::T_NOT_CONNECTED;
+		}
+	}
 
-		// Server stats
-		if (!request["stats"].empty())
+	// Attribute keys : identifiers are given to new names, so that clients can use them before setting them
+	if (request.hasKeys)
+	{
+		for (auto& name : request.keyNames)
 		{
-			reply["reply"]["count"] = mpDatabase->GetConnectedClientsCount();
-			reply["reply"]["uptime"] = mpDatabase->GetUptime().count();
+			mKeys.push_back(AddKey(name.ToString()));
 		}
+	}
 
-		// Update request : write the new client data in the database
-		if (!request["update"].empty())
+	// Update request : write the new client data in the database
+	if (request.hasUpdate)
+	{
+		ClientRecordPtr client = GetClient(request.update);
+
+		// Gather the changes : values to set, keys to remove, numbers to add
+		mPatches.clear();
+		RequestStatus status = AddPatches(request.updateData.data(), request.updateData.data() + request.updateData.size(), ClientPatchOperation::T_SET);
+		if (status == RequestStatus::T_OK)
 		{
-			std::string privateId = request["update"]["privateId"].asString();
+			status = AddPatches(request.updateIncrement.data(), request.updateIncrement.data() + request.updateIncrement.size(), ClientPatchOperation::T_INCREMENT);
+		}
+		AddRemovals(request.updateRemove.data(), request.updateRemove.data() + request.updateRemove.size());
 
-			if (mpDatabase->IsConnectedPrivate(privateId))
+		if (request.update.isAllSessions)
+		{
+			mStatus = RequestStatus::T_INVALID;
+		}
+		else if (status != RequestStatus::T_OK)
+		{
+			mStatus = status;
+		}
+		else if (!mpDatabase->PatchClient(client, mPatches))
+		{
+			mStatus = RequestStatus::T_NOT_CONNECTED;
+		}
+	}
+
+	// Heartbeat request : mark client as active, or all sessions, forgetting those whose client is gone
+	if (request.hasHeartbeat)
+	{
+		if (request.heartbeat.isAllSessions)
+		{
+			for (uint32_t session = 0; session < mSessions.size(); session++)
 			{
-				ClientData data = mpDatabase->QueryClientPrivate(privateId);
-				for (std::string& key : request["update"]["data"].getMemberNames())
+				if (mSessions[session] && !mpDatabase->HeartbeatClient(mSessions[session]))
 				{
-					SetClientAttribute(data.attributes[key], request["update"]["data"].get(key, defValue));
+					mSessions[session] = nullptr;
+					mLostSessions.push_back(session);
 				}
+			}
+		}
+		else if (!mpDatabase->HeartbeatClient(GetClient(request.heartbeat)))
+		{
+			mStatus = RequestStatus::T_NOT_CONNECTED;
+		}
+	}
 
-				mpDatabase->UpdateClient(privateId, data);
+	// Batch : gather all operations, so that the database locks each shard once for them
+	if (request.hasBatch)
+	{
+		mPatches.clear();
+		mOperations.resize(request.batch.size());
+		mBatchStatus.assign(request.batch.size(), RequestStatus::T_OK);
+		for (size_t i = 0; i < request.batch.size(); i++)
+		{
+			const RequestOperation& requestOperation = request.batch[i];
+			const RequestTarget& target = requestOperation.target;
+			ClientOperation& operation = mOperations[i];
+
+			// Operations target a session, the client bound to this connection if they have no identifier, or are looked up
+			bool isBound = !target.hasPrivateId || (mClient && target.privateId == mClient->privateId && mClient->IsConnected());
+			operation.record = target.hasSession ? GetSession(target.session) : (isBound ? mClient : nullptr);
+			operation.privateId.assign(isBound ? "" : target.privateId.data, isBound ? 0 : target.privateId.length);
+			operation.isPatch = (requestOperation.type == RequestOperationType::T_UPDATE);
+			operation.patchBegin = mPatches.size();
+
+			// Only the heartbeat command targets all sessions
+			RequestStatus& status = mBatchStatus[i];
+			if (requestOperation.type == RequestOperationType::T_INVALID || target.isAllSessions)
+			{
+				status = RequestStatus::T_INVALID;
 			}
-			else
+			else if (operation.isPatch)
+			{
+				const RequestAttribute* pData = request.batchData.data();
+				const RequestAttribute* pIncrement = request.batchIncrement.data();
+				const RequestKey* pRemove = request.batchRemove.data();
+				status = AddPatches(pData + requestOperation.data.begin, pData + requestOperation.data.end, ClientPatchOperation::T_SET);
+				if (status == RequestStatus::T_OK)
+				{
+					status = AddPatches(pIncrement + requestOperation.increment.begin, pIncrement + requestOperation.increment.end, ClientPatchOperation::T_INCREMENT);
+				}
+				AddRemovals(pRemove + requestOperation.remove.begin, pRemove + requestOperation.remove.end);
+			}
+
+			// Operations that can't run are given no client, so that they fail
+			if (status != RequestStatus::T_OK)
 			{
-				reply["reply"]["status"] = std::string("Target is not connected");
+				operation.record = nullptr;
+				operation.privateId.clear();
+				mPatches.erase(mPatches.begin() + operation.patchBegin, mPatches.end());
 			}
+			operation.patchEnd = mPatches.size();
 		}
 
-		// Heartbeat request : mark client as active
-		if (!request["heartbeat"].empty())
+		mpDatabase->RunOperations(mOperations, mPatches);
+		for (size_t i = 0; i < mOperations.size(); i++)
 		{
-			std::string privateId = request["heartbeat"]["privateId"].asString();
+			if (mBatchStatus[i] == RequestStatus::T_OK && !mOperations[i].isSuccess)
+			{
+				mBatchStatus[i] = RequestStatus::T_NOT_CONNECTED;
+			}
+		}
+	}
 
-			if (mpDatabase->IsConnectedPrivate(privateId))
+	// Subscriptions, before queries so that the changes of the clients they return are sent
+	if (request.hasUnsubscribe)
+	{
+		Unsubscribe(request.unsubscribeIds);
+	}
+	if (request.hasSubscribe)
+	{
+		RequestStatus status = Subscribe(request.subscribeIds);
+		if (status != RequestStatus::T_OK)
+		{
+			mStatus = status;
+		}
+	}
+
+	// Query client info
+	if (request.hasQuery)
+	{
+		std::string targetId = request.queryTargetId.ToString();
+
+		mQueryData = mpDatabase->QueryClientPublic(targetId);
+		if (!mQueryData)
+		{
+			mStatus = RequestStatus::T_NOT_CONNECTED;
+		}
+	}
+
+	// Query many clients, keeping the keys to reply with, that are known
+	if (request.hasMultiQuery)
+	{
+		for (const RequestKey& key : request.multiQueryKeys)
+		{
+			AttributeKey keyId = GetKey(key, false);
+			if (!key.name.data && keyId == AttributeKeys::cInvalidKey)
 			{
-				mpDatabase->HeartbeatClient(privateId);
+				mStatus = RequestStatus::T_UNKNOWN_KEY;
+				return;
 			}
-			else
+			else if (keyId != AttributeKeys::cInvalidKey)
 			{
-				reply["reply"]["status"] = std::string("Target is not connected");
+				mMultiQueryKeys.push_back(keyId);
 			}
 		}
 
-		// Query client info
-		if (!request["query"].empty())
+		mTargetIds.resize(request.multiQueryIds.size());
+		for (size_t i = 0; i < request.multiQueryIds.size(); i++)
 		{
-			std::string targetId = request["query"]["targetId"].asString();
+			mTargetIds[i].assign(request.multiQueryIds[i].data, request.multiQueryIds[i].length);
+		}
+		mpDatabase->QueryClientsPublic(mTargetIds, mMultiQueryData);
+	}
 
-			if (mpDatabase->IsConnectedPublic(targetId))
+	// Search clients
+	if (request.hasSearch)
+	{
+		// Process the search parameters, keys given by identifier being named
+		std::vector<ClientSearchCriterion> criteria;
+		for (auto& searchCriterion : request.search)
+		{
+			const RequestKey& key = searchCriterion.key;
+			if (!key.name.data && !AttributeKeys::Get().IsValid(key.id))
 			{
-				const ClientData& data = mpDatabase->QueryClientPublic(targetId);
-				for (auto& entry : data.attributes)
-				{
-					SetJsonValue(reply["reply"]["data"][entry.first], entry.second);
-				}
+				mStatus = RequestStatus::T_UNKNOWN_KEY;
+				return;
+			}
+
+			ClientAttribute value;
+			std::string name = key.name.data ? key.name.ToString() : AttributeKeys::Get().GetName(key.id);
+			SetClientAttribute(value, searchCriterion.value);
+			ClientSearchCondition type = searchCriterion.conditionValue >= 0
+				? ClientSearchCondition(searchCriterion.conditionValue)
+				: GetCondition(searchCriterion.condition);
+
+			criteria.push_back(ClientSearchCriterion(name, value, type));
+		}
+
+		mSearchResults = mpDatabase->SearchClients(criteria, 10, &mSearchPlan);
+	}
+}
+
+
+RequestStatus Handler::Subscribe(const std::vector<StringView>& publicIds)
+{
+	// Connections that can't be woken would only get notifications with their next reply
+	if (mNotificationWake == nullptr)
+	{
+		return RequestStatus::T_NO_SUBSCRIPTIONS;
+	}
+
+	mTargetIds.clear();
+	for (const StringView& publicId : publicIds)
+	{
+		std::string id = publicId.ToString();
+		if (mSubscriptions.find(id) == mSubscriptions.end())
+		{
+			mTargetIds.push_back(id);
+		}
+	}
+	std::sort(mTargetIds.begin(), mTargetIds.end());
+	mTargetIds.erase(std::unique(mTargetIds.begin(), mTargetIds.end()), mTargetIds.end());
+
+	if (mSubscriptions.size() + mTargetIds.size() > cMaxSubscriptions)
+	{
+		return RequestStatus::T_TOO_MANY_SUBSCRIPTIONS;
+	}
+
+	// Notifications use the protocol of the latest subscription
+	if (mSubscriber == nullptr)
+	{
+		mSubscriber = std::make_shared<ClientSubscriber>(mNotificationWake);
+	}
+	mIsBinaryNotifications = mIsBinary;
+	mSubscriptions.insert(mTargetIds.begin(), mTargetIds.end());
+	mpDatabase->Subscribe(mSubscriber, mTargetIds);
+	return RequestStatus::T_OK;
+}
+
+void Handler::Unsubscribe(const std::vector<StringView>& publicIds)
+{
+	mTargetIds.clear();
+	for (const StringView& publicId : publicIds)
+	{
+		auto it = mSubscriptions.find(publicId.ToString());
+		if (it != mSubscriptions.end())
+		{
+			mTargetIds.push_back(*it);
+			mSubscriptions.erase(it);
+		}
+	}
+
+	if (mTargetIds.size())
+	{
+		mpDatabase->Unsubscribe(mSubscriber, mTargetIds);
+	}
+}
+
+
+/*-----------------------------------------------------------------------------
+	Replies
+-----------------------------------------------------------------------------*/
+
+void Handler::WriteJsonReply(std::string& dataOut)
+{
+	const ClientRequest& request = mRequest;
+
+	// Members of the reply are written in the order of commands, its status last
+	JsonWriter writer(dataOut);
+	writer.BeginObject();
+	writer.Key("reply");
+	writer.BeginObject();
+	size_t emptyLength = dataOut.length();
+
+	// Server stats
+	if (request.hasStats)
+	{
+		writer.Key("count");
+		writer.Int(mpDatabase->GetConnectedClientsCount());
+		writer.Key("uptime");
+		writer.Int(mpDatabase->GetUptime().count());
+
+		NetworkStats& networkStats = NetworkStats::Get();
+		writer.Key("handshakes");
+		writer.BeginObject();
+		writer.Key("inFlight");
+		writer.Int(networkStats.handshakesInFlight.load());
+		writer.Key("completed");
+		writer.Int(networkStats.handshakesCompleted.load());
+		writer.Key("failed");
+		writer.Int(networkStats.handshakesFailed.load());
+		writer.Key("resumed");
+		writer.Int(networkStats.handshakesResumed.load());
+		writer.Key("kernelSend");
+		writer.Int(networkStats.kernelTLSSend.load());
+		writer.Key("kernelRecv");
+		writer.Int(networkStats.kernelTLSRecv.load());
+		writer.EndObject();
+	}
+
+	// Sessions that were lost
+	if (mLostSessions.size())
+	{
+		writer.Key("lostSessions");
+		writer.BeginArray();
+		for (uint32_t session : mLostSessions)
+		{
+			writer.Unsigned(session);
+		}
+		writer.EndArray();
+	}
+
+	// Status of each operation of a batch
+	if (request.hasBatch)
+	{
+		writer.Key("batch");
+		writer.BeginArray();
+		for (RequestStatus status : mBatchStatus)
+		{
+			writer.String(GetStatusText(status));
+		}
+		writer.EndArray();
+	}
+
+	// Query client info
+	if (mQueryData)
+	{
+		const std::string& payload = mQueryData->GetPayload();
+		writer.Key("data");
+		writer.Raw(payload.data(), payload.length());
+	}
+
+	// Query many clients, null for those not connected
+	if (request.hasMultiQuery && mStatus != RequestStatus::T_UNKNOWN_KEY)
+	{
+		writer.Key("players");
+		writer.BeginArray();
+		for (const ClientDataPtr& data : mMultiQueryData)
+		{
+			if (!data)
+			{
+				writer.Null();
+			}
+			else if (!request.hasMultiQueryKeys)
+			{
+				const std::string& payload = data->GetPayload();
+				writer.Raw(payload.data(), payload.length());
 			}
 			else
 			{
-				reply["reply"]["status"] = std::string("Target is not connected");
+				writer.BeginObject();
+				for (AttributeKey key : mMultiQueryKeys)
+				{
+					const ClientAttribute* pValue = data->attributes.Find(key);
+					if (pValue)
+					{
+						writer.Key(AttributeKeys::Get().GetName(key));
+						writer.Attribute(*pValue);
+					}
+				}
+				writer.EndObject();
 			}
 		}
+		writer.EndArray();
+	}
 
-		// Search clients
-		if (!request["search"].empty() && request["search"].isArray())
+	// Search clients
+	if (mSearchResults.size())
+	{
+		writer.Key("clients");
+		writer.BeginObject();
+		for (auto& data : mSearchResults)
 		{
-			// Process the search parameters
-			std::vector<ClientSearchCriterion> criteria;
-			for (auto& searchCriterion : request["search"])
-			{
-				ClientAttribute value;
-				std::string key = searchCriterion["key"].asString();
-				SetClientAttribute(value, searchCriterion["value"]);
-				ClientSearchCondition type = GetCondition(searchCriterion["condition"].asString());
+			const std::string& payload = data.second->GetPayload();
+			writer.Key(data.first);
+			writer.Raw(payload.data(), payload.length());
+		}
+		writer.EndObject();
+	}
+
+	// Describe the plan
+	if (request.hasSearch && request.explain)
+	{
+		writer.Key("plan");
+		writer.BeginObject();
+		writer.Key("access");
+		writer.String(mSearchPlan.GetAccessName());
+		writer.Key("indexes");
+		writer.BeginArray();
+		for (auto& key : mSearchPlan.indexKeys)
+		{
+			writer.String(key);
+		}
+		writer.EndArray();
+		writer.Key("order");
+		writer.BeginArray();
+		for (auto& crit : mSearchPlan.criteria)
+		{
+			writer.String(crit.key);
+		}
+		writer.EndArray();
+		writer.Key("estimatedRows");
+		writer.Double(mSearchPlan.estimatedRows);
+		writer.Key("estimatedCost");
+		writer.Double(mSearchPlan.estimatedCost);
+		writer.Key("visited");
+		writer.Unsigned(mSearchPlan.visitedClients);
+		writer.EndObject();
+	}
+
+	// Most replies are only a success
+	if (dataOut.length() == emptyLength && mStatus == RequestStatus::T_OK)
+	{
+		dataOut.assign(cOKReply, sizeof(cOKReply) - 1);
+	}
+	else
+	{
+		writer.Key("status");
+		writer.String(GetStatusText(mStatus));
+		writer.EndObject();
+		writer.EndObject();
+	}
+}
+
+void Handler::WriteBinaryReply(std::string& dataOut)
+{
+	const ClientRequest& request = mRequest;
+
+	// The status comes first, then a section for each command with results, tagged by the command
+	BinaryWriter writer(dataOut);
+	writer.Byte(cBinaryMagic);
+	writer.Byte(uint8_t(mStatus));
 
-				criteria.push_back(ClientSearchCriterion(key, value, type));
+	// Server stats
+	if (request.hasStats)
+	{
+		NetworkStats& networkStats = NetworkStats::Get();
+		writer.Byte(uint8_t(BinaryCommand::T_STATS));
+		writer.Varint(mpDatabase->GetConnectedClientsCount());
+		writer.Varint(mpDatabase->GetUptime().count());
+		writer.Varint(networkStats.handshakesInFlight.load());
+		writer.Varint(networkStats.handshakesCompleted.load());
+		writer.Varint(networkStats.handshakesFailed.load());
+		writer.Varint(networkStats.handshakesResumed.load());
+		writer.Varint(networkStats.kernelTLSSend.load());
+		writer.Varint(networkStats.kernelTLSRecv.load());
+	}
+
+	// Attribute keys, zero meaning the table is full
+	if (request.hasKeys)
+	{
+		writer.Byte(uint8_t(BinaryCommand::T_KEYS));
+		writer.Varint(mKeys.size());
+		for (AttributeKey key : mKeys)
+		{
+			writer.Varint(key == AttributeKeys::cInvalidKey ? 0 : uint64_t(key) + 1);
+		}
+	}
+
+	// Attribute key names, empty if unknown
+	if (request.hasKeyNames)
+	{
+		writer.Byte(uint8_t(BinaryCommand::T_KEY_NAMES));
+		writer.Varint(request.keyIds.size());
+		for (AttributeKey key : request.keyIds)
+		{
+			writer.String(AttributeKeys::Get().IsValid(key) ? AttributeKeys::Get().GetName(key) : std::string());
+		}
+	}
+
+	// Sessions that were lost, for heartbeats of all sessions
+	if (request.hasHeartbeat && request.heartbeat.isAllSessions)
+	{
+		writer.Byte(uint8_t(BinaryCommand::T_HEARTBEAT));
+		writer.Varint(mLostSessions.size());
+		for (uint32_t session : mLostSessions)
+		{
+			writer.Varint(session);
+		}
+	}
+
+	// Status of each operation of a batch
+	if (request.hasBatch)
+	{
+		writer.Byte(uint8_t(BinaryCommand::T_BATCH));
+		writer.Varint(mBatchStatus.size());
+		for (RequestStatus status : mBatchStatus)
+		{
+			writer.Byte(uint8_t(status));
+		}
+	}
+
+	// Query client info
+	if (mQueryData)
+	{
+		writer.Byte(uint8_t(BinaryCommand::T_QUERY));
+		writer.Attributes(mQueryData->attributes);
+	}
+
+	// Query many clients : whether each is connected, then its attributes if it is
+	if (request.hasMultiQuery && mStatus != RequestStatus::T_UNKNOWN_KEY)
+	{
+		writer.Byte(uint8_t(BinaryCommand::T_MULTI_QUERY));
+		writer.Varint(mMultiQueryData.size());
+		for (const ClientDataPtr& data : mMultiQueryData)
+		{
+			writer.Byte(data != nullptr);
+			if (!data)
+			{
+				continue;
+			}
+			else if (!request.hasMultiQueryKeys)
+			{
+				writer.Attributes(data->attributes);
+				continue;
 			}
 
-			// Process results
-			ClientSearchResult results = mpDatabase->SearchClients(criteria);
-			for (auto& data : results)
+			size_t count = 0;
+			for (AttributeKey key : mMultiQueryKeys)
 			{
-				for (auto& entry : data.second.attributes)
+				count += (data->attributes.Find(key) != nullptr);
+			}
+			writer.Varint(count);
+			for (AttributeKey key : mMultiQueryKeys)
+			{
+				const ClientAttribute* pValue = data->attributes.Find(key);
+				if (pValue)
 				{
-					SetJsonValue(reply["reply"]["clients"][data.first][entry.first], entry.second);
+					writer.Key(key);
+					writer.Attribute(*pValue);
 				}
 			}
 		}
 	}
 
-	// Disconnect
-	else
+	// Search clients, even without results
+	if (request.hasSearch && mStatus != RequestStatus::T_UNKNOWN_KEY)
 	{
-		reply["reply"]["status"] = std::string("Could not parse request");
-		isSuccess = false;
-	}
+		writer.Byte(uint8_t(BinaryCommand::T_SEARCH));
+		writer.Varint(mSearchResults.size());
+		for (auto& data : mSearchResults)
+		{
+			writer.String(data.first);
+			writer.Attributes(data.second->attributes);
+		}
 
-	// Send reply
-	Json::StreamWriterBuilder builder;
-	dataOut = Json::writeString(builder, reply);
-	return isSuccess;
+		// Describe the plan
+		if (request.explain)
+		{
+			writer.Byte(uint8_t(BinaryCommand::T_PLAN));
+			writer.String(mSearchPlan.GetAccessName(), strlen(mSearchPlan.GetAccessName()));
+			writer.Varint(mSearchPlan.indexKeys.size());
+			for (auto& key : mSearchPlan.indexKeys)
+			{
+				writer.String(key);
+			}
+			writer.Varint(mSearchPlan.criteria.size());
+			for (auto& crit : mSearchPlan.criteria)
+			{
+				writer.String(crit.key);
+			}
+			writer.Double(mSearchPlan.estimatedRows);
+			writer.Double(mSearchPlan.estimatedCost);
+			writer.Varint(mSearchPlan.visitedClients);
+		}
+	}
 }
 
 
@@ -163,42 +808,151 @@ bool Handler::ProcessClientRequest(const std::string& dataIn, std::string& dataO
 	Private methods
 -----------------------------------------------------------------------------*/
 
-ClientSearchCondition Handler::GetCondition(const std::string& v)
+ClientRecordPtr Handler::GetClient(const RequestTarget& target)
+{
+	// Sessions are found by number, commands without identifier target the client bound to this connection.
+	// Targeting all sessions is only valid for heartbeats, that don't use this.
+	if (target.isAllSessions)
+	{
+		return nullptr;
+	}
+	else if (target.hasSession)
+	{
+		return GetSession(target.session);
+	}
+	else if (!target.hasPrivateId)
+	{
+		return mClient;
+	}
+
+	const StringView& privateId = target.privateId;
+	if (mClient && privateId == mClient->privateId && mClient->IsConnected())
+	{
+		return mClient;
+	}
+
+	// Reuse the record of the previous identifier, only looking it up when it changed
+	if (mLastClient == nullptr || privateId != mLastClient->privateId || !mLastClient->IsConnected())
+	{
+		mLastClient = mpDatabase->GetClientRecord(privateId.ToString());
+	}
+	return mLastClient;
+}
+
+ClientRecordPtr Handler::GetSession(uint32_t session) const
+{
+	return (session < mSessions.size()) ? mSessions[session] : nullptr;
+}
+
+AttributeKey Handler::GetKey(const RequestKey& key, bool isAdded)
 {
-	if (v == "<")
+	if (key.name.data)
+	{
+		std::string name = key.name.ToString();
+		return isAdded ? AddKey(name) : AttributeKeys::Get().Find(name);
+	}
+
+	// Identifiers are only valid once given to a key
+	return AttributeKeys::Get().IsValid(key.id) ? key.id : AttributeKeys::cInvalidKey;
+}
+
+AttributeKey Handler::AddKey(const std::string& name)
+{
+	// Past the limit, existing keys can still be used
+	if (mAddedKeyCount >= cMaxConnectionKeys)
+	{
+		return AttributeKeys::Get().Find(name);
+	}
+
+	bool isAdded;
+	AttributeKey key = AttributeKeys::Get().Intern(name, mClientAddress, isAdded);
+	if (isAdded)
+	{
+		mAddedKeyCount++;
+	}
+	return key;
+}
+
+RequestStatus Handler::AddPatches(const RequestAttribute* pBegin, const RequestAttribute* pEnd, ClientPatchOperation operation)
+{
+	for (const RequestAttribute* pAttribute = pBegin; pAttribute != pEnd; pAttribute++)
+	{
+		AttributeKey keyId = GetKey(pAttribute->key, true);
+		if (keyId == AttributeKeys::cInvalidKey)
+		{
+			return pAttribute->key.name.data ? RequestStatus::T_TOO_MANY_KEYS : RequestStatus::T_UNKNOWN_KEY;
+		}
+
+		ClientAttribute value;
+		SetClientAttribute(value, pAttribute->value);
+		mPatches.push_back(ClientPatch(keyId, operation, std::move(value)));
+	}
+
+	return RequestStatus::T_OK;
+}
+
+void Handler::AddRemovals(const RequestKey* pBegin, const RequestKey* pEnd)
+{
+	for (const RequestKey* pKey = pBegin; pKey != pEnd; pKey++)
+	{
+		AttributeKey keyId = GetKey(*pKey, false);
+		if (keyId != AttributeKeys::cInvalidKey)
+		{
+			mPatches.push_back(ClientPatch(keyId, ClientPatchOperation::T_REMOVE));
+		}
+	}
+}
+
+ClientSearchCondition Handler::GetCondition(const StringView& v)
+{
+	if (v.Is("<"))
 		return ClientSearchCondition::T_LESSER;
-	else if (v == ">")
+	else if (v.Is(">"))
 		return ClientSearchCondition::T_GREATER;
-	else if (v == "<=")
+	else if (v.Is("<="))
 		return ClientSearchCondition::T_LESSER_EQ;
-	else if (v == ">=")
+	else if (v.Is(">="))
 		return ClientSearchCondition::T_GREATER_EQ;
+	else if (v.Is("!="))
+		return ClientSearchCondition::T_NEQUAL;
 	else
 		return ClientSearchCondition::T_EQUAL;
 }
 
-void Handler::SetClientAttribute(ClientAttribute& a, const Json::Value& v)
+void Handler::SetClientAttribute(ClientAttribute& a, const RequestValue& v)
 {
-	if (v.isInt())
-		a = ClientAttribute(v.asInt());
-	else if (v.isUInt())
-		a = ClientAttribute(v.asUInt());
-	else if (v.isDouble())
-		a = ClientAttribute(v.asDouble());
-	else if (v.isBool())
-		a = ClientAttribute(v.asBool());
-	else
-		a = ClientAttribute(v.asString());
+	switch (v.type)
+	{
+		case RequestValueType::T_INT: a = ClientAttribute(int(v.integer));                   break;
+		case RequestValueType::T_UNS: a = ClientAttribute((unsigned int)(v.integer));        break;
+		case RequestValueType::T_DBL: a = ClientAttribute(v.number);                         break;
+		case RequestValueType::T_BOL: a = ClientAttribute(v.integer != 0);                   break;
+		case RequestValueType::T_STR: a = ClientAttribute(v.string.data, v.string.length);   break;
+		default:                      a = ClientAttribute(std::string());                    break;
+	}
+}
+
+const char* Handler::GetStatusText(RequestStatus status)
+{
+	switch (status)
+	{
+		case RequestStatus::T_OK:                      return "OK";
+		case RequestStatus::T_NOT_CONNECTED:           return "Target is not connected";
+		case RequestStatus::T_TOO_MANY_KEYS:           return "Too many attribute keys";
+		case RequestStatus::T_UNKNOWN_KEY:             return "Unknown attribute key";
+		case RequestStatus::T_INVALID_SESSION:         return "Invalid session number";
+		case RequestStatus::T_TOO_MANY_SUBSCRIPTIONS:  return "Too many subscriptions";
+		case RequestStatus::T_NO_SUBSCRIPTIONS:        return "Subscriptions are not supported";
+		default:                                       return "Could not parse request";
+	}
 }
 
-void Handler::SetJsonValue(Json::Value& v, const ClientAttribute& a)
+const char* Handler::GetEventText(ClientEvent event)
 {
-	switch (a.type)
+	switch (event)
 	{
-		case ClientAttributeType::T_STR: v = a.s; break;
-		case ClientAttributeType::T_INT: v = a.i; break;
-		case ClientAttributeType::T_UNS: v = a.u; break;
-		case ClientAttributeType::T_DBL: v = a.d; break;
-		case ClientAttributeType::T_BOL: v = a.b; break;
+		case ClientEvent::T_CONNECTED:  return "connect";
+		case ClientEvent::T_UPDATED:    return "update";
+		default:                        return "disconnect";
 	}
-}
\ No newline at end of file
+}
@@ -2,8 +2,12 @@
 
 #include <string>
 #include <memory>
-#include "json/json.h"
+#include <functional>
+#include <unordered_set>
 #include "database.h"
+#include "request.h"
+#include "jsonwriter.h"
+#include "binaryprotocol.h"
 
 
 /*-----------------------------------------------------------------------------
@@ -22,29 +26,108 @@ public:
 public:
 
 	// Process data from a request and write a reply. Return true to keep connection.
+	// Requests starting with cBinaryMagic are binary, others are JSON, and are replied to the same way.
 	bool ProcessClientRequest(const std::string& dataIn, std::string& dataOut);
 
+	// Set the function called when notifications become pending, from the thread that changed the client.
+	// Subscriptions are rejected without it.
+	void SetNotificationWake(std::function<void()> wake);
+
+	// Write the pending notifications of subscribed clients as one message, in the protocol they were
+	// subscribed with. Return false if there are none.
+	bool WriteNotifications(std::string& dataOut);
+
 
 private:
 
+	// Run the commands of mRequest, keeping their results for the reply
+	void RunCommands();
+
+	// Start sending the changes of clients, return the failure if this connection has too many subscriptions,
+	// or can't be sent notifications as no wake function was set
+	RequestStatus Subscribe(const std::vector<StringView>& publicIds);
+
+	// Stop sending the changes of clients
+	void Unsubscribe(const std::vector<StringView>& publicIds);
+
+	// Write the reply to mRequest as JSON
+	void WriteJsonReply(std::string& dataOut);
+
+	// Write the reply to mRequest in the binary protocol
+	void WriteBinaryReply(std::string& dataOut);
+
 	// Generate a safe public identifier from the private identifier that is never revealed
 	static std::string GetPublicIdFromPrivateId(const std::string privateId);
 
+	// Get the client targeted by a command : the one it identifies, or the one bound to this connection
+	ClientRecordPtr GetClient(const RequestTarget& target);
+
+	// Get the client of a session of this connection, or null
+	ClientRecordPtr GetSession(uint32_t session) const;
+
+	// Get the identifier of a key in a request, adding it on behalf of the client address if isAdded, or cInvalidKey
+	AttributeKey GetKey(const RequestKey& key, bool isAdded);
+
+	// Get the identifier of a key name, adding it unless this connection already added cMaxConnectionKeys keys
+	AttributeKey AddKey(const std::string& name);
+
+	// Add changes to mPatches for each attribute, return the failure if a key could not be added
+	RequestStatus AddPatches(const RequestAttribute* pBegin, const RequestAttribute* pEnd, ClientPatchOperation operation);
+
+	// Add removals to mPatches for each known key
+	void AddRemovals(const RequestKey* pBegin, const RequestKey* pEnd);
+
 	// Get a search criteria from string
-	static ClientSearchCondition GetCondition(const std::string& v);
+	static ClientSearchCondition GetCondition(const StringView& v);
+
+	// Set a client attribute from a request value
+	static void SetClientAttribute(ClientAttribute& a, const RequestValue& v);
 
-	// Set a client attribute from a JSON value
-	static void SetClientAttribute(ClientAttribute& a, const Json::Value& v);
+	// Get the JSON status of a request
+	static const char* GetStatusText(RequestStatus status);
 
-	// Set a JSON value from a client attribute
-	static void SetJsonValue(Json::Value& v, const ClientAttribute& a);
+	// Get the JSON name of a change to a client
+	static const char* GetEventText(ClientEvent event);
 
 
 private:
 
 	std::shared_ptr<Database>                       mpDatabase;
-	Json::Reader                                    mReader;
+	RequestParser                                   mParser;
+	BinaryRequestParser                             mBinaryParser;
+	ClientRequest                                   mRequest;
 	std::string                                     mClientAddress;
-
+	size_t                                          mAddedKeyCount;
+	ClientRecordPtr                                 mClient;
+	ClientRecordPtr                                 mLastClient;
+	bool                                            mIsShared;
+	std::vector<ClientPatch>                        mPatches;
+	std::vector<ClientOperation>                    mOperations;
+	std::vector<std::string>                        mTargetIds;
+	bool                                            mIsBinary;
+	std::vector<ClientRecordPtr>                    mSessions;
+
+	// Subscriptions of this connection
+	ClientSubscriberPtr                             mSubscriber;
+	std::unordered_set<std::string>                 mSubscriptions;
+	std::vector<ClientNotification>                 mNotifications;
+	std::function<void()>                           mNotificationWake;
+	bool                                            mIsBinaryNotifications;
+
+	// Results of the commands of the current request
+	RequestStatus                                   mStatus;
+	ClientDataPtr                                   mQueryData;
+	std::vector<ClientDataPtr>                      mMultiQueryData;
+	std::vector<AttributeKey>                       mMultiQueryKeys;
+	ClientSearchResult                              mSearchResults;
+	ClientSearchPlan                                mSearchPlan;
+	std::vector<AttributeKey>                       mKeys;
+	std::vector<RequestStatus>                      mBatchStatus;
+	std::vector<uint32_t>                           mLostSessions;
+
+	static const char                               cOKReply[];
+	static const uint32_t                           cMaxSessions = 4096;
+	static const size_t                             cMaxSubscriptions = 1024;
+	static const size_t                             cMaxConnectionKeys = 64;
 
 };
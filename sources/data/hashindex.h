@@ -0,0 +1,287 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <algorithm>
+
+
+/*-----------------------------------------------------------------------------
+	Client keys
+-----------------------------------------------------------------------------*/
+
+// Compact fixed-size form of a client identifier : a 128-bit hash of it, seeded at startup.
+// Indexes only store this key, and check the full identifier against the indexed value on a match.
+class ClientKey
+{
+public:
+
+	ClientKey(const std::string& id)
+	{
+		static const uint64_t sSeed = std::random_device()() * 0x9E3779B97F4A7C15ULL;
+		const char* data = id.data();
+		size_t length = id.length();
+
+		uint64_t h1 = sSeed ^ length;
+		uint64_t h2 = ~sSeed;
+
+		// Hash 8 bytes at a time on two lanes, zero-padding the last word
+		for (size_t i = 0; i < length; i += 8)
+		{
+			uint64_t word = 0;
+			memcpy(&word, data + i, std::min<size_t>(8, length - i));
+
+			h1 = (h1 ^ word) * 0x9E3779B97F4A7C15ULL;
+			h1 ^= h1 >> 29;
+			h2 = (h2 + word) * 0xC2B2AE3D27D4EB4FULL;
+			h2 = (h2 << 31) | (h2 >> 33);
+		}
+
+		hash = Mix(h1 + h2);
+		tag = Mix(h2 ^ (h1 >> 1)) | 1;
+	}
+
+public:
+
+	uint64_t                                        hash;
+	uint64_t                                        tag;
+
+
+private:
+
+	// Final avalanche, from MurmurHash3
+	static uint64_t Mix(uint64_t h)
+	{
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+};
+
+
+/*-----------------------------------------------------------------------------
+	HashIndex class definition
+-----------------------------------------------------------------------------*/
+
+// Open-addressing hash table with linear probing, mapping client identifiers to values.
+// KeyOf returns the identifier a value is indexed with : identifiers themselves are not stored.
+template<typename Value, typename KeyOf>
+class HashIndex
+{
+public:
+
+	HashIndex()
+		: mCount(0)
+		, mMask(cInitialSize - 1)
+		, mSlots(cInitialSize)
+	{}
+
+
+	// Find the value for an identifier, or null
+	Value* Find(const ClientKey& key, const std::string& id)
+	{
+		size_t i = FindSlot(key, id);
+		return (i != cInvalidSlot) ? &mSlots[i].value : nullptr;
+	}
+
+	// Find the value for an identifier, inserting a default value if missing
+	Value& Insert(const ClientKey& key, const std::string& id)
+	{
+		size_t existing = FindSlot(key, id);
+		if (existing != cInvalidSlot)
+		{
+			return mSlots[existing].value;
+		}
+
+		// Keep the load factor under 3/4
+		if (4 * (mCount + 1) > 3 * mSlots.size())
+		{
+			Grow();
+		}
+
+		size_t i = key.hash & mMask;
+		while (mSlots[i].tag != 0)
+		{
+			i = (i + 1) & mMask;
+		}
+
+		mSlots[i].hash = key.hash;
+		mSlots[i].tag = key.tag;
+		mCount++;
+		return mSlots[i].value;
+	}
+
+	// Remove the value for an identifier, return false if it was missing
+	bool Erase(const ClientKey& key, const std::string& id)
+	{
+		size_t i = FindSlot(key, id);
+		if (i == cInvalidSlot)
+		{
+			return false;
+		}
+
+		EraseSlot(i);
+		return true;
+	}
+
+	// Remove all values matching a predicate, return how many were removed
+	template<typename Predicate>
+	size_t EraseIf(Predicate predicate)
+	{
+		size_t count = 0;
+
+		// Backward shifting may move a later slot into the current one, so check it again
+		for (size_t i = 0; i < mSlots.size();)
+		{
+			if (mSlots[i].tag != 0 && predicate(mSlots[i].value))
+			{
+				EraseSlot(i);
+				count++;
+			}
+			else
+			{
+				i++;
+			}
+		}
+
+		return count;
+	}
+
+	// Call a function on each value
+	template<typename Function>
+	void ForEach(Function function) const
+	{
+		for (const Slot& slot : mSlots)
+		{
+			if (slot.tag != 0)
+			{
+				function(slot.value);
+			}
+		}
+	}
+
+	// Call a function on the first value found from each of count evenly spaced slots, starting from a slot.
+	// At most cSampleProbes slots are checked from each, so that sampling a large table stays cheap.
+	template<typename Function>
+	void Sample(size_t count, size_t start, Function function) const
+	{
+		if (count >= mSlots.size())
+		{
+			ForEach(function);
+			return;
+		}
+
+		size_t stride = mSlots.size() / count;
+		size_t probes = (stride < cSampleProbes) ? stride : cSampleProbes;
+		for (size_t n = 0; n < count; n++)
+		{
+			size_t first = start + n * stride;
+			for (size_t i = 0; i < probes; i++)
+			{
+				const Slot& slot = mSlots[(first + i) & mMask];
+				if (slot.tag != 0)
+				{
+					function(slot.value);
+					break;
+				}
+			}
+		}
+	}
+
+	// Get the number of values
+	size_t Size() const
+	{
+		return mCount;
+	}
+
+
+private:
+
+	// Table entry, empty when its tag is zero
+	struct Slot
+	{
+		Slot()
+			: hash(0)
+			, tag(0)
+			, value()
+		{}
+
+		uint64_t                                    hash;
+		uint64_t                                    tag;
+		Value                                       value;
+	};
+
+
+private:
+
+	// Find the slot holding an identifier, or cInvalidSlot
+	size_t FindSlot(const ClientKey& key, const std::string& id) const
+	{
+		for (size_t i = key.hash & mMask; mSlots[i].tag != 0; i = (i + 1) & mMask)
+		{
+			if (mSlots[i].tag == key.tag && mSlots[i].hash == key.hash && KeyOf()(mSlots[i].value) == id)
+			{
+				return i;
+			}
+		}
+		return cInvalidSlot;
+	}
+
+	// Double the table size
+	void Grow()
+	{
+		std::vector<Slot> oldSlots(mSlots.size() * 2);
+		oldSlots.swap(mSlots);
+		mMask = mSlots.size() - 1;
+
+		for (Slot& slot : oldSlots)
+		{
+			if (slot.tag != 0)
+			{
+				size_t i = slot.hash & mMask;
+				while (mSlots[i].tag != 0)
+				{
+					i = (i + 1) & mMask;
+				}
+				mSlots[i].hash = slot.hash;
+				mSlots[i].tag = slot.tag;
+				mSlots[i].value = std::move(slot.value);
+			}
+		}
+	}
+
+	// Empty a slot, shifting back the following entries of the probe sequence to avoid tombstones
+	void EraseSlot(size_t hole)
+	{
+		for (size_t i = (hole + 1) & mMask; mSlots[i].tag != 0; i = (i + 1) & mMask)
+		{
+			size_t home = mSlots[i].hash & mMask;
+			if (((i - home) & mMask) >= ((i - hole) & mMask))
+			{
+				mSlots[hole] = std::move(mSlots[i]);
+				hole = i;
+			}
+		}
+
+		mSlots[hole] = Slot();
+		mCount--;
+	}
+
+
+private:
+
+	size_t                                          mCount;
+	size_t                                          mMask;
+	std::vector<Slot>                               mSlots;
+
+	static const size_t                             cInitialSize = 16;
+	static const size_t                             cInvalidSlot = SIZE_MAX;
+	static const size_t                             cSampleProbes = 8;
+
+};
@@ -0,0 +1,172 @@
+#include "interning.h"
+#include <tuple>
+#include <functional>
+#include <cstring>
+#include <arpa/inet.h>
+
+
+/*-----------------------------------------------------------------------------
+	InternedStrings
+-----------------------------------------------------------------------------*/
+
+InternedStrings& InternedStrings::Get()
+{
+	// Never destroyed, so that attributes in static objects can still release their strings
+	static InternedStrings* sInstance = new InternedStrings;
+	return *sInstance;
+}
+
+const InternedString* InternedStrings::Acquire(const char* data, size_t length)
+{
+	std::string value(data, length);
+	Shard& shard = GetShard(value);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto it = shard.strings.find(value);
+	if (it == shard.strings.end())
+	{
+		it = shard.strings.emplace(std::piecewise_construct, std::forward_as_tuple(std::move(value)), std::forward_as_tuple(0)).first;
+	}
+
+	it->second.fetch_add(1, std::memory_order_relaxed);
+	return &*it;
+}
+
+void InternedStrings::Release(const InternedString* pString)
+{
+	std::atomic<uint32_t>& references = const_cast<InternedString*>(pString)->second;
+
+	// Other attributes still use it : no need to lock
+	uint32_t count = references.load(std::memory_order_relaxed);
+	while (count > 1)
+	{
+		if (references.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel))
+		{
+			return;
+		}
+	}
+
+	// Last use, unless it was acquired again in the meantime
+	Shard& shard = GetShard(pString->first);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	if (references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		shard.strings.erase(pString->first);
+	}
+}
+
+size_t InternedStrings::Size()
+{
+	size_t count = 0;
+	for (Shard& shard : mShards)
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		count += shard.strings.size();
+	}
+	return count;
+}
+
+InternedStrings::Shard& InternedStrings::GetShard(const std::string& value)
+{
+	return mShards[std::hash<std::string>()(value) % (sizeof(mShards) / sizeof(mShards[0]))];
+}
+
+
+/*-----------------------------------------------------------------------------
+	AttributeKeys
+-----------------------------------------------------------------------------*/
+
+AttributeKeys::AttributeKeys()
+	: mIdentifiers(std::make_shared<const std::unordered_map<std::string, AttributeKey>>())
+	, mNames(cMaxKeys)
+{
+	for (auto& name : mNames)
+	{
+		name.store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+AttributeKeys& AttributeKeys::Get()
+{
+	static AttributeKeys* sInstance = new AttributeKeys;
+	return *sInstance;
+}
+
+AttributeKey AttributeKeys::Intern(const std::string& name)
+{
+	bool isAdded;
+	return Intern(name, std::string(), isAdded);
+}
+
+AttributeKey AttributeKeys::Intern(const std::string& name, const std::string& creator, bool& isAdded)
+{
+	isAdded = false;
+	AttributeKey key = Find(name);
+	if (key != cInvalidKey)
+	{
+		return key;
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	// Another thread may have added it
+	auto it = mIdentifiers->find(name);
+	if (it != mIdentifiers->end())
+	{
+		return it->second;
+	}
+	else if (mNameStorage.size() >= cMaxKeys)
+	{
+		return cInvalidKey;
+	}
+
+	// The server itself has no limit and can use the reserved keys, and there are fewer creators than keys
+	if (creator.length())
+	{
+		if (mNameStorage.size() >= cMaxKeys - cReservedKeys)
+		{
+			return cInvalidKey;
+		}
+
+		size_t& creatorKeyCount = mCreatorKeyCounts[GetCreatorGroup(creator)];
+		if (creatorKeyCount >= cMaxCreatorKeys)
+		{
+			return cInvalidKey;
+		}
+		creatorKeyCount++;
+	}
+
+	// The name is stored before the identifier is published
+	key = AttributeKey(mNameStorage.size());
+	mNameStorage.push_back(name);
+	mNames[key].store(&mNameStorage.back(), std::memory_order_release);
+
+	std::shared_ptr<std::unordered_map<std::string, AttributeKey>> identifiers = std::make_shared<std::unordered_map<std::string, AttributeKey>>(*mIdentifiers);
+	(*identifiers)[name] = key;
+	std::atomic_store(&mIdentifiers, std::shared_ptr<const std::unordered_map<std::string, AttributeKey>>(identifiers));
+
+	isAdded = true;
+	return key;
+}
+
+AttributeKey AttributeKeys::Find(const std::string& name) const
+{
+	std::shared_ptr<const std::unordered_map<std::string, AttributeKey>> identifiers = std::atomic_load(&mIdentifiers);
+	auto it = identifiers->find(name);
+	return (it != identifiers->end()) ? it->second : cInvalidKey;
+}
+
+std::string AttributeKeys::GetCreatorGroup(const std::string& creator)
+{
+	// IPv6 address : keep the /64 prefix, parsed as groups may be abbreviated
+	struct in6_addr address;
+	if (creator.find(':') != std::string::npos && inet_pton(AF_INET6, creator.c_str(), &address) == 1)
+	{
+		char prefix[INET6_ADDRSTRLEN] = { 0 };
+		memset(address.s6_addr + 8, 0, 8);
+		inet_ntop(AF_INET6, &address, prefix, sizeof(prefix));
+		return std::string(prefix) + "/64";
+	}
+
+	return creator;
+}
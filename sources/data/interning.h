@@ -0,0 +1,131 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <utility>
+#include <unordered_map>
+
+
+/*-----------------------------------------------------------------------------
+	InternedStrings class definition
+-----------------------------------------------------------------------------*/
+
+// Shared copy of a string value, with the count of attributes using it
+using InternedString = std::pair<const std::string, std::atomic<uint32_t>>;
+
+
+// Process-wide table of reference-counted strings : equal strings share one copy, so that attributes
+// only store a pointer to it and compare equal strings by address. Strings are freed when unused.
+class InternedStrings
+{
+public:
+
+	// Get the table
+	static InternedStrings& Get();
+
+	// Get the shared copy of a string, counting one more use
+	const InternedString* Acquire(const char* data, size_t length);
+
+	// Count one more use of a string that is already in use
+	void AddReference(const InternedString* pString)
+	{
+		const_cast<InternedString*>(pString)->second.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Count one less use of a string, freeing it when unused
+	void Release(const InternedString* pString);
+
+	// Get the number of strings in the table
+	size_t Size();
+
+
+private:
+
+	// Part of the table, with its own lock
+	struct Shard
+	{
+		std::unordered_map<std::string, std::atomic<uint32_t>> strings;
+		std::mutex                                  mutex;
+	};
+
+	// Get the shard responsible for a string
+	Shard& GetShard(const std::string& value);
+
+
+private:
+
+	Shard                                           mShards[64];
+
+};
+
+
+/*-----------------------------------------------------------------------------
+	AttributeKeys class definition
+-----------------------------------------------------------------------------*/
+
+// Small integer identifier of an attribute key
+using AttributeKey = uint16_t;
+
+
+// Process-wide table of attribute keys, so that clients store an identifier instead of each key.
+// Keys are never freed, as clients keep their identifiers : their number is limited to cMaxKeys, of which
+// cReservedKeys can only be added by the server itself, and each creator can only add cMaxCreatorKeys of them.
+// IPv6 creators are grouped by /64 prefix, as one host usually owns the whole prefix.
+class AttributeKeys
+{
+public:
+
+	AttributeKeys();
+
+	// Get the table
+	static AttributeKeys& Get();
+
+	// Get the identifier of a key, adding it if needed, or cInvalidKey if the table is full
+	AttributeKey Intern(const std::string& name);
+
+	// Get the identifier of a key, adding it on behalf of a creator if needed, or cInvalidKey if the table is full
+	// or the creator already added cMaxCreatorKeys keys. isAdded tells if this call added the key.
+	AttributeKey Intern(const std::string& name, const std::string& creator, bool& isAdded);
+
+	// Get the identifier of a key, or cInvalidKey if it was never added
+	AttributeKey Find(const std::string& name) const;
+
+	// Get the name of a valid key
+	const std::string& GetName(AttributeKey key) const
+	{
+		return *mNames[key].load(std::memory_order_acquire);
+	}
+
+	// Check if an identifier was given to a key, as those sent by clients may not have been
+	bool IsValid(AttributeKey key) const
+	{
+		return key < cMaxKeys && mNames[key].load(std::memory_order_acquire) != nullptr;
+	}
+
+public:
+
+	static const AttributeKey                       cInvalidKey = 0xFFFF;
+	static const size_t                             cMaxKeys = 4096;
+	static const size_t                             cMaxCreatorKeys = 256;
+	static const size_t                             cReservedKeys = 1024;
+
+
+private:
+
+	// Get the group a creator's keys are counted in
+	static std::string GetCreatorGroup(const std::string& creator);
+
+
+	// Identifiers are looked up without locking, in a map that is replaced when a key is added
+	std::shared_ptr<const std::unordered_map<std::string, AttributeKey>> mIdentifiers;
+	std::vector<std::atomic<const std::string*>>    mNames;
+	std::deque<std::string>                         mNameStorage;
+	std::unordered_map<std::string, size_t>         mCreatorKeyCounts;
+	std::mutex                                      mMutex;
+
+};
@@ -0,0 +1,226 @@
+#include "jsonwriter.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define ECHORAM_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+
+/*-----------------------------------------------------------------------------
+	Helpers
+-----------------------------------------------------------------------------*/
+
+// Write the digits of a number at the end of a buffer, return where they start
+static char* WriteDigits(char* end, uint64_t value)
+{
+	do
+	{
+		*--end = char('0' + value % 10);
+		value /= 10;
+	} while (value);
+	return end;
+}
+
+// Get the index of the lowest set bit
+static int CountTrailingZeros(uint32_t bits)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, bits);
+	return int(index);
+#else
+	return __builtin_ctz(bits);
+#endif
+}
+
+
+/*-----------------------------------------------------------------------------
+	Public interface
+-----------------------------------------------------------------------------*/
+
+void JsonWriter::Int(int64_t value)
+{
+	char buffer[24];
+	char* end = buffer + sizeof(buffer);
+	char* start = WriteDigits(end, value < 0 ? 0 - uint64_t(value) : uint64_t(value));
+	if (value < 0)
+	{
+		*--start = '-';
+	}
+
+	Separate();
+	mOutput.append(start, end - start);
+	mNeedsComma = true;
+}
+
+void JsonWriter::Unsigned(uint64_t value)
+{
+	char buffer[24];
+	char* end = buffer + sizeof(buffer);
+	char* start = WriteDigits(end, value);
+
+	Separate();
+	mOutput.append(start, end - start);
+	mNeedsComma = true;
+}
+
+void JsonWriter::Double(double value)
+{
+	char buffer[40];
+	char* end = buffer + sizeof(buffer);
+	char* start = end;
+
+	// Values with up to six decimals, as most game data is, are written exactly from an integer :
+	// a decimal number parses to the closest double, and scaled below 1e9 no other one is as close
+	double scaled = value * 1e6;
+	double rounded = std::floor(std::fabs(scaled) + 0.5);
+	if (std::fabs(value) < 1e9 && rounded / 1e6 == std::fabs(value))
+	{
+		uint64_t digits = uint64_t(rounded);
+		uint64_t fraction = digits % 1000000;
+		int fractionDigits = 6;
+		while (fraction && fraction % 10 == 0)
+		{
+			fraction /= 10;
+			fractionDigits--;
+		}
+
+		// A fraction of zero is still written, so that the value reads back as a double
+		if (fraction)
+		{
+			start = WriteDigits(end, fraction);
+			while (end - start < fractionDigits)
+			{
+				*--start = '0';
+			}
+		}
+		else
+		{
+			*--start = '0';
+		}
+		*--start = '.';
+		start = WriteDigits(start, digits / 1000000);
+		if (std::signbit(value) && digits)
+		{
+			*--start = '-';
+		}
+	}
+
+	// Others are written with enough digits to read back the same, or as Json::Value writes non-finite values
+	else if (std::isfinite(value))
+	{
+		int length = snprintf(buffer, sizeof(buffer), "%.17g", value);
+		start = buffer;
+		end = buffer + length;
+		if (!memchr(buffer, '.', length) && !memchr(buffer, 'e', length))
+		{
+			*end++ = '.';
+			*end++ = '0';
+		}
+	}
+	else
+	{
+		const char* text = (value != value) ? "null" : (value < 0 ? "-1e+9999" : "1e+9999");
+		Raw(text, strlen(text));
+		return;
+	}
+
+	Separate();
+	mOutput.append(start, end - start);
+	mNeedsComma = true;
+}
+
+void JsonWriter::Attribute(const ClientAttribute& value)
+{
+	switch (value.GetType())
+	{
+		case ClientAttributeType::T_STR: String(value.GetStringData(), value.GetStringLength()); break;
+		case ClientAttributeType::T_INT: Int(value.GetInt());                                    break;
+		case ClientAttributeType::T_UNS: Unsigned(value.GetUnsigned());                          break;
+		case ClientAttributeType::T_DBL: Double(value.GetDouble());                              break;
+		case ClientAttributeType::T_BOL: Bool(value.GetBool());                                  break;
+		default:                         Null();                                                 break;
+	}
+}
+
+
+/*-----------------------------------------------------------------------------
+	Private methods
+-----------------------------------------------------------------------------*/
+
+void JsonWriter::WriteQuoted(const char* data, size_t length)
+{
+	static const char cHexDigits[] = "0123456789abcdef";
+
+	mOutput.push_back('"');
+
+	// Append runs of characters that need no escape at once
+	const char* end = data + length;
+	const char* run = data;
+	const char* c = data;
+	while (c < end)
+	{
+#ifdef ECHORAM_SSE2
+		// Skip 16 characters at a time while none is a quote, a backslash or a control character
+		const __m128i quote = _mm_set1_epi8('"');
+		const __m128i backslash = _mm_set1_epi8('\\');
+		const __m128i control = _mm_set1_epi8(0x1F);
+		while (end - c >= 16)
+		{
+			__m128i characters = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c));
+			__m128i escaped = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(characters, quote), _mm_cmpeq_epi8(characters, backslash)),
+				_mm_cmpeq_epi8(_mm_max_epu8(characters, control), control));
+			int mask = _mm_movemask_epi8(escaped);
+			if (mask)
+			{
+				c += CountTrailingZeros(uint32_t(mask));
+				break;
+			}
+			c += 16;
+		}
+		if (c == end)
+		{
+			break;
+		}
+#endif
+
+		unsigned char character = static_cast<unsigned char>(*c);
+		if (character >= 0x20 && character != '"' && character != '\\')
+		{
+			c++;
+			continue;
+		}
+
+		mOutput.append(run, c - run);
+		run = ++c;
+
+		mOutput.push_back('\\');
+		switch (character)
+		{
+			case '"':  mOutput.push_back('"');  break;
+			case '\\': mOutput.push_back('\\'); break;
+			case '\b': mOutput.push_back('b');  break;
+			case '\f': mOutput.push_back('f');  break;
+			case '\n': mOutput.push_back('n');  break;
+			case '\r': mOutput.push_back('r');  break;
+			case '\t': mOutput.push_back('t');  break;
+			default:
+			{
+				char escape[5] = { 'u', '0', '0', cHexDigits[character >> 4], cHexDigits[character & 0xF] };
+				mOutput.append(escape, sizeof(escape));
+				break;
+			}
+		}
+	}
+	mOutput.append(run, end - run);
+
+	mOutput.push_back('"');
+}
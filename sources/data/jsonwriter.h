@@ -0,0 +1,137 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include "clientattribute.h"
+
+
+/*-----------------------------------------------------------------------------
+	JsonWriter class definition
+-----------------------------------------------------------------------------*/
+
+// Compact JSON writer, appending values to a string as they come : the caller keeps the string between
+// messages so that its memory is reused. Commas are placed by the writer, the caller matches the
+// Begin and End calls and writes a key before each member of an object.
+class JsonWriter
+{
+public:
+
+	JsonWriter(std::string& output)
+		: mOutput(output)
+		, mNeedsComma(false)
+	{}
+
+	// Start and end an object
+	void BeginObject()
+	{
+		Separate();
+		mOutput.push_back('{');
+		mNeedsComma = false;
+	}
+	void EndObject()
+	{
+		mOutput.push_back('}');
+		mNeedsComma = true;
+	}
+
+	// Start and end an array
+	void BeginArray()
+	{
+		Separate();
+		mOutput.push_back('[');
+		mNeedsComma = false;
+	}
+	void EndArray()
+	{
+		mOutput.push_back(']');
+		mNeedsComma = true;
+	}
+
+	// Write the key of the next member of an object
+	void Key(const char* data, size_t length)
+	{
+		Separate();
+		WriteQuoted(data, length);
+		mOutput.push_back(':');
+		mNeedsComma = false;
+	}
+	void Key(const char* key)
+	{
+		Key(key, strlen(key));
+	}
+	void Key(const std::string& key)
+	{
+		Key(key.data(), key.length());
+	}
+
+	// Write a string value
+	void String(const char* data, size_t length)
+	{
+		Separate();
+		WriteQuoted(data, length);
+		mNeedsComma = true;
+	}
+	void String(const char* value)
+	{
+		String(value, strlen(value));
+	}
+	void String(const std::string& value)
+	{
+		String(value.data(), value.length());
+	}
+
+	// Write a number value
+	void Int(int64_t value);
+	void Unsigned(uint64_t value);
+	void Double(double value);
+
+	// Write a boolean value
+	void Bool(bool value)
+	{
+		Separate();
+		mOutput.append(value ? "true" : "false", value ? 4 : 5);
+		mNeedsComma = true;
+	}
+
+	// Write a null value
+	void Null()
+	{
+		Separate();
+		mOutput.append("null", 4);
+		mNeedsComma = true;
+	}
+
+	// Write an attribute value, null if it has none
+	void Attribute(const ClientAttribute& value);
+
+	// Write a value that is already JSON
+	void Raw(const char* data, size_t length)
+	{
+		Separate();
+		mOutput.append(data, length);
+		mNeedsComma = true;
+	}
+
+
+private:
+
+	// Write a comma if a value precedes
+	void Separate()
+	{
+		if (mNeedsComma)
+		{
+			mOutput.push_back(',');
+		}
+	}
+
+	// Write a string with quotes and escapes
+	void WriteQuoted(const char* data, size_t length);
+
+
+private:
+
+	std::string&                                    mOutput;
+	bool                                            mNeedsComma;
+
+};
@@ -0,0 +1,904 @@
+#include "request.h"
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <cstdlib>
+
+
+/*-----------------------------------------------------------------------------
+	Helpers
+-----------------------------------------------------------------------------*/
+
+// Parse the four hexadecimal digits of a \u escape
+static bool ParseHex(const char*& cursor, const char* end, uint32_t& value)
+{
+	if (end - cursor < 4)
+	{
+		return false;
+	}
+
+	value = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		char c = *cursor++;
+		value <<= 4;
+		if (c >= '0' && c <= '9')
+			value |= uint32_t(c - '0');
+		else if (c >= 'a' && c <= 'f')
+			value |= uint32_t(c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F')
+			value |= uint32_t(c - 'A' + 10);
+		else
+			return false;
+	}
+	return true;
+}
+
+// Write a code point as UTF-8, return the end of the output
+static char* WriteUtf8(char* output, uint32_t codePoint)
+{
+	if (codePoint < 0x80)
+	{
+		*output++ = char(codePoint);
+	}
+	else if (codePoint < 0x800)
+	{
+		*output++ = char(0xC0 | (codePoint >> 6));
+		*output++ = char(0x80 | (codePoint & 0x3F));
+	}
+	else if (codePoint < 0x10000)
+	{
+		*output++ = char(0xE0 | (codePoint >> 12));
+		*output++ = char(0x80 | ((codePoint >> 6) & 0x3F));
+		*output++ = char(0x80 | (codePoint & 0x3F));
+	}
+	else
+	{
+		*output++ = char(0xF0 | (codePoint >> 18));
+		*output++ = char(0x80 | ((codePoint >> 12) & 0x3F));
+		*output++ = char(0x80 | ((codePoint >> 6) & 0x3F));
+		*output++ = char(0x80 | (codePoint & 0x3F));
+	}
+	return output;
+}
+
+
+/*-----------------------------------------------------------------------------
+	Constructors & destructor
+-----------------------------------------------------------------------------*/
+
+RequestParser::RequestParser()
+	: mCursor(nullptr)
+	, mEnd(nullptr)
+	, mLength(0)
+	, mStringsLength(0)
+{
+}
+
+
+/*-----------------------------------------------------------------------------
+	Public interface
+-----------------------------------------------------------------------------*/
+
+bool RequestParser::Parse(const char* data, size_t length, ClientRequest& request)
+{
+	mCursor = data;
+	mEnd = data + length;
+	mLength = length;
+	mStringsLength = 0;
+	request.Clear();
+
+	if (!IsNext('{'))
+	{
+		return false;
+	}
+
+	bool isValid = ParseObject(1, [&](const StringView& name)
+	{
+		return ParseCommand(name, request);
+	});
+
+	// Only whitespace may follow the request
+	return isValid && !SkipWhitespace();
+}
+
+
+/*-----------------------------------------------------------------------------
+	Commands
+-----------------------------------------------------------------------------*/
+
+bool RequestParser::ParseCommand(const StringView& name, ClientRequest& request)
+{
+	RequestValue ignored;
+
+	// Connection : identifiers of the client
+	if (name.Is("connect"))
+	{
+		request.hasConnect = false;
+		request.connectPrivateId = StringView();
+		request.connectPublicId = StringView();
+		if (!IsNext('{'))
+		{
+			return ParseValue(ignored, 2);
+		}
+
+		request.hasConnect = true;
+		return ParseObject(2, [&](const StringView& member)
+		{
+			if (member.Is("privateId"))
+				return ParseText(request.connectPrivateId, 3);
+			else if (member.Is("publicId"))
+				return ParseText(request.connectPublicId, 3);
+			else if (member.Is("session"))
+			{
+				request.hasConnectSession = true;
+				return ParseSession(request.connectSession);
+			}
+			else
+				return ParseValue(ignored, 3);
+		});
+	}
+
+	// Disconnection and heartbeat : any value, with an optional target
+	else if (name.Is("disconnect"))
+	{
+		request.hasDisconnect = true;
+		return ParseTarget(request.disconnect, 2, [&](const StringView&)
+		{
+			return ParseValue(ignored, 3);
+		});
+	}
+	else if (name.Is("heartbeat"))
+	{
+		request.hasHeartbeat = true;
+		return ParseTarget(request.heartbeat, 2, [&](const StringView&)
+		{
+			return ParseValue(ignored, 3);
+		});
+	}
+
+	// Update : an object with an optional target, values to set or add, keys to remove
+	else if (name.Is("update"))
+	{
+		request.hasUpdate = false;
+		request.updateData.clear();
+		request.updateIncrement.clear();
+		request.updateRemove.clear();
+		if (!IsNext('{'))
+		{
+			request.update = RequestTarget();
+			return ParseValue(ignored, 2);
+		}
+
+		request.hasUpdate = true;
+		return ParseUpdate(request.update, request.updateData, request.updateIncrement, request.updateRemove, 2);
+	}
+
+	// Query : a non-empty object with the public identifier of the target
+	else if (name.Is("query"))
+	{
+		request.hasQuery = false;
+		request.queryTargetId = StringView();
+		if (!IsNext('{'))
+		{
+			return ParseValue(ignored, 2);
+		}
+
+		return ParseObject(2, [&](const StringView& member)
+		{
+			request.hasQuery = true;
+			if (member.Is("targetId"))
+				return ParseText(request.queryTargetId, 3);
+			else
+				return ParseValue(ignored, 3);
+		});
+	}
+
+	// Query on many clients : an object with an array of public identifiers, and an optional array of keys
+	else if (name.Is("multiQuery"))
+	{
+		request.hasMultiQuery = false;
+		request.multiQueryIds.clear();
+		request.hasMultiQueryKeys = false;
+		request.multiQueryKeys.clear();
+		if (!IsNext('{'))
+		{
+			return ParseValue(ignored, 2);
+		}
+
+		request.hasMultiQuery = true;
+		return ParseObject(2, [&](const StringView& member)
+		{
+			if (member.Is("targetIds") && IsNext('['))
+			{
+				request.multiQueryIds.clear();
+				return ParseIdentifiers(request.multiQueryIds, 3);
+			}
+			else if (member.Is("keys") && IsNext('['))
+			{
+				request.hasMultiQueryKeys = true;
+				request.multiQueryKeys.clear();
+				return ParseArray(3, [&]()
+				{
+					StringView key;
+					if (!ParseText(key, 4))
+					{
+						return false;
+					}
+					if (key.data)
+					{
+						request.multiQueryKeys.push_back(RequestKey(key));
+					}
+					return true;
+				});
+			}
+			else
+				return ParseValue(ignored, 3);
+		});
+	}
+
+	// Subscriptions : an object with an array of public identifiers
+	else if (name.Is("subscribe") || name.Is("unsubscribe"))
+	{
+		bool isSubscribe = name.Is("subscribe");
+		bool& hasCommand = isSubscribe ? request.hasSubscribe : request.hasUnsubscribe;
+		std::vector<StringView>& targetIds = isSubscribe ? request.subscribeIds : request.unsubscribeIds;
+		hasCommand = false;
+		targetIds.clear();
+		if (!IsNext('{'))
+		{
+			return ParseValue(ignored, 2);
+		}
+
+		hasCommand = true;
+		return ParseObject(2, [&](const StringView& member)
+		{
+			if (member.Is("targetIds") && IsNext('['))
+			{
+				targetIds.clear();
+				return ParseIdentifiers(targetIds, 3);
+			}
+			else
+				return ParseValue(ignored, 3);
+		});
+	}
+
+	// Search : a non-empty array of criteria objects
+	else if (name.Is("search"))
+	{
+		request.hasSearch = false;
+		request.search.clear();
+		if (!IsNext('['))
+		{
+			return ParseValue(ignored, 2);
+		}
+
+		return ParseArray(2, [&]()
+		{
+			request.hasSearch = true;
+			request.search.push_back(RequestCriterion());
+			RequestCriterion& criterion = request.search.back();
+			criterion.key.name = StringView("", 0);
+			criterion.conditionValue = -1;
+
+			if (!IsNext('{'))
+			{
+				return false;
+			}
+			return ParseObject(3, [&](const StringView& member)
+			{
+				if (member.Is("key"))
+				{
+					// Keys that are not strings are empty, as Json::Value::asString() would say
+					StringView key;
+					bool isValid = ParseText(key, 4);
+					criterion.key.name = key.data ? key : StringView("", 0);
+					return isValid;
+				}
+				else if (member.Is("value"))
+					return ParseValue(criterion.value, 4) && criterion.value.type != RequestValueType::T_OBJECT && criterion.value.type != RequestValueType::T_ARRAY;
+				else if (member.Is("condition"))
+					return ParseText(criterion.condition, 4);
+				else
+					return ParseValue(ignored, 4);
+			});
+		});
+	}
+
+	// Batch : an array of operation objects
+	else if (name.Is("batch"))
+	{
+		request.hasBatch = false;
+		request.batch.clear();
+		request.batchData.clear();
+		request.batchIncrement.clear();
+		request.batchRemove.clear();
+		if (!IsNext('['))
+		{
+			return ParseValue(ignored, 2);
+		}
+
+		request.hasBatch = true;
+		return ParseArray(2, [&]()
+		{
+			return ParseOperation(request);
+		});
+	}
+
+	// Flags
+	else if (name.Is("stats"))
+	{
+		bool isValid = ParseValue(ignored, 2);
+		request.hasStats = !ignored.isEmpty;
+		return isValid;
+	}
+	else if (name.Is("explain"))
+	{
+		bool isValid = ParseValue(ignored, 2);
+		request.explain = ignored.IsTrue();
+		return isValid;
+	}
+
+	return ParseValue(ignored, 2);
+}
+
+template<typename Function>
+bool RequestParser::ParseTarget(RequestTarget& target, int depth, Function function)
+{
+	target = RequestTarget();
+	if (!IsNext('{'))
+	{
+		RequestValue ignored;
+		return ParseValue(ignored, depth);
+	}
+
+	return ParseObject(depth, [&](const StringView& member)
+	{
+		if (member.Is("privateId"))
+		{
+			target.hasPrivateId = true;
+			return ParseText(target.privateId, depth + 1);
+		}
+		else if (member.Is("session"))
+		{
+			target.hasSession = true;
+			return ParseSession(target.session);
+		}
+		else if (member.Is("allSessions"))
+		{
+			RequestValue value;
+			bool isValid = ParseValue(value, depth + 1);
+			target.isAllSessions = value.IsTrue();
+			return isValid;
+		}
+		return function(member);
+	});
+}
+
+bool RequestParser::ParseUpdate(RequestTarget& target, std::vector<RequestAttribute>& data, std::vector<RequestAttribute>& increment,
+	std::vector<RequestKey>& remove, int depth)
+{
+	RequestValue ignored;
+
+	// Members given twice replace the first
+	size_t dataStart = data.size();
+	size_t incrementStart = increment.size();
+	size_t removeStart = remove.size();
+	return ParseTarget(target, depth, [&](const StringView& member)
+	{
+		if (member.Is("data"))
+		{
+			data.resize(dataStart);
+			return ParseAttributes(data, depth + 1);
+		}
+		else if (member.Is("increment"))
+		{
+			increment.resize(incrementStart);
+			return ParseAttributes(increment, depth + 1);
+		}
+		else if (member.Is("remove") && IsNext('['))
+		{
+			remove.resize(removeStart);
+			return ParseArray(depth + 1, [&]()
+			{
+				StringView key;
+				if (!ParseText(key, depth + 2))
+				{
+					return false;
+				}
+				if (key.data)
+				{
+					remove.push_back(RequestKey(key));
+				}
+				return true;
+			});
+		}
+		return ParseValue(ignored, depth + 1);
+	});
+}
+
+bool RequestParser::ParseAttributes(std::vector<RequestAttribute>& attributes, int depth)
+{
+	if (!IsNext('{'))
+	{
+		RequestValue ignored;
+		return ParseValue(ignored, depth);
+	}
+
+	return ParseObject(depth, [&](const StringView& member)
+	{
+		attributes.push_back(RequestAttribute());
+		attributes.back().key = RequestKey(member);
+		return ParseScalar(attributes.back().value);
+	});
+}
+
+bool RequestParser::ParseIdentifiers(std::vector<StringView>& identifiers, int depth)
+{
+	return ParseArray(depth, [&]()
+	{
+		identifiers.push_back(StringView());
+		return ParseText(identifiers.back(), depth + 1);
+	});
+}
+
+bool RequestParser::ParseOperation(ClientRequest& request)
+{
+	RequestValue ignored;
+
+	request.batch.push_back(RequestOperation());
+	RequestOperation& operation = request.batch.back();
+	operation.type = RequestOperationType::T_INVALID;
+	operation.target = RequestTarget();
+	operation.data.begin = operation.data.end = request.batchData.size();
+	operation.increment.begin = operation.increment.end = request.batchIncrement.size();
+	operation.remove.begin = operation.remove.end = request.batchRemove.size();
+
+	// Operations that are not objects, or have no command, are invalid
+	if (!IsNext('{'))
+	{
+		return ParseValue(ignored, 3);
+	}
+
+	return ParseObject(3, [&](const StringView& member)
+	{
+		bool isValid = true;
+		if (member.Is("heartbeat"))
+		{
+			operation.type = RequestOperationType::T_HEARTBEAT;
+			isValid = ParseTarget(operation.target, 4, [&](const StringView&)
+			{
+				return ParseValue(ignored, 5);
+			});
+		}
+		else if (member.Is("update") && IsNext('{'))
+		{
+			operation.type = RequestOperationType::T_UPDATE;
+			request.batchData.resize(operation.data.begin);
+			request.batchIncrement.resize(operation.increment.begin);
+			request.batchRemove.resize(operation.remove.begin);
+			isValid = ParseUpdate(operation.target, request.batchData, request.batchIncrement, request.batchRemove, 4);
+		}
+		else
+		{
+			isValid = ParseValue(ignored, 4);
+		}
+
+		operation.data.end = request.batchData.size();
+		operation.increment.end = request.batchIncrement.size();
+		operation.remove.end = request.batchRemove.size();
+		return isValid;
+	});
+}
+
+
+/*-----------------------------------------------------------------------------
+	Values
+-----------------------------------------------------------------------------*/
+
+template<typename Function>
+bool RequestParser::ParseObject(int depth, Function function)
+{
+	if (depth > cMaxDepth || !Expect('{') || !SkipWhitespace())
+	{
+		return false;
+	}
+	else if (*mCursor == '}')
+	{
+		mCursor++;
+		return true;
+	}
+
+	while (true)
+	{
+		StringView name;
+		if (!ParseString(name) || !Expect(':') || !function(name) || !SkipWhitespace())
+		{
+			return false;
+		}
+		else if (*mCursor == '}')
+		{
+			mCursor++;
+			return true;
+		}
+		else if (*mCursor++ != ',')
+		{
+			return false;
+		}
+	}
+}
+
+template<typename Function>
+bool RequestParser::ParseArray(int depth, Function function)
+{
+	if (depth > cMaxDepth || !Expect('[') || !SkipWhitespace())
+	{
+		return false;
+	}
+	else if (*mCursor == ']')
+	{
+		mCursor++;
+		return true;
+	}
+
+	while (true)
+	{
+		if (!function() || !SkipWhitespace())
+		{
+			return false;
+		}
+		else if (*mCursor == ']')
+		{
+			mCursor++;
+			return true;
+		}
+		else if (*mCursor++ != ',')
+		{
+			return false;
+		}
+	}
+}
+
+bool RequestParser::ParseValue(RequestValue& value, int depth)
+{
+	if (!SkipWhitespace())
+	{
+		return false;
+	}
+
+	value = RequestValue();
+	if (*mCursor == '{')
+	{
+		value.type = RequestValueType::T_OBJECT;
+		return ParseObject(depth, [&](const StringView&)
+		{
+			RequestValue member;
+			value.isEmpty = false;
+			return ParseValue(member, depth + 1);
+		});
+	}
+	else if (*mCursor == '[')
+	{
+		value.type = RequestValueType::T_ARRAY;
+		return ParseArray(depth, [&]()
+		{
+			RequestValue element;
+			value.isEmpty = false;
+			return ParseValue(element, depth + 1);
+		});
+	}
+
+	return ParseScalar(value);
+}
+
+bool RequestParser::ParseScalar(RequestValue& value)
+{
+	if (!SkipWhitespace())
+	{
+		return false;
+	}
+
+	value = RequestValue();
+	value.isEmpty = false;
+	switch (*mCursor)
+	{
+		case '"':
+			value.type = RequestValueType::T_STR;
+			return ParseString(value.string);
+
+		case 't':
+			value.type = RequestValueType::T_BOL;
+			value.integer = 1;
+			return ParseWord("true", 4);
+
+		case 'f':
+			value.type = RequestValueType::T_BOL;
+			return ParseWord("false", 5);
+
+		case 'n':
+			value.isEmpty = true;
+			return ParseWord("null", 4);
+
+		default:
+			return ParseNumber(value);
+	}
+}
+
+bool RequestParser::ParseText(StringView& text, int depth)
+{
+	RequestValue value;
+	if (!ParseValue(value, depth))
+	{
+		return false;
+	}
+
+	text = (value.type == RequestValueType::T_STR) ? value.string : StringView();
+	return true;
+}
+
+bool RequestParser::ParseSession(uint32_t& session)
+{
+	RequestValue value;
+	if (!ParseScalar(value))
+	{
+		return false;
+	}
+
+	bool isNumber = (value.type == RequestValueType::T_INT || value.type == RequestValueType::T_UNS);
+	session = (isNumber && value.integer >= 0) ? uint32_t(value.integer) : UINT32_MAX;
+	return true;
+}
+
+bool RequestParser::ParseString(StringView& value)
+{
+	if (!Expect('"'))
+	{
+		return false;
+	}
+
+	// Most strings have no escapes and are used in place
+	const char* start = mCursor;
+	while (mCursor < mEnd && *mCursor != '"' && *mCursor != '\\')
+	{
+		mCursor++;
+	}
+	if (mCursor == mEnd)
+	{
+		return false;
+	}
+	else if (*mCursor == '"')
+	{
+		value = StringView(start, mCursor - start);
+		mCursor++;
+		return true;
+	}
+
+	// Others are decoded into mStrings, sized for the whole request on the first escape : decoding
+	// never makes a string longer, so it is never reallocated while earlier strings point into it
+	if (mStrings.size() < mLength)
+	{
+		mStrings.resize(mLength);
+	}
+	char* output = mStrings.data() + mStringsLength;
+	char* end = output;
+	memcpy(end, start, mCursor - start);
+	end += mCursor - start;
+
+	while (true)
+	{
+		if (mCursor == mEnd)
+		{
+			return false;
+		}
+
+		char c = *mCursor++;
+		if (c == '"')
+		{
+			break;
+		}
+		else if (c != '\\')
+		{
+			*end++ = c;
+			continue;
+		}
+		else if (mCursor == mEnd)
+		{
+			return false;
+		}
+
+		switch (*mCursor++)
+		{
+			case '"':  *end++ = '"';  break;
+			case '\\': *end++ = '\\'; break;
+			case '/':  *end++ = '/';  break;
+			case 'b':  *end++ = '\b'; break;
+			case 'f':  *end++ = '\f'; break;
+			case 'n':  *end++ = '\n'; break;
+			case 'r':  *end++ = '\r'; break;
+			case 't':  *end++ = '\t'; break;
+
+			case 'u':
+			{
+				uint32_t codePoint;
+				if (!ParseHex(mCursor, mEnd, codePoint))
+				{
+					return false;
+				}
+
+				// Characters past the first plane are escaped as a pair of surrogates
+				if (codePoint >= 0xD800 && codePoint <= 0xDBFF)
+				{
+					uint32_t low;
+					if (mEnd - mCursor < 2 || mCursor[0] != '\\' || mCursor[1] != 'u')
+					{
+						return false;
+					}
+					mCursor += 2;
+					if (!ParseHex(mCursor, mEnd, low) || low < 0xDC00 || low > 0xDFFF)
+					{
+						return false;
+					}
+					codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+				}
+
+				end = WriteUtf8(end, codePoint);
+				break;
+			}
+
+			default:
+				return false;
+		}
+	}
+
+	value = StringView(output, end - output);
+	mStringsLength += end - output;
+	return true;
+}
+
+bool RequestParser::ParseNumber(RequestValue& value)
+{
+	const char* start = mCursor;
+	bool isNegative = (mCursor < mEnd && *mCursor == '-');
+	if (isNegative)
+	{
+		mCursor++;
+	}
+
+	// Integer part, accumulated as long as it fits
+	const char* digits = mCursor;
+	uint64_t magnitude = 0;
+	bool isOverflow = false;
+	while (mCursor < mEnd && *mCursor >= '0' && *mCursor <= '9')
+	{
+		uint64_t digit = uint64_t(*mCursor++ - '0');
+		if (magnitude > (std::numeric_limits<uint64_t>::max() - digit) / 10)
+		{
+			isOverflow = true;
+		}
+		magnitude = magnitude * 10 + digit;
+	}
+	if (mCursor == digits)
+	{
+		return false;
+	}
+
+	// Fraction and exponent
+	bool isReal = false;
+	if (mCursor < mEnd && *mCursor == '.')
+	{
+		isReal = true;
+		digits = ++mCursor;
+		while (mCursor < mEnd && *mCursor >= '0' && *mCursor <= '9')
+		{
+			mCursor++;
+		}
+		if (mCursor == digits)
+		{
+			return false;
+		}
+	}
+	if (mCursor < mEnd && (*mCursor == 'e' || *mCursor == 'E'))
+	{
+		isReal = true;
+		mCursor++;
+		if (mCursor < mEnd && (*mCursor == '+' || *mCursor == '-'))
+		{
+			mCursor++;
+		}
+		digits = mCursor;
+		while (mCursor < mEnd && *mCursor >= '0' && *mCursor <= '9')
+		{
+			mCursor++;
+		}
+		if (mCursor == digits)
+		{
+			return false;
+		}
+	}
+
+	// Integers are exact, other numbers are converted from a terminated copy
+	if (!isReal && !isOverflow)
+	{
+		value.number = isNegative ? -double(magnitude) : double(magnitude);
+		value.integer = isNegative ? -int64_t(std::min<uint64_t>(magnitude, 1ULL << 62)) : int64_t(std::min<uint64_t>(magnitude, 1ULL << 62));
+	}
+	else
+	{
+		char buffer[64];
+		size_t length = mCursor - start;
+		if (length < sizeof(buffer))
+		{
+			memcpy(buffer, start, length);
+			buffer[length] = '\0';
+			value.number = strtod(buffer, nullptr);
+		}
+		else
+		{
+			value.number = strtod(std::string(start, length).c_str(), nullptr);
+		}
+
+		double integralPart;
+		if (std::modf(value.number, &integralPart) != 0.0 || std::fabs(value.number) > 4294967296.0)
+		{
+			value.type = RequestValueType::T_DBL;
+			return true;
+		}
+		value.integer = int64_t(value.number);
+	}
+
+	// Integral numbers that fit are integers, as Json::Value::isInt() and isUInt() would say
+	if (value.integer >= std::numeric_limits<int32_t>::min() && value.integer <= std::numeric_limits<int32_t>::max())
+	{
+		value.type = RequestValueType::T_INT;
+	}
+	else if (value.integer >= 0 && value.integer <= std::numeric_limits<uint32_t>::max())
+	{
+		value.type = RequestValueType::T_UNS;
+	}
+	else
+	{
+		value.type = RequestValueType::T_DBL;
+	}
+
+	return true;
+}
+
+bool RequestParser::ParseWord(const char* word, size_t length)
+{
+	if (size_t(mEnd - mCursor) < length || memcmp(mCursor, word, length) != 0)
+	{
+		return false;
+	}
+
+	mCursor += length;
+	return true;
+}
+
+
+/*-----------------------------------------------------------------------------
+	Whitespace
+-----------------------------------------------------------------------------*/
+
+bool RequestParser::SkipWhitespace()
+{
+	while (mCursor < mEnd && (*mCursor == ' ' || *mCursor == '\t' || *mCursor == '\n' || *mCursor == '\r'))
+	{
+		mCursor++;
+	}
+	return mCursor < mEnd;
+}
+
+bool RequestParser::IsNext(char c)
+{
+	return SkipWhitespace() && *mCursor == c;
+}
+
+bool RequestParser::Expect(char c)
+{
+	if (IsNext(c))
+	{
+		mCursor++;
+		return true;
+	}
+	return false;
+}
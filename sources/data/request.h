@@ -0,0 +1,375 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include "interning.h"
+
+
+/*-----------------------------------------------------------------------------
+	Request types
+-----------------------------------------------------------------------------*/
+
+// Characters of a string in a request, not owned and not null-terminated
+class StringView
+{
+public:
+
+	StringView()
+		: data(nullptr)
+		, length(0)
+	{}
+
+	StringView(const char* d, size_t l)
+		: data(d)
+		, length(l)
+	{}
+
+	// Check if the string is a literal
+	template<size_t N>
+	bool Is(const char (&literal)[N]) const
+	{
+		return length == N - 1 && memcmp(data, literal, N - 1) == 0;
+	}
+
+	// Get a copy of the string
+	std::string ToString() const
+	{
+		return std::string(data, length);
+	}
+
+public:
+
+	const char*                                     data;
+	size_t                                          length;
+
+};
+
+// StringView operator ==
+inline bool operator== (const StringView& lhs, const std::string& rhs)
+{
+	return lhs.length == rhs.length() && memcmp(lhs.data, rhs.data(), lhs.length) == 0;
+}
+inline bool operator!= (const StringView& lhs, const std::string& rhs){ return !(lhs == rhs);}
+
+
+// Type of a value in a request, numbers being typed as Json::Value would
+enum class RequestValueType : uint8_t { T_NULL = 0, T_STR, T_INT, T_UNS, T_DBL, T_BOL, T_OBJECT, T_ARRAY };
+
+
+// Value in a request : a scalar, or the type and emptiness of an object or array that was skipped
+class RequestValue
+{
+public:
+
+	RequestValue()
+		: type(RequestValueType::T_NULL)
+		, number(0)
+		, integer(0)
+		, isEmpty(true)
+	{}
+
+	// Check if the value is true, or a non-zero number
+	bool IsTrue() const
+	{
+		switch (type)
+		{
+			case RequestValueType::T_BOL:
+			case RequestValueType::T_INT:
+			case RequestValueType::T_UNS: return integer != 0;
+			case RequestValueType::T_DBL: return number != 0;
+			default:                      return false;
+		}
+	}
+
+public:
+
+	RequestValueType                                type;
+	StringView                                      string;
+	double                                          number;
+	int64_t                                         integer;
+	bool                                            isEmpty;
+
+};
+
+
+// Attribute key in a request, by name, or by identifier when the name is null
+class RequestKey
+{
+public:
+
+	RequestKey()
+		: id(AttributeKeys::cInvalidKey)
+	{}
+
+	RequestKey(const StringView& n)
+		: name(n)
+		, id(AttributeKeys::cInvalidKey)
+	{}
+
+public:
+
+	StringView                                      name;
+	AttributeKey                                    id;
+
+};
+
+// Attribute key and value in a request
+struct RequestAttribute
+{
+	RequestKey                                      key;
+	RequestValue                                    value;
+};
+
+// Search criterion in a request, with a condition by name or by value
+struct RequestCriterion
+{
+	RequestKey                                      key;
+	RequestValue                                    value;
+	StringView                                      condition;
+	int                                             conditionValue;
+};
+
+// Client targeted by a command, if it has an identifier or a session number, or all sessions of the connection
+struct RequestTarget
+{
+	bool                                            hasPrivateId;
+	StringView                                      privateId;
+	bool                                            hasSession;
+	uint32_t                                        session;
+	bool                                            isAllSessions;
+};
+
+
+// Kind of operation in a batch, invalid for those that are not recognized
+enum class RequestOperationType : uint8_t { T_INVALID = 0, T_HEARTBEAT, T_UPDATE };
+
+// Range of elements in a list of a request
+struct RequestRange
+{
+	size_t                                          begin;
+	size_t                                          end;
+};
+
+// Operation of a batch : a heartbeat or an update, whose changes are ranges of the batch lists of the request
+struct RequestOperation
+{
+	RequestOperationType                            type;
+	RequestTarget                                   target;
+	RequestRange                                    data;
+	RequestRange                                    increment;
+	RequestRange                                    remove;
+};
+
+
+// Outcome of a request
+enum class RequestStatus : uint8_t { T_OK = 0, T_NOT_CONNECTED, T_TOO_MANY_KEYS, T_UNKNOWN_KEY, T_INVALID, T_INVALID_SESSION, T_TOO_MANY_SUBSCRIPTIONS, T_NO_SUBSCRIPTIONS };
+
+
+// Commands of a request, with their arguments : strings point into the request or the parser
+class ClientRequest
+{
+public:
+
+	ClientRequest()
+	{
+		Clear();
+	}
+
+	// Reset all commands, keeping the memory of the lists
+	void Clear()
+	{
+		hasConnect = false;
+		connectPrivateId = StringView();
+		connectPublicId = StringView();
+		hasConnectSession = false;
+		connectSession = 0;
+		hasDisconnect = false;
+		disconnect = RequestTarget();
+		hasStats = false;
+		hasUpdate = false;
+		update = RequestTarget();
+		updateData.clear();
+		updateIncrement.clear();
+		updateRemove.clear();
+		hasHeartbeat = false;
+		heartbeat = RequestTarget();
+		hasQuery = false;
+		queryTargetId = StringView();
+		hasMultiQuery = false;
+		multiQueryIds.clear();
+		hasMultiQueryKeys = false;
+		multiQueryKeys.clear();
+		hasSubscribe = false;
+		subscribeIds.clear();
+		hasUnsubscribe = false;
+		unsubscribeIds.clear();
+		hasSearch = false;
+		search.clear();
+		explain = false;
+		hasKeys = false;
+		keyNames.clear();
+		hasKeyNames = false;
+		keyIds.clear();
+		hasBatch = false;
+		batch.clear();
+		batchData.clear();
+		batchIncrement.clear();
+		batchRemove.clear();
+	}
+
+public:
+
+	bool                                            hasConnect;
+	StringView                                      connectPrivateId;
+	StringView                                      connectPublicId;
+	bool                                            hasConnectSession;
+	uint32_t                                        connectSession;
+
+	bool                                            hasDisconnect;
+	RequestTarget                                   disconnect;
+
+	bool                                            hasStats;
+
+	bool                                            hasUpdate;
+	RequestTarget                                   update;
+	std::vector<RequestAttribute>                   updateData;
+	std::vector<RequestAttribute>                   updateIncrement;
+	std::vector<RequestKey>                         updateRemove;
+
+	bool                                            hasHeartbeat;
+	RequestTarget                                   heartbeat;
+
+	bool                                            hasQuery;
+	StringView                                      queryTargetId;
+
+	// Public identifiers of the targets of a query on many clients, and the keys to reply with if given
+	bool                                            hasMultiQuery;
+	std::vector<StringView>                         multiQueryIds;
+	bool                                            hasMultiQueryKeys;
+	std::vector<RequestKey>                         multiQueryKeys;
+
+	// Public identifiers of the clients whose changes to start or stop sending
+	bool                                            hasSubscribe;
+	std::vector<StringView>                         subscribeIds;
+	bool                                            hasUnsubscribe;
+	std::vector<StringView>                         unsubscribeIds;
+
+	bool                                            hasSearch;
+	std::vector<RequestCriterion>                   search;
+	bool                                            explain;
+
+	// Identifiers of attribute keys by name, and names by identifier
+	bool                                            hasKeys;
+	std::vector<StringView>                         keyNames;
+	bool                                            hasKeyNames;
+	std::vector<AttributeKey>                       keyIds;
+
+	// Operations of a batch, sharing lists for their changes
+	bool                                            hasBatch;
+	std::vector<RequestOperation>                   batch;
+	std::vector<RequestAttribute>                   batchData;
+	std::vector<RequestAttribute>                   batchIncrement;
+	std::vector<RequestKey>                         batchRemove;
+
+};
+
+
+/*-----------------------------------------------------------------------------
+	RequestParser class definition
+-----------------------------------------------------------------------------*/
+
+// Streaming JSON parser for the command set : it reads a request in one pass, straight into a ClientRequest,
+// and skips what no command uses. Strings point into the request, or into the parser for those with escapes,
+// so that once its lists have grown, parsing a request allocates nothing.
+class RequestParser
+{
+public:
+
+	RequestParser();
+
+	// Parse a request, return false if it is not a valid JSON object. Strings stay valid until the next call.
+	bool Parse(const char* data, size_t length, ClientRequest& request);
+
+	// Parse a request from a string
+	bool Parse(const std::string& data, ClientRequest& request)
+	{
+		return Parse(data.data(), data.length(), request);
+	}
+
+
+private:
+
+	// Parse one command from the top-level object
+	bool ParseCommand(const StringView& name, ClientRequest& request);
+
+	// Parse the target of a command, which is set if the command is an object with a privateId member,
+	// calling a function with the name of each other member, which must parse its value
+	template<typename Function>
+	bool ParseTarget(RequestTarget& target, int depth, Function function);
+
+	// Parse an update, adding its changes to the lists
+	bool ParseUpdate(RequestTarget& target, std::vector<RequestAttribute>& data, std::vector<RequestAttribute>& increment,
+		std::vector<RequestKey>& remove, int depth);
+
+	// Parse an object of attributes, whose values must be scalars, adding them to the list
+	bool ParseAttributes(std::vector<RequestAttribute>& attributes, int depth);
+
+	// Parse an array of identifiers, adding them to the list
+	bool ParseIdentifiers(std::vector<StringView>& identifiers, int depth);
+
+	// Parse an operation of a batch
+	bool ParseOperation(ClientRequest& request);
+
+	// Parse the members of an object, calling a function with the name of each member, which must parse its value
+	template<typename Function>
+	bool ParseObject(int depth, Function function);
+
+	// Parse the elements of an array, calling a function for each element, which must parse it
+	template<typename Function>
+	bool ParseArray(int depth, Function function);
+
+	// Parse any value, skipping objects and arrays
+	bool ParseValue(RequestValue& value, int depth);
+
+	// Parse a value that is not an object or array
+	bool ParseScalar(RequestValue& value);
+
+	// Parse any value into a string, which is null unless the value is a string
+	bool ParseText(StringView& text, int depth);
+
+	// Parse a session number, which is invalid unless it is a non-negative integer
+	bool ParseSession(uint32_t& session);
+
+	// Parse a string value, pointing into the request, or into mStrings if it has escapes
+	bool ParseString(StringView& value);
+
+	// Parse a number value
+	bool ParseNumber(RequestValue& value);
+
+	// Parse a literal word
+	bool ParseWord(const char* word, size_t length);
+
+	// Skip whitespace, return false at the end of the request
+	bool SkipWhitespace();
+
+	// Skip whitespace, return true if the next character is c
+	bool IsNext(char c);
+
+	// Skip whitespace and an expected character
+	bool Expect(char c);
+
+
+private:
+
+	const char*                                     mCursor;
+	const char*                                     mEnd;
+	size_t                                          mLength;
+
+	std::vector<char>                               mStrings;
+	size_t                                          mStringsLength;
+
+	static const int                                cMaxDepth = 64;
+
+};
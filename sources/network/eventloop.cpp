@@ -0,0 +1,459 @@
+#include "eventloop.h"
+#include "data/handler.h"
+#include <iostream>
+#include <cassert>
+
+#ifndef WIN32
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+#  include <pthread.h>
+#endif
+
+
+/*-----------------------------------------------------------------------------
+	Constructors & destructor
+-----------------------------------------------------------------------------*/
+
+EventLoop::EventLoop(std::shared_ptr<Database> pDb, uint32_t handshakeTimeout)
+	: mpDatabase(pDb)
+	, mClientCount(0)
+	, mHandshakeTimeout(handshakeTimeout)
+	, mRunning(false)
+	, mEventDescriptor(-1)
+	, mWakeupDescriptor(-1)
+{
+}
+
+EventLoop::~EventLoop()
+{
+	Stop();
+}
+
+EventLoop::Connection::Connection(std::shared_ptr<Database> pDb, const TcpSocket& client)
+	: socket(client)
+	, handler(new Handler(pDb, client.GetClientAddress()))
+	, isHandshaking(true)
+	, isClosing(false)
+{
+}
+
+EventLoop::Connection::~Connection()
+{
+}
+
+
+/*-----------------------------------------------------------------------------
+	Public interface
+-----------------------------------------------------------------------------*/
+
+#ifndef WIN32
+
+bool EventLoop::Start(int cpuCore)
+{
+	// Create the event queue
+	mEventDescriptor = epoll_create1(0);
+	if (mEventDescriptor < 0)
+	{
+		std::cout << "EventLoop::Start failed to create event queue : " << errno << std::endl;
+		return false;
+	}
+
+	// Create the wakeup event used to hand over new clients
+	mWakeupDescriptor = eventfd(0, EFD_NONBLOCK);
+	if (mWakeupDescriptor < 0)
+	{
+		std::cout << "EventLoop::Start failed to create wakeup event : " << errno << std::endl;
+		return false;
+	}
+
+	struct epoll_event event = { 0 };
+	event.events = EPOLLIN;
+	event.data.fd = mWakeupDescriptor;
+	if (epoll_ctl(mEventDescriptor, EPOLL_CTL_ADD, mWakeupDescriptor, &event) < 0)
+	{
+		std::cout << "EventLoop::Start failed to register wakeup event : " << errno << std::endl;
+		return false;
+	}
+
+	mRunning.store(true);
+	mThread = std::thread(&EventLoop::Run, this);
+	if (cpuCore >= 0)
+	{
+		PinThread(mThread, cpuCore);
+	}
+
+	return true;
+}
+
+void EventLoop::Stop()
+{
+	if (mRunning.exchange(false))
+	{
+		uint64_t value = 1;
+		ssize_t written = write(mWakeupDescriptor, &value, sizeof(value));
+		(void)written;
+
+		mThread.join();
+	}
+
+	mConnections.clear();
+	mHandshakes.clear();
+	mClientCount.store(0);
+
+	if (mWakeupDescriptor >= 0)
+	{
+		close(mWakeupDescriptor);
+		mWakeupDescriptor = -1;
+	}
+	if (mEventDescriptor >= 0)
+	{
+		close(mEventDescriptor);
+		mEventDescriptor = -1;
+	}
+}
+
+void EventLoop::AddClient(const TcpSocket& client)
+{
+	{
+		std::lock_guard<std::mutex> lock(mPendingMutex);
+		mPendingClients.push_back(client);
+	}
+
+	uint64_t value = 1;
+	ssize_t written = write(mWakeupDescriptor, &value, sizeof(value));
+	(void)written;
+}
+
+void EventLoop::NotifyClient(SOCKET descriptor)
+{
+	// Clients changed by the same writer wake the loop once
+	bool isWaking;
+	{
+		std::lock_guard<std::mutex> lock(mPendingMutex);
+		isWaking = mNotifiedClients.empty();
+		mNotifiedClients.push_back(descriptor);
+	}
+
+	if (isWaking)
+	{
+		uint64_t value = 1;
+		ssize_t written = write(mWakeupDescriptor, &value, sizeof(value));
+		(void)written;
+	}
+}
+
+#else
+
+bool EventLoop::Start(int cpuCore)
+{
+	std::cout << "EventLoop::Start : event loops are not supported on this platform" << std::endl;
+	return false;
+}
+
+void EventLoop::Stop()
+{
+}
+
+void EventLoop::AddClient(const TcpSocket& client)
+{
+}
+
+void EventLoop::NotifyClient(SOCKET descriptor)
+{
+}
+
+#endif
+
+int EventLoop::GetClientCount() const
+{
+	return mClientCount.load();
+}
+
+bool EventLoop::PinThread(std::thread& thread, int cpuCore)
+{
+#ifdef __linux__
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	CPU_SET(cpuCore, &cpuSet);
+
+	int error = pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuSet);
+	if (error != 0)
+	{
+		std::cout << "EventLoop::PinThread failed to pin thread to core " << cpuCore << " : " << error << std::endl;
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+/*-----------------------------------------------------------------------------
+	Event processing
+-----------------------------------------------------------------------------*/
+
+#ifndef WIN32
+
+void EventLoop::Run()
+{
+	struct epoll_event events[cMaxEvents];
+
+	while (mRunning.load())
+	{
+		// Wake up regularly while handshakes are running, to enforce their timeout
+		int timeout = mHandshakes.size() ? cHandshakeCheckPeriod : -1;
+		int count = epoll_wait(mEventDescriptor, events, cMaxEvents, timeout);
+		if (count < 0 && errno != EINTR)
+		{
+			std::cout << "EventLoop::Run failed to wait for events : " << errno << std::endl;
+			break;
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			int descriptor = events[i].data.fd;
+
+			// New clients were handed over, or clients have notifications
+			if (descriptor == mWakeupDescriptor)
+			{
+				uint64_t value;
+				ssize_t length = read(mWakeupDescriptor, &value, sizeof(value));
+				(void)length;
+
+				RegisterPendingClients();
+				ProcessNotifications();
+			}
+
+			// Client activity
+			else
+			{
+				auto it = mConnections.find(descriptor);
+				if (it != mConnections.end())
+				{
+					bool isError = (events[i].events & (EPOLLERR | EPOLLHUP)) != 0;
+					if (isError || !ProcessConnection(*it->second))
+					{
+						CloseConnection(descriptor);
+					}
+				}
+			}
+		}
+
+		CloseExpiredHandshakes();
+	}
+}
+
+void EventLoop::RegisterPendingClients()
+{
+	std::vector<TcpSocket> clients;
+	{
+		std::lock_guard<std::mutex> lock(mPendingMutex);
+		clients.swap(mPendingClients);
+	}
+
+	for (auto& client : clients)
+	{
+		SOCKET descriptor = client.GetDescriptor();
+		if (!client.SetNonBlocking())
+		{
+			continue;
+		}
+
+		// Watch for reads and writes, edge-triggered
+		struct epoll_event event = { 0 };
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.fd = descriptor;
+		if (epoll_ctl(mEventDescriptor, EPOLL_CTL_ADD, descriptor, &event) < 0)
+		{
+			std::cout << "EventLoop::RegisterPendingClients failed to register client : " << errno << std::endl;
+			continue;
+		}
+
+		Connection* pConnection = new Connection(mpDatabase, client);
+		pConnection->handler->SetNotificationWake([this, descriptor]()
+		{
+			NotifyClient(descriptor);
+		});
+		pConnection->handshakeDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(mHandshakeTimeout);
+		mConnections[descriptor] = std::unique_ptr<Connection>(pConnection);
+		mHandshakes.push_back(descriptor);
+		mClientCount++;
+
+		// Data may have arrived before registration
+		if (!ProcessConnection(*mConnections[descriptor]))
+		{
+			CloseConnection(descriptor);
+		}
+	}
+}
+
+bool EventLoop::ProcessConnection(Connection& connection)
+{
+	// Run the secure handshake until it completes
+	if (connection.isHandshaking)
+	{
+		TcpSocketStatus handshakeStatus = connection.socket.Handshake();
+		if (handshakeStatus == TcpSocketStatus::T_WOULD_BLOCK)
+		{
+			return true;
+		}
+		else if (handshakeStatus == TcpSocketStatus::T_CLOSED)
+		{
+			return false;
+		}
+		connection.isHandshaking = false;
+	}
+
+	// A connection that is closing only sends its last replies
+	std::string& output = connection.stream.GetOutputBuffer();
+	if (connection.isClosing)
+	{
+		return connection.socket.WriteAvailable(output) != TcpSocketStatus::T_CLOSED && output.length() > 0;
+	}
+
+	bool keepConnection = true;
+	bool isProgressing = true;
+	while (keepConnection && isProgressing)
+	{
+		// Read until the socket is drained, as we will not be notified again for this data, or the input is full
+		size_t inputSize = connection.stream.GetInputSize();
+		TcpSocketStatus readStatus = TcpSocketStatus::T_OK;
+		if (inputSize < cMaxInputSize)
+		{
+			readStatus = connection.socket.ReadAvailable(connection.stream.GetInputBuffer(), cMaxInputSize - inputSize);
+		}
+
+		// Process complete requests, batching replies, in buffers kept with the connection, until replies back up
+		bool isBackedUp = false;
+		bool isRunning = false;
+		while (keepConnection && !(isBackedUp = output.length() >= cMaxOutputSize) && connection.stream.ReadMessage(connection.request))
+		{
+			keepConnection = connection.handler->ProcessClientRequest(connection.request, connection.reply);
+			connection.stream.WriteMessage(connection.reply);
+			isRunning = true;
+		}
+
+		// Send notifications along with the replies
+		if (keepConnection && connection.handler->WriteNotifications(connection.reply))
+		{
+			connection.stream.WriteMessage(connection.reply);
+		}
+
+		// Send replies, the remainder will be sent on the next write notification
+		if (output.length() && connection.socket.WriteAvailable(output) == TcpSocketStatus::T_CLOSED)
+		{
+			return false;
+		}
+
+		// Go on while the socket may hold more requests, or requests waited for replies to be sent
+		keepConnection &= connection.stream.IsValid() && readStatus != TcpSocketStatus::T_CLOSED;
+		isProgressing = output.length() < cMaxOutputSize
+			&& (readStatus == TcpSocketStatus::T_OK || isBackedUp)
+			&& (isRunning || isBackedUp || connection.stream.GetInputSize() > inputSize);
+	}
+
+	// Close once the last replies are sent
+	connection.isClosing = !keepConnection;
+	return !connection.isClosing || output.length() > 0;
+}
+
+void EventLoop::ProcessNotifications()
+{
+	std::vector<SOCKET> descriptors;
+	{
+		std::lock_guard<std::mutex> lock(mPendingMutex);
+		descriptors.swap(mNotifiedClients);
+	}
+
+	for (SOCKET descriptor : descriptors)
+	{
+		auto it = mConnections.find(descriptor);
+		if (it == mConnections.end() || it->second->isHandshaking)
+		{
+			continue;
+		}
+
+		// While replies are still being sent, notifications keep coalescing until the next write notification
+		Connection& connection = *it->second;
+		std::string& output = connection.stream.GetOutputBuffer();
+		if (connection.isClosing || output.length() || !connection.handler->WriteNotifications(connection.reply))
+		{
+			continue;
+		}
+
+		connection.stream.WriteMessage(connection.reply);
+		if (connection.socket.WriteAvailable(output) == TcpSocketStatus::T_CLOSED)
+		{
+			CloseConnection(descriptor);
+		}
+	}
+}
+
+void EventLoop::CloseConnection(SOCKET descriptor)
+{
+	epoll_ctl(mEventDescriptor, EPOLL_CTL_DEL, descriptor, nullptr);
+
+	mConnections.erase(descriptor);
+	mClientCount--;
+}
+
+void EventLoop::CloseExpiredHandshakes()
+{
+	auto now = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < mHandshakes.size();)
+	{
+		auto it = mConnections.find(mHandshakes[i]);
+
+		// Connection was closed, or is done with the handshake
+		if (it == mConnections.end() || !it->second->isHandshaking)
+		{
+			mHandshakes[i] = mHandshakes.back();
+			mHandshakes.pop_back();
+		}
+
+		// Handshake took too long
+		else if (now > it->second->handshakeDeadline)
+		{
+			std::cout << "EventLoop::CloseExpiredHandshakes : handshake timed out for " << it->second->socket.GetClientAddress() << std::endl;
+			CloseConnection(mHandshakes[i]);
+			mHandshakes[i] = mHandshakes.back();
+			mHandshakes.pop_back();
+		}
+
+		else
+		{
+			i++;
+		}
+	}
+}
+
+#else
+
+void EventLoop::Run()
+{
+}
+
+void EventLoop::RegisterPendingClients()
+{
+}
+
+bool EventLoop::ProcessConnection(Connection& connection)
+{
+	return false;
+}
+
+void EventLoop::ProcessNotifications()
+{
+}
+
+void EventLoop::CloseConnection(SOCKET descriptor)
+{
+}
+
+void EventLoop::CloseExpiredHandshakes()
+{
+}
+
+#endif
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <chrono>
+#include "network/tcpsocket.h"
+
+class Database;
+class Handler;
+
+
+/*-----------------------------------------------------------------------------
+	EventLoop class definition
+-----------------------------------------------------------------------------*/
+
+class EventLoop
+{
+
+public:
+
+	EventLoop(std::shared_ptr<Database> pDb, uint32_t handshakeTimeout);
+
+	~EventLoop();
+
+
+	// Start processing events on a dedicated thread, pinned to cpuCore if not negative
+	bool Start(int cpuCore = -1);
+
+	// Stop processing events, close all connections
+	void Stop();
+
+	// Hand over a connected client to this loop, can be called from any thread
+	void AddClient(const TcpSocket& client);
+
+	// Send the pending notifications of a client of this loop, can be called from any thread
+	void NotifyClient(SOCKET descriptor);
+
+	// Get the number of clients currently served by this loop
+	int GetClientCount() const;
+
+	// Restrict a thread to run on a single core
+	static bool PinThread(std::thread& thread, int cpuCore);
+
+
+private:
+
+	// Client connection state
+	struct Connection
+	{
+		Connection(std::shared_ptr<Database> pDb, const TcpSocket& client);
+
+		~Connection();
+
+		TcpSocket                                   socket;
+		std::unique_ptr<Handler>                    handler;
+		MessageStream                               stream;
+		std::string                                 request;
+		std::string                                 reply;
+		bool                                        isHandshaking;
+		bool                                        isClosing;
+		std::chrono::steady_clock::time_point       handshakeDeadline;
+	};
+
+
+private:
+
+	// Event processing thread
+	void Run();
+
+	// Register clients handed over by AddClient
+	void RegisterPendingClients();
+
+	// Process events on a client, return false to close it. Requests are only read and run while their
+	// replies can be sent, so that a client that doesn't read its replies can't grow the buffers.
+	bool ProcessConnection(Connection& connection);
+
+	// Send the pending notifications of clients given to NotifyClient
+	void ProcessNotifications();
+
+	// Remove a client from the loop
+	void CloseConnection(SOCKET descriptor);
+
+	// Close clients that did not complete their handshake in time
+	void CloseExpiredHandshakes();
+
+
+private:
+
+	std::shared_ptr<Database>                       mpDatabase;
+	std::unordered_map<SOCKET, std::unique_ptr<Connection>> mConnections;
+	std::atomic<int>                                mClientCount;
+	std::vector<SOCKET>                             mHandshakes;
+	uint32_t                                        mHandshakeTimeout;
+
+	std::vector<TcpSocket>                          mPendingClients;
+	std::vector<SOCKET>                             mNotifiedClients;
+	std::mutex                                      mPendingMutex;
+
+	std::thread                                     mThread;
+	std::atomic<bool>                               mRunning;
+	int                                             mEventDescriptor;
+	int                                             mWakeupDescriptor;
+
+	static const int                                cMaxEvents = 256;
+	static const int                                cHandshakeCheckPeriod = 250;
+
+	// Buffered requests hold at least one message of the largest size, replies stop requests past cMaxOutputSize
+	static const size_t                             cMaxInputSize = MessageStream::cMaxMessageSize + MessageStream::cHeaderSize;
+	static const size_t                             cMaxOutputSize = 1024 * 1024;
+
+};
@@ -0,0 +1,170 @@
+#include "messagestream.h"
+#include <iostream>
+#include <cstring>
+
+
+/*-----------------------------------------------------------------------------
+	Constructors & destructor
+-----------------------------------------------------------------------------*/
+
+MessageStream::MessageStream(MessageFraming framing)
+	: mFraming(framing)
+	, mIsValid(true)
+	, mInputOffset(0)
+	, mScanOffset(0)
+{
+}
+
+
+/*-----------------------------------------------------------------------------
+	Public interface
+-----------------------------------------------------------------------------*/
+
+std::string& MessageStream::GetInputBuffer()
+{
+	return mInput;
+}
+
+std::string& MessageStream::GetOutputBuffer()
+{
+	return mOutput;
+}
+
+bool MessageStream::ReadMessage(std::string& message)
+{
+	DetectFraming();
+
+	// Newline-delimited messages, skipping empty lines
+	if (mFraming == MessageFraming::T_LINE)
+	{
+		while (true)
+		{
+			size_t end = mInput.find('\n', mScanOffset);
+			if (end == std::string::npos)
+			{
+				mScanOffset = mInput.length();
+				if (mInput.length() - mInputOffset > cMaxMessageSize)
+				{
+					std::cout << "MessageStream::ReadMessage : message exceeds " << cMaxMessageSize << " bytes" << std::endl;
+					mIsValid = false;
+				}
+				break;
+			}
+
+			size_t length = end - mInputOffset;
+			if (length > 0 && mInput[end - 1] == '\r')
+			{
+				length--;
+			}
+
+			size_t start = mInputOffset;
+			mInputOffset = end + 1;
+			mScanOffset = mInputOffset;
+
+			if (length > 0)
+			{
+				message.assign(mInput, start, length);
+				CompactInput();
+				return true;
+			}
+		}
+	}
+
+	// Length-prefixed messages
+	else if (mFraming == MessageFraming::T_LENGTH && mInput.length() - mInputOffset >= cHeaderSize)
+	{
+		const uint8_t* header = reinterpret_cast<const uint8_t*>(mInput.data() + mInputOffset);
+		uint32_t length = (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) | (uint32_t(header[2]) << 8) | uint32_t(header[3]);
+
+		if (length > cMaxMessageSize)
+		{
+			std::cout << "MessageStream::ReadMessage : message exceeds " << cMaxMessageSize << " bytes" << std::endl;
+			mIsValid = false;
+		}
+		else if (mInput.length() - mInputOffset - cHeaderSize >= length)
+		{
+			message.assign(mInput, mInputOffset + cHeaderSize, length);
+			mInputOffset += cHeaderSize + length;
+			mScanOffset = mInputOffset;
+			CompactInput();
+			return true;
+		}
+	}
+
+	CompactInput();
+	return false;
+}
+
+void MessageStream::WriteMessage(const std::string& message)
+{
+	if (mFraming == MessageFraming::T_LENGTH)
+	{
+		uint32_t length = static_cast<uint32_t>(message.length());
+		char header[cHeaderSize] = {
+			char((length >> 24) & 0xFF),
+			char((length >> 16) & 0xFF),
+			char((length >> 8) & 0xFF),
+			char(length & 0xFF) };
+
+		mOutput.append(header, cHeaderSize);
+		mOutput.append(message);
+	}
+	else
+	{
+		mOutput.append(message);
+		mOutput.push_back('\n');
+	}
+}
+
+MessageFraming MessageStream::GetFraming() const
+{
+	return mFraming;
+}
+
+bool MessageStream::IsValid() const
+{
+	return mIsValid;
+}
+
+size_t MessageStream::GetInputSize() const
+{
+	return mInput.length() - mInputOffset;
+}
+
+
+/*-----------------------------------------------------------------------------
+	Private methods
+-----------------------------------------------------------------------------*/
+
+void MessageStream::DetectFraming()
+{
+	// JSON text always starts with a printable character or whitespace, a length header never does
+	if (mFraming == MessageFraming::T_UNKNOWN && mInput.length() > mInputOffset)
+	{
+		uint8_t first = static_cast<uint8_t>(mInput[mInputOffset]);
+		if (first >= 0x20 || first == '\t' || first == '\r' || first == '\n')
+		{
+			mFraming = MessageFraming::T_LINE;
+		}
+		else
+		{
+			mFraming = MessageFraming::T_LENGTH;
+		}
+	}
+}
+
+void MessageStream::CompactInput()
+{
+	if (mInputOffset == mInput.length())
+	{
+		mInput.clear();
+		mInputOffset = 0;
+		mScanOffset = 0;
+	}
+	else if (mInputOffset > cMaxMessageSize / 16 && mInputOffset > mInput.length() / 2)
+	{
+		mInput.erase(0, mInputOffset);
+		mScanOffset -= mInputOffset;
+		mInputOffset = 0;
+	}
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+
+/*-----------------------------------------------------------------------------
+	Message stream types
+-----------------------------------------------------------------------------*/
+
+// Framing of messages on a stream : newline-delimited text, or 32-bit big-endian length prefix
+enum class MessageFraming { T_UNKNOWN = 0, T_LINE, T_LENGTH };
+
+
+/*-----------------------------------------------------------------------------
+	MessageStream class definition
+-----------------------------------------------------------------------------*/
+
+class MessageStream
+{
+
+public:
+
+	// Framing is detected from the first received byte unless specified
+	MessageStream(MessageFraming framing = MessageFraming::T_UNKNOWN);
+
+
+	// Get the buffer where received data should be appended
+	std::string& GetInputBuffer();
+
+	// Get the buffer of framed data waiting to be sent
+	std::string& GetOutputBuffer();
+
+	// Extract the next complete message from the input buffer, return false if there is none
+	bool ReadMessage(std::string& message);
+
+	// Frame a message into the output buffer
+	void WriteMessage(const std::string& message);
+
+	// Get the framing used by this stream
+	MessageFraming GetFraming() const;
+
+	// Check if the stream is still usable, ie no oversized message was received
+	bool IsValid() const;
+
+	// Get the size of the received data that was not extracted as messages yet
+	size_t GetInputSize() const;
+
+public:
+
+	static const uint32_t                           cMaxMessageSize = 1024 * 1024;
+	static const uint32_t                           cHeaderSize = 4;
+
+
+private:
+
+	// Detect framing from the first byte received
+	void DetectFraming();
+
+	// Release the consumed part of the input buffer
+	void CompactInput();
+
+
+private:
+
+	MessageFraming                                  mFraming;
+	bool                                            mIsValid;
+
+	std::string                                     mInput;
+	size_t                                          mInputOffset;
+	size_t                                          mScanOffset;
+	std::string                                     mOutput;
+
+};
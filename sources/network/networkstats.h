@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+
+/*-----------------------------------------------------------------------------
+	Network statistics
+-----------------------------------------------------------------------------*/
+
+class NetworkStats
+{
+public:
+
+	// Get the process-wide statistics
+	static NetworkStats& Get()
+	{
+		static NetworkStats sStats;
+		return sStats;
+	}
+
+public:
+
+	// TLS handshakes
+	std::atomic<int64_t>                            handshakesInFlight;
+	std::atomic<int64_t>                            handshakesCompleted;
+	std::atomic<int64_t>                            handshakesFailed;
+	std::atomic<int64_t>                            handshakesResumed;
+
+	// Kernel TLS offload
+	std::atomic<int64_t>                            kernelTLSSend;
+	std::atomic<int64_t>                            kernelTLSRecv;
+
+
+private:
+
+	NetworkStats()
+		: handshakesInFlight(0)
+		, handshakesCompleted(0)
+		, handshakesFailed(0)
+		, handshakesResumed(0)
+		, kernelTLSSend(0)
+		, kernelTLSRecv(0)
+	{}
+
+};
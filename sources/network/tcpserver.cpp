@@ -1,21 +1,30 @@
 #include "tcpserver.h"
+#include "eventloop.h"
 #include "data/handler.h"
 #include <thread>
 #include <iostream>
 #include <memory>
+#include <algorithm>
 
 
 /*-----------------------------------------------------------------------------
 	Constructors & destructor
 -----------------------------------------------------------------------------*/
 
-TcpServer::TcpServer(std::shared_ptr<Database> pDb)
+TcpServer::TcpServer(std::shared_ptr<Database> pDb, uint32_t ioThreads, uint32_t handshakeTimeout, uint32_t listeners)
 	: pDatabase(pDb)
+	, mIoThreads(ioThreads)
+	, mHandshakeTimeout(handshakeTimeout)
+	, mListeners(std::max(listeners, 1u))
 {
 }
 
 TcpServer::~TcpServer()
 {
+	for (auto& loop : mEventLoops)
+	{
+		loop->Stop();
+	}
 }
 
 
@@ -23,37 +32,120 @@ TcpServer::~TcpServer()
 	Public interface
 -----------------------------------------------------------------------------*/
 
-void TcpServer::Listen(uint16_t port, uint32_t nClients, const std::string& certFile, const std::string& keyFile)
+void TcpServer::Listen(uint16_t port, uint32_t nClients, const std::string& certFile, const std::string& keyFile, bool useKernelTLS)
 {
-	TcpSocket socket;
+	std::vector<TcpSocket> sockets(mListeners);
+	bool isSharded = (mListeners > 1);
+	uint32_t cores = std::max(std::thread::hardware_concurrency(), 1u);
 
-	// Setup socket
+	// Setup sockets, sharing the same SSL context
 	if (certFile.length() > 0 && keyFile.length() > 0)
 	{
-		socket.SetSSLServer(certFile, keyFile);
+		sockets[0].SetSSLServer(certFile, keyFile, nClients);
+		if (useKernelTLS && !sockets[0].SetKernelTLS())
+		{
+			std::cout << "TcpServer::Listen : kernel TLS is not available, using OpenSSL" << std::endl;
+		}
+		for (uint32_t i = 1; i < mListeners; i++)
+		{
+			sockets[i].ShareSSLContext(sockets[0]);
+		}
+	}
+
+	// Start event loops, one per listener when sharded
+	uint32_t loopCount = (isSharded && mIoThreads > 0) ? mListeners : mIoThreads;
+	for (uint32_t i = 0; i < loopCount; i++)
+	{
+		std::unique_ptr<EventLoop> loop(new EventLoop(pDatabase, mHandshakeTimeout));
+		if (loop->Start(isSharded ? int(i % cores) : -1))
+		{
+			mEventLoops.push_back(std::move(loop));
+		}
+		else
+		{
+			std::cout << "TcpServer::Listen failed to start event loop, using a thread per client" << std::endl;
+			mEventLoops.clear();
+			break;
+		}
+	}
+
+	// Try listening on sockets
+	for (auto& socket : sockets)
+	{
+		if (!socket.Listen(port, nClients, isSharded))
+		{
+			return;
+		}
+	}
+
+	// Single listener : accept on this thread
+	if (!isSharded)
+	{
+		AcceptClients(sockets[0], nullptr);
+	}
+
+	// Sharded listeners : the kernel balances new connections across the accept loops
+	else
+	{
+		std::vector<std::thread> acceptThreads;
+		for (uint32_t i = 0; i < mListeners; i++)
+		{
+			EventLoop* pLoop = mEventLoops.size() ? mEventLoops[i].get() : nullptr;
+			acceptThreads.push_back(std::thread(&TcpServer::AcceptClients, this, sockets[i], pLoop));
+			EventLoop::PinThread(acceptThreads.back(), int(i % cores));
+		}
+		for (auto& thread : acceptThreads)
+		{
+			thread.join();
+		}
 	}
+}
 
-	// Try listening on socket
-	if (socket.Listen(port, nClients))
+
+/*-----------------------------------------------------------------------------
+	Private methods
+-----------------------------------------------------------------------------*/
+
+void TcpServer::AcceptClients(TcpSocket socket, EventLoop* pLoop)
+{
+	// Accept clients, hand them over to an event loop or fork the socket as a thread
+	while (true)
 	{
-		// Accept clients, fork the socket as a thread
-		std::vector<std::thread> clients;
-		while (true)
+		TcpSocket client = socket.Accept();
+		if (client.IsValid())
 		{
-			TcpSocket client = socket.Accept();
-			if (client.IsValid())
+			if (pLoop)
 			{
-				clients.push_back(std::thread(ProcessClient, pDatabase, client));
+				pLoop->AddClient(client);
+			}
+			else if (mEventLoops.size())
+			{
+				GetEventLoop()->AddClient(client);
+			}
+			else
+			{
+				std::thread(ProcessClient, pDatabase, client, mHandshakeTimeout).detach();
 			}
 		}
+	}
+
+	// Terminate connections
+	socket.Close();
+}
 
-		// Terminate connections, wait for exit
-		socket.Close();
-		for (auto& client : clients)
+EventLoop* TcpServer::GetEventLoop() const
+{
+	EventLoop* pBestLoop = mEventLoops[0].get();
+
+	for (auto& loop : mEventLoops)
+	{
+		if (loop->GetClientCount() < pBestLoop->GetClientCount())
 		{
-			client.join();
+			pBestLoop = loop.get();
 		}
 	}
+
+	return pBestLoop;
 }
 
 
@@ -61,18 +153,39 @@ void TcpServer::Listen(uint16_t port, uint32_t nClients, const std::string& cert
 	Callback
 -----------------------------------------------------------------------------*/
 
-void TcpServer::ProcessClient(std::shared_ptr<Database> pDatabase, TcpSocket client)
+void TcpServer::ProcessClient(std::shared_ptr<Database> pDatabase, TcpSocket client, uint32_t handshakeTimeout)
 {
 	Handler handler(pDatabase, client.GetClientAddress());
+	MessageStream stream;
 	bool keepConnection = true;
+	std::string request;
+	std::string reply;
+
+	// Establish the secure session
+	client.SetTimeout(handshakeTimeout);
+	if (client.Handshake() != TcpSocketStatus::T_OK)
+	{
+		return;
+	}
+	client.SetTimeout(0);
 
 	do {
-		std::string request;
-		std::string reply;
 
-		keepConnection &= client.Read(request);
-		keepConnection &= handler.ProcessClientRequest(request, reply);
-		keepConnection &= client.Write(reply);
+		// Wait for at least one request
+		keepConnection &= client.Read(stream, request);
+
+		// Process it and every other request already received, reply in one batch
+		while (keepConnection)
+		{
+			keepConnection &= handler.ProcessClientRequest(request, reply);
+			stream.WriteMessage(reply);
+
+			if (!stream.ReadMessage(request))
+			{
+				break;
+			}
+		}
+		keepConnection &= client.Write(stream);
 
 	} while (keepConnection);
 }
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 #include "network/tcpsocket.h"
 
 class Database;
+class EventLoop;
 
 
 /*-----------------------------------------------------------------------------
@@ -15,22 +17,34 @@ class TcpServer
 
 public:
 
-	TcpServer(std::shared_ptr<Database> pDb);
+	// Serve clients with ioThreads event loops, or a thread per client if ioThreads is zero.
+	// With several listeners, each gets its own accept loop and event loop, pinned to a core.
+	TcpServer(std::shared_ptr<Database> pDb, uint32_t ioThreads = 0, uint32_t handshakeTimeout = 5, uint32_t listeners = 1);
 
 	~TcpServer();
 
 
 	// Start listening on port with up to nClients clients
-	void Listen(uint16_t port, uint32_t nClients, const std::string& certFile = "", const std::string& keyFile = "");
+	void Listen(uint16_t port, uint32_t nClients, const std::string& certFile = "", const std::string& keyFile = "", bool useKernelTLS = false);
 
 
 private:
 
-	static void ProcessClient(std::shared_ptr<Database> pDatabase, TcpSocket client);
+	// Accept clients on socket, handing them over to pLoop, the least busy loop if null, or a new thread
+	void AcceptClients(TcpSocket socket, EventLoop* pLoop);
+
+	// Get the least busy event loop
+	EventLoop* GetEventLoop() const;
+
+	static void ProcessClient(std::shared_ptr<Database> pDatabase, TcpSocket client, uint32_t handshakeTimeout);
 
 
 private:
 
 	std::shared_ptr<Database>                       pDatabase;
+	uint32_t                                        mIoThreads;
+	uint32_t                                        mHandshakeTimeout;
+	uint32_t                                        mListeners;
+	std::vector<std::unique_ptr<EventLoop>>         mEventLoops;
 
 };
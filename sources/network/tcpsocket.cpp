@@ -1,6 +1,122 @@
 #include "tcpsocket.h"
+#include "networkstats.h"
 #include <iostream>
 #include <cassert>
+#include <csignal>
+#include <cerrno>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <cstring>
+#include <openssl/rand.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#else
+#  include <openssl/hmac.h>
+#endif
+
+
+/*-----------------------------------------------------------------------------
+	Session tickets
+-----------------------------------------------------------------------------*/
+
+// Key used to encrypt session tickets
+struct TicketKey
+{
+	unsigned char                                name[16];
+	unsigned char                                aesKey[32];
+	unsigned char                                hmacKey[32];
+	std::chrono::steady_clock::time_point        creationTime;
+	bool                                         isValid;
+};
+
+// Tickets are encrypted with the current key, and still accepted with the previous one
+static TicketKey   sTicketKeys[2] = {};
+static std::mutex  sTicketKeyMutex;
+
+// Get the current ticket key, rotating keys when it is too old. The lock must be held.
+static const TicketKey& GetCurrentTicketKey(int lifetime)
+{
+	auto now = std::chrono::steady_clock::now();
+
+	if (!sTicketKeys[0].isValid || now - sTicketKeys[0].creationTime > std::chrono::seconds(lifetime))
+	{
+		sTicketKeys[1] = sTicketKeys[0];
+
+		RAND_bytes(sTicketKeys[0].name, sizeof(sTicketKeys[0].name));
+		RAND_bytes(sTicketKeys[0].aesKey, sizeof(sTicketKeys[0].aesKey));
+		RAND_bytes(sTicketKeys[0].hmacKey, sizeof(sTicketKeys[0].hmacKey));
+		sTicketKeys[0].creationTime = now;
+		sTicketKeys[0].isValid = true;
+	}
+
+	return sTicketKeys[0];
+}
+
+// Ticket key callback for OpenSSL : return 1 on success, 2 to renew an accepted ticket, 0 to reject it
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int TicketKeyCallback(SSL* pSession, unsigned char* keyName, unsigned char* iv, EVP_CIPHER_CTX* pCipher, EVP_MAC_CTX* pMac, int isEncrypting)
+#else
+static int TicketKeyCallback(SSL* pSession, unsigned char* keyName, unsigned char* iv, EVP_CIPHER_CTX* pCipher, HMAC_CTX* pMac, int isEncrypting)
+#endif
+{
+	std::lock_guard<std::mutex> lock(sTicketKeyMutex);
+	const TicketKey& currentKey = GetCurrentTicketKey(SSL_CTX_get_timeout(SSL_get_SSL_CTX(pSession)));
+	const TicketKey* pKey = nullptr;
+
+	// New ticket : use the current key
+	if (isEncrypting)
+	{
+		if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0)
+		{
+			return -1;
+		}
+		pKey = &currentKey;
+		memcpy(keyName, pKey->name, sizeof(pKey->name));
+	}
+
+	// Ticket from a client : find the key it was encrypted with
+	else
+	{
+		for (const TicketKey& key : sTicketKeys)
+		{
+			if (key.isValid && memcmp(keyName, key.name, sizeof(key.name)) == 0)
+			{
+				pKey = &key;
+				break;
+			}
+		}
+		if (pKey == nullptr)
+		{
+			return 0;
+		}
+	}
+
+	// Setup encryption
+	if (isEncrypting)
+	{
+		EVP_EncryptInit_ex(pCipher, EVP_aes_256_cbc(), nullptr, pKey->aesKey, iv);
+	}
+	else
+	{
+		EVP_DecryptInit_ex(pCipher, EVP_aes_256_cbc(), nullptr, pKey->aesKey, iv);
+	}
+
+	// Setup authentication
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	char digest[] = "SHA256";
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void*)pKey->hmacKey, sizeof(pKey->hmacKey)),
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+		OSSL_PARAM_construct_end() };
+	EVP_MAC_CTX_set_params(pMac, params);
+#else
+	HMAC_Init_ex(pMac, pKey->hmacKey, sizeof(pKey->hmacKey), EVP_sha256(), nullptr);
+#endif
+
+	return (pKey == &currentKey) ? 1 : 2;
+}
 
 
 /*-----------------------------------------------------------------------------
@@ -78,7 +194,7 @@ TcpSocket::~TcpSocket()
 	Public interface
 -----------------------------------------------------------------------------*/
 
-bool TcpSocket::SetSSLServer(const std::string& certFile, const std::string& keyFile)
+bool TcpSocket::SetSSLServer(const std::string& certFile, const std::string& keyFile, uint32_t sessionCacheSize)
 {
 	// Create context
 	mSSLContext = SSL_CTX_new(SSLv23_server_method());
@@ -90,7 +206,22 @@ bool TcpSocket::SetSSLServer(const std::string& certFile, const std::string& key
 	}
 
 	// Set parameters
-	SSL_CTX_set_timeout(mSSLContext, 5);
+	SSL_CTX_set_timeout(mSSLContext, cSessionLifetime);
+
+	// Cache sessions for resumption, and issue session tickets with rotating keys
+	const char sessionContext[] = "EchoRAM";
+	SSL_CTX_set_session_cache_mode(mSSLContext, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(mSSLContext, sessionCacheSize);
+	SSL_CTX_set_session_id_context(mSSLContext, (const unsigned char*)sessionContext, sizeof(sessionContext) - 1);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	// Mobile clients often drop the connection without closing the session : keep it resumable
+	SSL_CTX_set_options(mSSLContext, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(mSSLContext, TicketKeyCallback);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(mSSLContext, TicketKeyCallback);
+#endif
 
 	// Load cert file
 	if (SSL_CTX_use_certificate_file(mSSLContext, certFile.c_str(), SSL_FILETYPE_PEM) < 0)
@@ -111,6 +242,38 @@ bool TcpSocket::SetSSLServer(const std::string& certFile, const std::string& key
 	return true;
 }
 
+bool TcpSocket::ShareSSLContext(const TcpSocket& other)
+{
+	if (other.mSSLContext && SSL_CTX_up_ref(other.mSSLContext))
+	{
+		mSSLContext = other.mSSLContext;
+		return true;
+	}
+	else
+	{
+		std::cout << "Socket::ShareSSLContext : no context to share" << std::endl;
+		return false;
+	}
+}
+
+bool TcpSocket::SetKernelTLS()
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	if (mSSLContext)
+	{
+		SSL_CTX_set_options(mSSLContext, SSL_OP_ENABLE_KTLS);
+		return true;
+	}
+	else
+	{
+		std::cout << "Socket::SetKernelTLS : SSL is not enabled" << std::endl;
+		return false;
+	}
+#else
+	std::cout << "Socket::SetKernelTLS : kernel TLS is not supported by this OpenSSL build" << std::endl;
+	return false;
+#endif
+}
 
 bool TcpSocket::SetSSLClient(const std::string& caCertFile)
 {
@@ -234,7 +397,7 @@ bool TcpSocket::Connect(std::string url, uint16_t port)
 	return (mSocket != SOCKET_ERROR);
 }
 
-bool TcpSocket::Listen(uint16_t port, uint32_t clients)
+bool TcpSocket::Listen(uint16_t port, uint32_t clients, bool reusePort)
 {
 	// Create port string
 	char portString[cPortSize];
@@ -263,6 +426,19 @@ bool TcpSocket::Listen(uint16_t port, uint32_t clients)
 		// Reuse sockets
 		setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&isReuse, sizeof(isReuse));
 
+		// Share the port with other sockets, the kernel will balance connections between them
+		if (reusePort)
+		{
+#ifdef SO_REUSEPORT
+			if (setsockopt(mSocket, SOL_SOCKET, SO_REUSEPORT, (char*)&isReuse, sizeof(isReuse)) == SOCKET_ERROR)
+			{
+				std::cout << "Socket::Listen failed to share port : " << GetErrno() << std::endl;
+			}
+#else
+			std::cout << "Socket::Listen : port sharing is not supported on this platform" << std::endl;
+#endif
+		}
+
 		// Bind
 		if (bind(mSocket, rp->ai_addr, (unsigned int)rp->ai_addrlen) != SOCKET_ERROR)
 		{
@@ -316,19 +492,12 @@ const TcpSocket TcpSocket::Accept()
 			clientSocket = SOCKET_ERROR;
 		}
 
-		// Accept the SSL session
+		// Prepare the SSL session, the handshake will be run by the client processing
 		else
 		{
 			SSL_set_fd(pSSLSession, (int)clientSocket);
-			if (SSL_accept(pSSLSession) <= 0)
-			{
-				long error = ERR_get_error();
-				std::cout << "Socket::Accept failed to establish secure session : " << ERR_error_string(error, nullptr) << std::endl;
-
-				clientSocket = SOCKET_ERROR;
-				SSL_free(pSSLSession);
-				pSSLSession = nullptr;
-			}
+			SSL_set_accept_state(pSSLSession);
+			NetworkStats::Get().handshakesInFlight++;
 		}
 	}
 
@@ -336,6 +505,69 @@ const TcpSocket TcpSocket::Accept()
 	return TcpSocket(clientSocket, clientInfo, pSSLSession);
 }
 
+TcpSocketStatus TcpSocket::Handshake()
+{
+	if (mSSLSession == nullptr || SSL_is_init_finished(mSSLSession))
+	{
+		return TcpSocketStatus::T_OK;
+	}
+
+	int res = SSL_do_handshake(mSSLSession);
+	if (res == 1)
+	{
+		NetworkStats::Get().handshakesInFlight--;
+		NetworkStats::Get().handshakesCompleted++;
+		if (SSL_session_reused(mSSLSession))
+		{
+			NetworkStats::Get().handshakesResumed++;
+		}
+
+		// Report kernel offload, which OpenSSL enables after the handshake when the kernel supports it
+		bool isKernelSend = IsKernelTLSSend();
+		bool isKernelRecv = IsKernelTLSRecv();
+		if (isKernelSend || isKernelRecv)
+		{
+			NetworkStats::Get().kernelTLSSend += isKernelSend ? 1 : 0;
+			NetworkStats::Get().kernelTLSRecv += isKernelRecv ? 1 : 0;
+			std::cout << "Socket::Handshake : kernel TLS enabled for " << GetClientAddress()
+				<< (isKernelSend ? " (send)" : "") << (isKernelRecv ? " (recv)" : "") << std::endl;
+		}
+
+		return TcpSocketStatus::T_OK;
+	}
+
+	int error = SSL_get_error(mSSLSession, res);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+	{
+		return TcpSocketStatus::T_WOULD_BLOCK;
+	}
+	else
+	{
+		long sslError = ERR_get_error();
+		std::cout << "Socket::Handshake failed to establish secure session : " << ERR_error_string(sslError, nullptr) << std::endl;
+		return TcpSocketStatus::T_CLOSED;
+	}
+}
+
+bool TcpSocket::SetTimeout(uint32_t seconds)
+{
+#ifdef WIN32
+	DWORD timeout = seconds * 1000;
+#else
+	struct timeval timeout = { 0 };
+	timeout.tv_sec = seconds;
+#endif
+
+	if (setsockopt(mSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout)) == SOCKET_ERROR
+	 || setsockopt(mSocket, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout)) == SOCKET_ERROR)
+	{
+		std::cout << "Socket::SetTimeout failed : " << GetErrno() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
 bool TcpSocket::IsValid() const
 {
 	return (mSocket != SOCKET_ERROR);
@@ -343,7 +575,7 @@ bool TcpSocket::IsValid() const
 
 bool TcpSocket::Write(const std::string& data)
 {
-	if (mSSLSession)
+	if (mSSLSession && !IsKernelTLSSend())
 	{
 		int length = SSL_write(mSSLSession, data.data(), (int)data.size());
 		return (length == data.size());
@@ -351,7 +583,7 @@ bool TcpSocket::Write(const std::string& data)
 	else
 	{
 
-		int length = send(mSocket, (const char*)(data.data()), (int)data.size(), 0);
+		int length = send(mSocket, (const char*)(data.data()), (int)data.size(), MSG_NOSIGNAL);
 		return (length == data.size());
 	}
 }
@@ -384,6 +616,210 @@ bool TcpSocket::Read(std::string& data)
 	}
 }
 
+bool TcpSocket::Read(MessageStream& stream, std::string& message)
+{
+	char buffer[cBufferSize];
+
+	while (!stream.ReadMessage(message))
+	{
+		int length;
+
+		if (!stream.IsValid())
+		{
+			return false;
+		}
+
+		// Read data from socket
+		if (mSSLSession)
+		{
+			length = SSL_read(mSSLSession, buffer, cBufferSize);
+		}
+		else
+		{
+			length = recv(mSocket, buffer, cBufferSize, 0);
+		}
+
+		// Connection was closed
+		if (length <= 0)
+		{
+			return false;
+		}
+
+		stream.GetInputBuffer().append(buffer, length);
+	}
+
+	return true;
+}
+
+bool TcpSocket::Write(MessageStream& stream)
+{
+	std::string& output = stream.GetOutputBuffer();
+	bool isSuccess = true;
+
+	if (output.length())
+	{
+		isSuccess = Write(output);
+		output.clear();
+	}
+
+	return isSuccess;
+}
+
+bool TcpSocket::SetNonBlocking()
+{
+#ifdef WIN32
+	u_long isNonBlocking = 1;
+	if (ioctlsocket(mSocket, FIONBIO, &isNonBlocking) == SOCKET_ERROR)
+#else
+	int flags = fcntl(mSocket, F_GETFL, 0);
+	if (flags < 0 || fcntl(mSocket, F_SETFL, flags | O_NONBLOCK) < 0)
+#endif
+	{
+		std::cout << "Socket::SetNonBlocking failed : " << GetErrno() << std::endl;
+		return false;
+	}
+
+	// SSL writes may be retried from a different buffer address after a partial write
+	if (mSSLSession)
+	{
+		SSL_set_mode(mSSLSession, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	}
+
+	return true;
+}
+
+TcpSocketStatus TcpSocket::ReadAvailable(std::string& data, size_t maxLength)
+{
+	char buffer[cBufferSize];
+
+	while (maxLength > 0)
+	{
+		int length;
+		int size = (int)std::min<size_t>(maxLength, cBufferSize);
+
+		// Read data from socket
+		if (mSSLSession)
+		{
+			length = SSL_read(mSSLSession, buffer, size);
+			if (length <= 0)
+			{
+				int error = SSL_get_error(mSSLSession, length);
+				if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+				{
+					return TcpSocketStatus::T_WOULD_BLOCK;
+				}
+				return TcpSocketStatus::T_CLOSED;
+			}
+		}
+		else
+		{
+			length = recv(mSocket, buffer, size, 0);
+			if (length == 0)
+			{
+				return TcpSocketStatus::T_CLOSED;
+			}
+			else if (length < 0)
+			{
+				int error = GetErrno();
+#ifdef WIN32
+				if (error == WSAEWOULDBLOCK)
+#else
+				if (error == EAGAIN || error == EWOULDBLOCK)
+#endif
+				{
+					return TcpSocketStatus::T_WOULD_BLOCK;
+				}
+				else if (error == EINTR)
+				{
+					continue;
+				}
+				return TcpSocketStatus::T_CLOSED;
+			}
+		}
+
+		data.append(buffer, length);
+		maxLength -= length;
+	}
+
+	return TcpSocketStatus::T_OK;
+}
+
+TcpSocketStatus TcpSocket::WriteAvailable(std::string& data)
+{
+	bool isKernelSend = IsKernelTLSSend();
+	size_t offset = 0;
+
+	while (offset < data.size())
+	{
+		int length;
+		int remaining = (int)std::min(data.size() - offset, (size_t)INT32_MAX);
+
+		// Write data to the socket, directly if the kernel does the encryption
+		if (mSSLSession && !isKernelSend)
+		{
+			length = SSL_write(mSSLSession, data.data() + offset, remaining);
+			if (length <= 0)
+			{
+				int error = SSL_get_error(mSSLSession, length);
+				if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+				{
+					break;
+				}
+				return TcpSocketStatus::T_CLOSED;
+			}
+		}
+		else
+		{
+			length = send(mSocket, data.data() + offset, remaining, MSG_NOSIGNAL);
+			if (length < 0)
+			{
+				int error = GetErrno();
+#ifdef WIN32
+				if (error == WSAEWOULDBLOCK)
+#else
+				if (error == EAGAIN || error == EWOULDBLOCK)
+#endif
+				{
+					break;
+				}
+				else if (error == EINTR)
+				{
+					continue;
+				}
+				return TcpSocketStatus::T_CLOSED;
+			}
+		}
+
+		offset += length;
+	}
+
+	data.erase(0, offset);
+	return data.empty() ? TcpSocketStatus::T_OK : TcpSocketStatus::T_WOULD_BLOCK;
+}
+
+bool TcpSocket::IsKernelTLSSend() const
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	return mSSLSession && BIO_get_ktls_send(SSL_get_wbio(mSSLSession));
+#else
+	return false;
+#endif
+}
+
+bool TcpSocket::IsKernelTLSRecv() const
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	return mSSLSession && BIO_get_ktls_recv(SSL_get_rbio(mSSLSession));
+#else
+	return false;
+#endif
+}
+
+SOCKET TcpSocket::GetDescriptor() const
+{
+	return mSocket;
+}
+
 std::string TcpSocket::GetClientAddress() const
 {
 	char address[16] = { 0 };
@@ -399,6 +835,24 @@ std::string TcpSocket::GetClientAddress() const
 
 void TcpSocket::Close()
 {
+	// Shutdown SSL session first, so that a cleanly closed session stays cached for resumption
+	if (mSSLSession)
+	{
+		// Accepted sessions that never received the client's Finished message failed their handshake
+		char finished[EVP_MAX_MD_SIZE];
+		if (SSL_is_server(mSSLSession) && SSL_get_peer_finished(mSSLSession, finished, sizeof(finished)) == 0)
+		{
+			NetworkStats::Get().handshakesInFlight--;
+			NetworkStats::Get().handshakesFailed++;
+		}
+		else
+		{
+			SSL_shutdown(mSSLSession);
+		}
+		SSL_free(mSSLSession);
+		mSSLSession = nullptr;
+	}
+
 	// Shutdown socket
 	if (mSocket != SOCKET_ERROR)
 	{
@@ -411,14 +865,6 @@ void TcpSocket::Close()
 		mSocket = SOCKET_ERROR;
 	}
 
-	// Shutdown SSL session
-	if (mSSLSession)
-	{
-		SSL_shutdown(mSSLSession);
-		SSL_free(mSSLSession);
-		mSSLSession = nullptr;
-	}
-
 	// Shutdown SSL context
 	if (mSSLContext)
 	{
@@ -446,6 +892,8 @@ void TcpSocket::Initialize()
 	{
 		exit(EXIT_FAILURE);
 	}
+#else
+	signal(SIGPIPE, SIG_IGN);
 #endif
 
 	SSL_load_error_strings();
@@ -5,6 +5,7 @@
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include "network/messagestream.h"
 
 
 /*-----------------------------------------------------------------------------
@@ -18,6 +19,8 @@
 #  include <winsock2.h>
 #  include <ws2tcpip.h>
 
+#  define MSG_NOSIGNAL 0
+
 // Make Unix types behave as Winsock2
 #else
 
@@ -27,6 +30,7 @@
 #  include <arpa/inet.h>
 #  include <unistd.h>
 #  include <netdb.h>
+#  include <fcntl.h>
 
 #  define INVALID_SOCKET -1
 #  define SOCKET_ERROR -1
@@ -40,6 +44,14 @@ typedef struct in_addr IN_ADDR;
 #endif
 
 
+/*-----------------------------------------------------------------------------
+	Socket types
+-----------------------------------------------------------------------------*/
+
+// Result of a non-blocking operation
+enum class TcpSocketStatus { T_OK = 0, T_WOULD_BLOCK, T_CLOSED };
+
+
 /*-----------------------------------------------------------------------------
 	Socket class definition
 -----------------------------------------------------------------------------*/
@@ -66,8 +78,14 @@ public:
 	~TcpSocket();
 
 
-	// Setup this socket to work as a SSL server
-	bool SetSSLServer(const std::string& certFile, const std::string& keyFile);
+	// Setup this socket to work as a SSL server, caching up to sessionCacheSize sessions for resumption
+	bool SetSSLServer(const std::string& certFile, const std::string& keyFile, uint32_t sessionCacheSize = 1000);
+
+	// Use the same SSL server setup as another socket
+	bool ShareSSLContext(const TcpSocket& other);
+
+	// Offload encryption of established sessions to the kernel where supported, on a SSL server
+	bool SetKernelTLS();
 
 	// Setup this socket to work as a SSL client
 	bool SetSSLClient(const std::string& caCertFile = "");
@@ -75,12 +93,18 @@ public:
 	// Connect to the server at url:port
 	bool Connect(std::string url, uint16_t port = 80);
 
-	// Start listening on port
-	bool Listen(uint16_t port, uint32_t clients = 10);
+	// Start listening on port, letting other sockets listen on the same port if reusePort is set
+	bool Listen(uint16_t port, uint32_t clients = 10, bool reusePort = false);
 
-	// Wait for connection, accept when it arrives
+	// Wait for connection, accept when it arrives. Secure sessions still need a Handshake.
 	const TcpSocket Accept();
 
+	// Establish the secure session on an accepted socket, non-blocking sockets will need several calls
+	TcpSocketStatus Handshake();
+
+	// Set the timeout for blocking reads and writes, in seconds, or 0 to wait forever
+	bool SetTimeout(uint32_t seconds);
+
 	// is this socket OK ?
 	bool IsValid() const;
 
@@ -90,6 +114,31 @@ public:
 	// Read data from the socket
 	bool Read(std::string& data);
 
+	// Read from the socket until stream holds a complete message, and extract it
+	bool Read(MessageStream& stream, std::string& message);
+
+	// Send all messages waiting in stream at once
+	bool Write(MessageStream& stream);
+
+	// Switch this socket to non-blocking mode
+	bool SetNonBlocking();
+
+	// Read data available on a non-blocking socket, appending up to maxLength bytes to data.
+	// Return T_OK if it stopped there, as more data may be waiting.
+	TcpSocketStatus ReadAvailable(std::string& data, size_t maxLength);
+
+	// Write as much data as possible on a non-blocking socket, erasing what was sent
+	TcpSocketStatus WriteAvailable(std::string& data);
+
+	// Check if the kernel encrypts data sent on this socket
+	bool IsKernelTLSSend() const;
+
+	// Check if the kernel decrypts data received on this socket
+	bool IsKernelTLSRecv() const;
+
+	// Get the system handle for this socket
+	SOCKET GetDescriptor() const;
+
 	// Get the IP address of the connected client
 	std::string GetClientAddress() const;
 
@@ -124,5 +173,6 @@ private:
 
 	static const int                             cBufferSize = 16384;
 	static const int                             cPortSize = 15;
+	static const int                             cSessionLifetime = 1800;
 
 };
@@ -3,6 +3,7 @@
 #include "network/tcpserver.h"
 
 #include <string>
+#include <sstream>
 #include <iostream>
 
 
@@ -32,7 +33,15 @@ int main(int argc, char** argv)
 	int clients = 1000;
 	int dbPeriod = 5;
 	int clientIdleTime = 30;
+	int dbShards = 16;
+	int ioThreads = 4;
+	int listeners = 1;
 	int useSSL = 0;
+	int handshakeTimeout = 5;
+	int useKernelTLS = 0;
+	int autoIndexSearches = 100;
+	std::string indexKeys = "";
+	std::string engine = "records";
 	std::string publicCert = "cert.pem";
 	std::string privateKey = "key.pem";
 
@@ -45,21 +54,44 @@ int main(int argc, char** argv)
 	getOption(params, "--clients", "Accepting clients", clients);
 	getOption(params, "--update-period", "Updating database every", dbPeriod);
 	getOption(params, "--client-idle-time", "Max client idle time", clientIdleTime);
+	getOption(params, "--shards", "Database shards", dbShards);
+	getOption(params, "--io-threads", "Event loop threads", ioThreads);
+	getOption(params, "--listeners", "Listening sockets", listeners);
+	getOption(params, "--engine", "Search engine", engine);
+	getOption(params, "--index-keys", "Indexed attribute keys", indexKeys);
+	getOption(params, "--auto-index", "Searches before indexing a key", autoIndexSearches);
 
 	// SSL parameters
 	getOption(params, "--use-ssl", "Use SSL for encryption", useSSL);
 	getOption(params, "--public-cert", "Public SSL certificate file", publicCert);
 	getOption(params, "--private-key", "Private SSL key file", privateKey);
+	getOption(params, "--handshake-timeout", "Max SSL handshake time", handshakeTimeout);
+	getOption(params, "--ktls", "Use kernel TLS offload", useKernelTLS);
 
 	// Done parsing
 	std::cout << "--------------------------------------------------------------------------------" << std::endl;
 
 	// Start the server
-	std::shared_ptr<Database> pDatabase(new Database(dbPeriod, clientIdleTime));
-	TcpServer server(pDatabase);
+	DatabaseEngine dbEngine = DatabaseEngine::T_RECORDS;
+	if (engine == "columns")
+	{
+		dbEngine = DatabaseEngine::T_COLUMNS;
+		std::cout << "Column scans use " << ColumnStore::GetInstructionSet() << std::endl;
+	}
+	std::shared_ptr<Database> pDatabase(new Database(dbPeriod, clientIdleTime, dbShards, autoIndexSearches, dbEngine));
+	std::istringstream indexKeyList(indexKeys);
+	std::string indexKey;
+	while (std::getline(indexKeyList, indexKey, ','))
+	{
+		if (indexKey.length())
+		{
+			pDatabase->AddIndex(indexKey);
+		}
+	}
+	TcpServer server(pDatabase, ioThreads, handshakeTimeout, listeners);
 	if (useSSL)
 	{
-		server.Listen(port, clients, publicCert, privateKey);
+		server.Listen(port, clients, publicCert, privateKey, useKernelTLS != 0);
 	}
 	else
 	{
@@ -0,0 +1,1044 @@
+#pragma once
+
+#include "utils.h"
+#include "data/database.h"
+#include "data/request.h"
+#include "data/jsonwriter.h"
+#include "data/binaryprotocol.h"
+#include "data/handler.h"
+#include "json/json.h"
+
+#include <map>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+
+/*-----------------------------------------------------------------------------
+	Utilities
+-----------------------------------------------------------------------------*/
+
+// Time a function, return the average duration of each of the count iterations in nanoseconds
+template<typename Function>
+double MeasureNanoseconds(int count, Function function)
+{
+	auto start = std::chrono::steady_clock::now();
+	function();
+	auto end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double, std::nano>(end - start).count() / count;
+}
+
+// Get the resident memory of the process in bytes, or zero if unknown
+size_t GetResidentMemory()
+{
+#ifdef WIN32
+	return 0;
+#else
+	size_t pages = 0, resident = 0;
+	std::ifstream statm("/proc/self/statm");
+	statm >> pages >> resident;
+	return resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Generate client records with hashed identifiers
+std::vector<ClientRecordPtr> GenerateRecords(int count)
+{
+	std::vector<ClientRecordPtr> records;
+	records.reserve(count);
+
+	for (int i = 0; i < count; i++)
+	{
+		std::string privateId = std::to_string(i);
+		ClientDataPtr data(new ClientData(privateId, "127.0.0.1"));
+		records.push_back(ClientRecordPtr(new ClientRecord(privateId, GetPublicIdFromPrivateId(privateId), data)));
+	}
+
+	return records;
+}
+
+
+/*-----------------------------------------------------------------------------
+	Benchmarks
+-----------------------------------------------------------------------------*/
+
+// Public ID lookups, std::map against HashIndex
+void BenchmarkIndex()
+{
+	const int lookupCount = 1000000;
+	std::mt19937 mt(42);
+
+	for (int clientCount : { 100000, 1000000 })
+	{
+		std::vector<ClientRecordPtr> records = GenerateRecords(clientCount);
+
+		// Random lookup order
+		std::vector<std::string> lookups;
+		std::uniform_int_distribution<int> randomClient(0, clientCount - 1);
+		for (int i = 0; i < lookupCount; i++)
+		{
+			lookups.push_back(records[randomClient(mt)]->publicId);
+		}
+
+		// Fill indexes
+		std::map<std::string, ClientRecordPtr> map;
+		HashIndex<ClientRecordPtr, ClientPublicIdOf> index;
+		for (auto& record : records)
+		{
+			map[record->publicId] = record;
+			index.Insert(ClientKey(record->publicId), record->publicId) = record;
+		}
+
+		// Measure
+		size_t found = 0;
+		double mapTime = MeasureNanoseconds(lookupCount, [&]()
+		{
+			for (auto& id : lookups)
+			{
+				found += map.find(id) != map.end();
+			}
+		});
+		double indexTime = MeasureNanoseconds(lookupCount, [&]()
+		{
+			for (auto& id : lookups)
+			{
+				found += index.Find(ClientKey(id), id) != nullptr;
+			}
+		});
+
+		if (found != 2 * lookupCount)
+		{
+			std::cout << "BenchmarkIndex : lookups failed" << std::endl;
+		}
+		std::cout << clientCount << " clients : std::map " << mapTime << " ns, HashIndex " << indexTime << " ns per lookup" << std::endl;
+	}
+}
+
+// Run a search repeatedly, return the average time in microseconds
+double MeasureSearch(Database& database, const std::vector<ClientSearchCriterion>& criteria, int count, size_t& results, std::string& access)
+{
+	ClientSearchPlan plan;
+	double time = MeasureNanoseconds(count, [&]()
+	{
+		for (int i = 0; i < count; i++)
+		{
+			results += database.SearchClients(criteria, 1000000, &plan).size();
+		}
+	});
+
+	access = plan.GetAccessName();
+	return time / 1000;
+}
+
+// Searches with a full scan, with secondary indexes, then with the planner's statistics
+void BenchmarkSearch()
+{
+	const int clientCount = 200000;
+	const int searchCount = 50;
+	std::mt19937 mt(42);
+	std::uniform_int_distribution<int> randomLevel(0, 999);
+	std::uniform_int_distribution<int> randomName(0, 999);
+
+	AttributeKey levelKey = AttributeKeys::Get().Intern("level");
+	AttributeKey nameKey = AttributeKeys::Get().Intern("name");
+
+	Database database(3600, 3600, 16, 0);
+	for (int i = 0; i < clientCount; i++)
+	{
+		std::string privateId = std::to_string(i);
+		database.ConnectClient(privateId, GetPublicIdFromPrivateId(privateId), "127.0.0.1");
+
+		ClientData data;
+		data.attributes.Set(levelKey, ClientAttribute(randomLevel(mt)));
+		data.attributes.Set(nameKey, ClientAttribute("name" + std::to_string(randomName(mt))));
+		database.UpdateClient(privateId, data);
+	}
+
+	// A narrow level range, about 0.5% of clients
+	std::vector<ClientSearchCriterion> levelRange;
+	levelRange.push_back(ClientSearchCriterion("level", ClientAttribute(300), ClientSearchCondition::T_GREATER_EQ));
+	levelRange.push_back(ClientSearchCriterion("level", ClientAttribute(305), ClientSearchCondition::T_LESSER));
+
+	// A wide level range led by a rare name, about 0.05% of clients
+	std::vector<ClientSearchCriterion> rareName;
+	rareName.push_back(ClientSearchCriterion("level", ClientAttribute(0), ClientSearchCondition::T_GREATER_EQ));
+	rareName.push_back(ClientSearchCriterion("name", ClientAttribute(std::string("name42")), ClientSearchCondition::T_EQUAL));
+
+	// Two ranges that are each wide but narrow together, about 0.25% of clients
+	std::vector<ClientSearchCriterion> twoRanges;
+	twoRanges.push_back(ClientSearchCriterion("level", ClientAttribute(950), ClientSearchCondition::T_GREATER_EQ));
+	twoRanges.push_back(ClientSearchCriterion("name", ClientAttribute(std::string("name95")), ClientSearchCondition::T_GREATER_EQ));
+
+	std::vector<std::pair<std::string, std::vector<ClientSearchCriterion>>> searches;
+	searches.push_back(std::make_pair("level range", levelRange));
+	searches.push_back(std::make_pair("rare name", rareName));
+	searches.push_back(std::make_pair("two ranges", twoRanges));
+
+	// Without indexes nor statistics, then with indexes, then with statistics
+	const char* steps[] = { "scan", "index", "planned" };
+	std::vector<std::vector<double>> times(searches.size());
+	std::vector<std::vector<size_t>> results(searches.size());
+	std::vector<std::vector<std::string>> accesses(searches.size());
+	for (const char* step : steps)
+	{
+		if (std::string(step) == "index")
+		{
+			database.AddIndex("level");
+			database.AddIndex("name");
+		}
+		else if (std::string(step) == "planned")
+		{
+			double refreshTime = MeasureNanoseconds(1, [&]()
+			{
+				database.RefreshStatistics();
+			});
+			std::cout << "Statistics refreshed in " << refreshTime / 1000 << " us" << std::endl;
+		}
+
+		for (size_t i = 0; i < searches.size(); i++)
+		{
+			size_t count = 0;
+			std::string access;
+			times[i].push_back(MeasureSearch(database, searches[i].second, searchCount, count, access));
+			results[i].push_back(count / searchCount);
+			accesses[i].push_back(access);
+		}
+	}
+
+	for (size_t i = 0; i < searches.size(); i++)
+	{
+		if (results[i][0] != results[i][1] || results[i][0] != results[i][2])
+		{
+			std::cout << "BenchmarkSearch : results differ" << std::endl;
+		}
+		std::cout << searches[i].first << ", " << results[i][0] << " results :";
+		for (size_t j = 0; j < times[i].size(); j++)
+		{
+			std::cout << " " << steps[j] << " (" << accesses[i][j] << ") " << times[i][j] << " us";
+		}
+		std::cout << std::endl;
+	}
+}
+
+
+// Full searches at 1M clients, scanning records against scanning columns
+void BenchmarkColumns()
+{
+	const int clientCount = 1000000;
+	const int searchCount = 10;
+	AttributeKey levelKey = AttributeKeys::Get().Intern("level");
+	AttributeKey scoreKey = AttributeKeys::Get().Intern("score");
+	AttributeKey nameKey = AttributeKeys::Get().Intern("name");
+	AttributeKey vipKey = AttributeKeys::Get().Intern("vip");
+
+	// Unindexed searches, each matching less than 0.1% of clients
+	std::vector<std::pair<std::string, std::vector<ClientSearchCriterion>>> searches(3);
+	searches[0].first = "level and score";
+	searches[0].second.push_back(ClientSearchCriterion("level", ClientAttribute(42), ClientSearchCondition::T_EQUAL));
+	searches[0].second.push_back(ClientSearchCriterion("score", ClientAttribute(0.5), ClientSearchCondition::T_LESSER));
+	searches[1].first = "name and vip";
+	searches[1].second.push_back(ClientSearchCriterion("name", ClientAttribute(std::string("name42")), ClientSearchCondition::T_EQUAL));
+	searches[1].second.push_back(ClientSearchCriterion("vip", ClientAttribute(true), ClientSearchCondition::T_EQUAL));
+	searches[2].first = "two ranges";
+	searches[2].second.push_back(ClientSearchCriterion("level", ClientAttribute(990), ClientSearchCondition::T_GREATER_EQ));
+	searches[2].second.push_back(ClientSearchCriterion("score", ClientAttribute(0.99), ClientSearchCondition::T_GREATER_EQ));
+
+	std::vector<std::vector<double>> times(searches.size());
+	std::vector<std::vector<size_t>> results(searches.size());
+	for (DatabaseEngine engine : { DatabaseEngine::T_RECORDS, DatabaseEngine::T_COLUMNS })
+	{
+		std::mt19937 mt(42);
+		std::uniform_int_distribution<int> randomValue(0, 999);
+
+		Database database(3600, 3600, 16, 0, engine);
+		for (int i = 0; i < clientCount; i++)
+		{
+			std::string privateId = std::to_string(i);
+			database.ConnectClient(privateId, GetPublicIdFromPrivateId(privateId), "127.0.0.1");
+
+			ClientData data;
+			data.attributes.Set(levelKey, ClientAttribute(randomValue(mt)));
+			data.attributes.Set(scoreKey, ClientAttribute(randomValue(mt) / 1000.0));
+			data.attributes.Set(nameKey, ClientAttribute("name" + std::to_string(randomValue(mt))));
+			data.attributes.Set(vipKey, ClientAttribute(randomValue(mt) < 100));
+			database.UpdateClient(privateId, data);
+		}
+
+		for (size_t i = 0; i < searches.size(); i++)
+		{
+			size_t count = 0;
+			std::string access;
+			times[i].push_back(MeasureSearch(database, searches[i].second, searchCount, count, access));
+			results[i].push_back(count / searchCount);
+		}
+	}
+
+	std::cout << "Column scans use " << ColumnStore::GetInstructionSet() << std::endl;
+	for (size_t i = 0; i < searches.size(); i++)
+	{
+		if (results[i][0] != results[i][1])
+		{
+			std::cout << "BenchmarkColumns : results differ" << std::endl;
+		}
+		std::cout << searches[i].first << ", " << results[i][0] << " results : records " << times[i][0] << " us, columns " << times[i][1] << " us" << std::endl;
+	}
+}
+
+
+// Heartbeats per second on one core : looking the client up twice as handlers used to, once, or through a handle
+void BenchmarkHeartbeat()
+{
+	const int clientCount = 100000;
+	const int heartbeatCount = 2000000;
+	std::mt19937 mt(42);
+	std::uniform_int_distribution<int> randomClient(0, clientCount - 1);
+
+	Database database(3600, 3600, 16, 0);
+	std::vector<std::string> privateIds;
+	std::vector<ClientRecordPtr> handles;
+	for (int i = 0; i < clientCount; i++)
+	{
+		privateIds.push_back(std::to_string(i));
+		database.ConnectClient(privateIds.back(), GetPublicIdFromPrivateId(privateIds.back()), "127.0.0.1");
+		handles.push_back(database.GetClientRecord(privateIds.back()));
+	}
+
+	std::vector<int> order;
+	for (int i = 0; i < heartbeatCount; i++)
+	{
+		order.push_back(randomClient(mt));
+	}
+
+	// Measure
+	size_t found = 0;
+	double twoLookupsTime = MeasureNanoseconds(heartbeatCount, [&]()
+	{
+		for (int i : order)
+		{
+			if (database.IsConnectedPrivate(privateIds[i]))
+			{
+				found += database.HeartbeatClient(privateIds[i]);
+			}
+		}
+	});
+	double lookupTime = MeasureNanoseconds(heartbeatCount, [&]()
+	{
+		for (int i : order)
+		{
+			found += database.HeartbeatClient(privateIds[i]);
+		}
+	});
+	double handleTime = MeasureNanoseconds(heartbeatCount, [&]()
+	{
+		for (int i : order)
+		{
+			found += database.HeartbeatClient(handles[i]);
+		}
+	});
+
+	if (found != 3 * size_t(heartbeatCount))
+	{
+		std::cout << "BenchmarkHeartbeat : heartbeats failed" << std::endl;
+	}
+	std::cout << clientCount << " clients : two lookups " << 1e9 / twoLookupsTime << ", one lookup " << 1e9 / lookupTime
+		<< ", handle " << 1e9 / handleTime << " heartbeats per second" << std::endl;
+}
+
+// Two-field updates of clients with six attributes : copying and replacing the data, or patching it
+void BenchmarkUpdate()
+{
+	const int clientCount = 100000;
+	const int updateCount = 1000000;
+	std::mt19937 mt(42);
+	std::uniform_int_distribution<int> randomClient(0, clientCount - 1);
+
+	AttributeKey levelKey = AttributeKeys::Get().Intern("level");
+	AttributeKey scoreKey = AttributeKeys::Get().Intern("score");
+	AttributeKey nameKey = AttributeKeys::Get().Intern("name");
+	AttributeKey vipKey = AttributeKeys::Get().Intern("vip");
+	AttributeKey regionKey = AttributeKeys::Get().Intern("region");
+	AttributeKey rankKey = AttributeKeys::Get().Intern("rank");
+
+	for (DatabaseEngine engine : { DatabaseEngine::T_RECORDS, DatabaseEngine::T_COLUMNS })
+	{
+		Database database(3600, 3600, 16, 0, engine);
+		std::vector<ClientRecordPtr> records;
+		for (int i = 0; i < clientCount; i++)
+		{
+			std::string privateId = std::to_string(i);
+			records.push_back(database.ConnectClient(privateId, GetPublicIdFromPrivateId(privateId), "127.0.0.1"));
+
+			ClientData data;
+			data.attributes.Set(levelKey, ClientAttribute(i % 100));
+			data.attributes.Set(scoreKey, ClientAttribute(i / 1000.0));
+			data.attributes.Set(nameKey, ClientAttribute("name" + std::to_string(i)));
+			data.attributes.Set(vipKey, ClientAttribute(i % 10 == 0));
+			data.attributes.Set(regionKey, ClientAttribute(std::string("europe-west-paris")));
+			data.attributes.Set(rankKey, ClientAttribute(std::string("gold")));
+			database.UpdateClient(records.back(), data);
+		}
+
+		std::vector<int> order;
+		for (int i = 0; i < updateCount; i++)
+		{
+			order.push_back(randomClient(mt));
+		}
+
+		// Measure
+		double updateTime = MeasureNanoseconds(updateCount, [&]()
+		{
+			for (int i : order)
+			{
+				ClientData data = *records[i]->GetData();
+				data.attributes.Set(levelKey, ClientAttribute(data.attributes.Find(levelKey)->GetInt() + 1));
+				data.attributes.Set(scoreKey, ClientAttribute(i / 100.0));
+				database.UpdateClient(records[i], std::move(data));
+			}
+		});
+		std::vector<ClientPatch> patches;
+		double patchTime = MeasureNanoseconds(updateCount, [&]()
+		{
+			for (int i : order)
+			{
+				patches.clear();
+				patches.push_back(ClientPatch(levelKey, ClientPatchOperation::T_INCREMENT, ClientAttribute(1)));
+				patches.push_back(ClientPatch(scoreKey, ClientPatchOperation::T_SET, ClientAttribute(i / 10.0)));
+				database.PatchClient(records[i], patches);
+			}
+		});
+
+		std::cout << (engine == DatabaseEngine::T_COLUMNS ? "columns" : "records") << ", " << clientCount << " clients : update "
+			<< updateTime << " ns, patch " << patchTime << " ns per update" << std::endl;
+	}
+}
+
+// Memory used by 1M clients with typical attributes
+void BenchmarkMemory()
+{
+	const int clientCount = 1000000;
+	const char* regions[] = { "europe-west-paris", "europe-north-stockholm", "america-east-virginia", "asia-east-tokyo" };
+	const char* levels[] = { "bronze", "silver", "gold", "platinum-champion" };
+	std::mt19937 mt(42);
+	std::uniform_int_distribution<int> randomValue(0, 999);
+
+	AttributeKey levelKey = AttributeKeys::Get().Intern("level");
+	AttributeKey scoreKey = AttributeKeys::Get().Intern("score");
+	AttributeKey nameKey = AttributeKeys::Get().Intern("name");
+	AttributeKey vipKey = AttributeKeys::Get().Intern("vip");
+	AttributeKey regionKey = AttributeKeys::Get().Intern("region");
+	AttributeKey rankKey = AttributeKeys::Get().Intern("rank");
+
+	size_t startMemory = GetResidentMemory();
+	{
+		Database database(3600, 3600, 16, 0);
+		for (int i = 0; i < clientCount; i++)
+		{
+			std::string privateId = std::to_string(i);
+			database.ConnectClient(privateId, GetPublicIdFromPrivateId(privateId), "127.0.0.1");
+
+			ClientData data;
+			data.attributes.Set(levelKey, ClientAttribute(randomValue(mt)));
+			data.attributes.Set(scoreKey, ClientAttribute(randomValue(mt) / 1000.0));
+			data.attributes.Set(nameKey, ClientAttribute("name" + std::to_string(randomValue(mt))));
+			data.attributes.Set(vipKey, ClientAttribute(randomValue(mt) < 100));
+			data.attributes.Set(regionKey, ClientAttribute(std::string(regions[randomValue(mt) % 4])));
+			data.attributes.Set(rankKey, ClientAttribute(std::string(levels[randomValue(mt) % 4])));
+			database.UpdateClient(privateId, data);
+		}
+
+		size_t memory = GetResidentMemory() - startMemory;
+		std::cout << clientCount << " clients with 6 attributes : " << memory / clientCount << " bytes per client, "
+			<< sizeof(ClientAttribute) << " bytes per attribute, " << InternedStrings::Get().Size() << " interned strings" << std::endl;
+	}
+}
+
+// Request parsing throughput on a mix of typical requests : jsoncpp into a document, then reading the
+// commands as handlers used to, against the request parser
+void BenchmarkParse()
+{
+	const int requestCount = 200000;
+	const char* requests[] = {
+		"{\"heartbeat\":{}}",
+		"{\"update\":{\"privateId\":\"3f2a9c1e-8b7d-4e21-a5c6-0d9e8f7a6b5c\",\"data\":{\"name\":\"Player \\\"One\\\"\",\"level\":42,"
+			"\"score\":1234.5,\"vip\":true,\"region\":\"europe-west-paris\",\"rank\":\"gold\"},\"increment\":{\"wins\":1}}}",
+		"{\"query\":{\"targetId\":\"9b8c7d6e5f4a3b2c1d0e9f8a7b6c5d4e3f2a1b0c9d8e7f6a5b4c3d2e1f0a9b8c\"}}",
+		"{\"search\":[{\"key\":\"level\",\"value\":10,\"condition\":\">=\"},{\"key\":\"region\",\"value\":\"europe-west-paris\"}],\"explain\":true}",
+		"{\"connect\":{\"privateId\":\"3f2a9c1e-8b7d-4e21-a5c6-0d9e8f7a6b5c\",\"publicId\":\"Player One\"}}"
+	};
+	const int typeCount = sizeof(requests) / sizeof(requests[0]);
+
+	std::vector<std::string> inputs;
+	size_t totalSize = 0;
+	for (int i = 0; i < requestCount; i++)
+	{
+		inputs.push_back(requests[i % typeCount]);
+		totalSize += inputs.back().length();
+	}
+
+	// Measure
+	size_t jsonCount = 0;
+	Json::Reader reader;
+	double jsonTime = MeasureNanoseconds(requestCount, [&]()
+	{
+		for (auto& input : inputs)
+		{
+			Json::Value request;
+			if (reader.parse(input, request))
+			{
+				jsonCount += request["update"]["data"].size() + request["search"].size();
+				jsonCount += !request["connect"].empty() + request.isMember("heartbeat") + !request["query"].empty();
+			}
+		}
+	});
+
+	size_t parserCount = 0;
+	RequestParser parser;
+	ClientRequest request;
+	double parserTime = MeasureNanoseconds(requestCount, [&]()
+	{
+		for (auto& input : inputs)
+		{
+			if (parser.Parse(input, request))
+			{
+				parserCount += request.updateData.size() + request.search.size();
+				parserCount += request.hasConnect + request.hasHeartbeat + request.hasQuery;
+			}
+		}
+	});
+
+	if (jsonCount != parserCount)
+	{
+		std::cout << "BenchmarkParse : results differ" << std::endl;
+	}
+	std::cout << requestCount << " requests of " << totalSize / requestCount << " bytes : jsoncpp " << jsonTime << " ns ("
+		<< totalSize / jsonTime / requestCount * 1000 << " MB/s), parser " << parserTime << " ns ("
+		<< totalSize / parserTime / requestCount * 1000 << " MB/s) per request" << std::endl;
+}
+
+// Reply serialization for a success, and a search with ten clients of six attributes : a jsoncpp document
+// written by Json::StreamWriterBuilder as handlers used to, against JsonWriter into a reused buffer, writing
+// each client's attributes or splicing those its snapshot cached for previous readers
+void BenchmarkReply()
+{
+	const int replyCount = 100000;
+	const int clientCount = 10;
+	const char* regions[] = { "europe-west-paris", "europe-north-stockholm", "america-east-virginia", "asia-east-tokyo" };
+
+	AttributeKey levelKey = AttributeKeys::Get().Intern("level");
+	AttributeKey scoreKey = AttributeKeys::Get().Intern("score");
+	AttributeKey nameKey = AttributeKeys::Get().Intern("name");
+	AttributeKey vipKey = AttributeKeys::Get().Intern("vip");
+	AttributeKey regionKey = AttributeKeys::Get().Intern("region");
+	AttributeKey rankKey = AttributeKeys::Get().Intern("rank");
+
+	std::vector<std::pair<std::string, ClientData>> clients(clientCount);
+	for (int i = 0; i < clientCount; i++)
+	{
+		clients[i].first = GetPublicIdFromPrivateId(std::to_string(i));
+		ClientAttributeMap& attributes = clients[i].second.attributes;
+		attributes.Set(levelKey, ClientAttribute(i * 7));
+		attributes.Set(scoreKey, ClientAttribute(i * 123.25));
+		attributes.Set(nameKey, ClientAttribute("Player " + std::to_string(i)));
+		attributes.Set(vipKey, ClientAttribute(i % 3 == 0));
+		attributes.Set(regionKey, ClientAttribute(std::string(regions[i % 4])));
+		attributes.Set(rankKey, ClientAttribute(std::string("gold")));
+	}
+
+	for (bool isSearch : { false, true })
+	{
+		// Measure
+		std::string jsonReply;
+		double jsonTime = MeasureNanoseconds(replyCount, [&]()
+		{
+			for (int i = 0; i < replyCount; i++)
+			{
+				Json::Value reply;
+				reply["reply"]["status"] = std::string("OK");
+				for (int j = 0; isSearch && j < clientCount; j++)
+				{
+					for (auto& entry : clients[j].second.attributes)
+					{
+						Json::Value& value = reply["reply"]["clients"][clients[j].first][AttributeKeys::Get().GetName(entry.first)];
+						switch (entry.second.GetType())
+						{
+							case ClientAttributeType::T_STR: value = entry.second.GetString();   break;
+							case ClientAttributeType::T_INT: value = entry.second.GetInt();      break;
+							case ClientAttributeType::T_DBL: value = entry.second.GetDouble();   break;
+							case ClientAttributeType::T_BOL: value = entry.second.GetBool();     break;
+							default:                                                             break;
+						}
+					}
+				}
+
+				Json::StreamWriterBuilder builder;
+				builder["indentation"] = "";
+				jsonReply = Json::writeString(builder, reply);
+			}
+		});
+
+		std::string writerReply;
+		double writerTime = MeasureNanoseconds(replyCount, [&]()
+		{
+			for (int i = 0; i < replyCount; i++)
+			{
+				writerReply.clear();
+				JsonWriter writer(writerReply);
+				writer.BeginObject();
+				writer.Key("reply");
+				writer.BeginObject();
+				if (isSearch)
+				{
+					writer.Key("clients");
+					writer.BeginObject();
+					for (int j = 0; j < clientCount; j++)
+					{
+						writer.Key(clients[j].first);
+						writer.BeginObject();
+						for (auto& entry : clients[j].second.attributes)
+						{
+							writer.Key(AttributeKeys::Get().GetName(entry.first));
+							switch (entry.second.GetType())
+							{
+								case ClientAttributeType::T_STR: writer.String(entry.second.GetStringData(), entry.second.GetStringLength()); break;
+								case ClientAttributeType::T_INT: writer.Int(entry.second.GetInt());                                           break;
+								case ClientAttributeType::T_DBL: writer.Double(entry.second.GetDouble());                                     break;
+								case ClientAttributeType::T_BOL: writer.Bool(entry.second.GetBool());                                         break;
+								default:                                                                                                      break;
+							}
+						}
+						writer.EndObject();
+					}
+					writer.EndObject();
+				}
+				writer.Key("status");
+				writer.String("OK");
+				writer.EndObject();
+				writer.EndObject();
+			}
+		});
+
+		// Replies to readers of the same snapshots, splicing their serialized attributes
+		std::string cachedReply;
+		double cachedTime = MeasureNanoseconds(replyCount, [&]()
+		{
+			for (int i = 0; i < replyCount; i++)
+			{
+				cachedReply.clear();
+				JsonWriter writer(cachedReply);
+				writer.BeginObject();
+				writer.Key("reply");
+				writer.BeginObject();
+				if (isSearch)
+				{
+					writer.Key("clients");
+					writer.BeginObject();
+					for (int j = 0; j < clientCount; j++)
+					{
+						const std::string& payload = clients[j].second.GetPayload();
+						writer.Key(clients[j].first);
+						writer.Raw(payload.data(), payload.length());
+					}
+					writer.EndObject();
+				}
+				writer.Key("status");
+				writer.String("OK");
+				writer.EndObject();
+				writer.EndObject();
+			}
+		});
+
+		// All replies should read back the same
+		Json::Value jsonValue, writerValue, cachedValue;
+		Json::Reader reader;
+		if (!reader.parse(jsonReply, jsonValue) || !reader.parse(writerReply, writerValue) || !reader.parse(cachedReply, cachedValue)
+			|| jsonValue != writerValue || jsonValue != cachedValue)
+		{
+			std::cout << "BenchmarkReply : replies differ" << std::endl;
+		}
+		std::cout << (isSearch ? "search" : "success") << " : jsoncpp " << jsonReply.length() << " bytes in " << jsonTime << " ns, writer "
+			<< writerReply.length() << " bytes in " << writerTime << " ns, cached " << cachedTime << " ns per reply" << std::endl;
+	}
+}
+
+
+// Request size and parsing time for the requests of the parse benchmark, as JSON with the request parser
+// against the binary protocol, with attribute keys by identifier
+void BenchmarkProtocol()
+{
+	const int requestCount = 200000;
+	const char* privateId = "3f2a9c1e-8b7d-4e21-a5c6-0d9e8f7a6b5c";
+	const char* requests[] = {
+		"{\"heartbeat\":{}}",
+		"{\"update\":{\"privateId\":\"3f2a9c1e-8b7d-4e21-a5c6-0d9e8f7a6b5c\",\"data\":{\"name\":\"Player \\\"One\\\"\",\"level\":42,"
+			"\"score\":1234.5,\"vip\":true,\"region\":\"europe-west-paris\",\"rank\":\"gold\"},\"increment\":{\"wins\":1}}}",
+		"{\"query\":{\"targetId\":\"9b8c7d6e5f4a3b2c1d0e9f8a7b6c5d4e3f2a1b0c9d8e7f6a5b4c3d2e1f0a9b8c\"}}",
+		"{\"search\":[{\"key\":\"level\",\"value\":10,\"condition\":\">=\"},{\"key\":\"region\",\"value\":\"europe-west-paris\"}],\"explain\":true}",
+		"{\"connect\":{\"privateId\":\"3f2a9c1e-8b7d-4e21-a5c6-0d9e8f7a6b5c\",\"publicId\":\"Player One\"}}"
+	};
+	const int typeCount = sizeof(requests) / sizeof(requests[0]);
+
+	// Write the same requests in the binary protocol
+	std::string binaryRequests[typeCount];
+	for (int i = 0; i < typeCount; i++)
+	{
+		BinaryWriter writer(binaryRequests[i]);
+		writer.Byte(cBinaryMagic);
+	}
+	{
+		BinaryWriter writer(binaryRequests[0]);
+		writer.Byte(uint8_t(BinaryCommand::T_HEARTBEAT));
+		writer.Byte(uint8_t(BinaryTarget::T_BOUND));
+	}
+	{
+		BinaryWriter writer(binaryRequests[1]);
+		writer.Byte(uint8_t(BinaryCommand::T_UPDATE));
+		writer.Byte(uint8_t(BinaryTarget::T_PRIVATE_ID));
+		writer.String(privateId, strlen(privateId));
+		writer.Varint(6);
+		writer.Key(AttributeKeys::Get().Intern("name"));
+		writer.Attribute(ClientAttribute("Player \"One\""));
+		writer.Key(AttributeKeys::Get().Intern("level"));
+		writer.Attribute(ClientAttribute(42));
+		writer.Key(AttributeKeys::Get().Intern("score"));
+		writer.Attribute(ClientAttribute(1234.5));
+		writer.Key(AttributeKeys::Get().Intern("vip"));
+		writer.Attribute(ClientAttribute(true));
+		writer.Key(AttributeKeys::Get().Intern("region"));
+		writer.Attribute(ClientAttribute("europe-west-paris"));
+		writer.Key(AttributeKeys::Get().Intern("rank"));
+		writer.Attribute(ClientAttribute("gold"));
+		writer.Varint(1);
+		writer.Key(AttributeKeys::Get().Intern("wins"));
+		writer.Attribute(ClientAttribute(1));
+		writer.Varint(0);
+	}
+	{
+		BinaryWriter writer(binaryRequests[2]);
+		writer.Byte(uint8_t(BinaryCommand::T_QUERY));
+		writer.String("9b8c7d6e5f4a3b2c1d0e9f8a7b6c5d4e3f2a1b0c9d8e7f6a5b4c3d2e1f0a9b8c");
+	}
+	{
+		BinaryWriter writer(binaryRequests[3]);
+		writer.Byte(uint8_t(BinaryCommand::T_SEARCH));
+		writer.Varint(2);
+		writer.Key(AttributeKeys::Get().Intern("level"));
+		writer.Byte(uint8_t(ClientSearchCondition::T_GREATER_EQ));
+		writer.Attribute(ClientAttribute(10));
+		writer.Key(AttributeKeys::Get().Intern("region"));
+		writer.Byte(uint8_t(ClientSearchCondition::T_EQUAL));
+		writer.Attribute(ClientAttribute("europe-west-paris"));
+		writer.Byte(1);
+	}
+	{
+		BinaryWriter writer(binaryRequests[4]);
+		writer.Byte(uint8_t(BinaryCommand::T_CONNECT));
+		writer.String(privateId, strlen(privateId));
+		writer.String("Player One");
+		writer.Varint(0);
+	}
+
+	std::vector<std::string> jsonInputs;
+	std::vector<std::string> binaryInputs;
+	size_t jsonSize = 0;
+	size_t binarySize = 0;
+	for (int i = 0; i < requestCount; i++)
+	{
+		jsonInputs.push_back(requests[i % typeCount]);
+		binaryInputs.push_back(binaryRequests[i % typeCount]);
+		jsonSize += jsonInputs.back().length();
+		binarySize += binaryInputs.back().length();
+	}
+
+	// Measure
+	size_t jsonCount = 0;
+	RequestParser parser;
+	ClientRequest request;
+	double jsonTime = MeasureNanoseconds(requestCount, [&]()
+	{
+		for (auto& input : jsonInputs)
+		{
+			if (parser.Parse(input, request))
+			{
+				jsonCount += request.updateData.size() + request.search.size();
+				jsonCount += request.hasConnect + request.hasHeartbeat + request.hasQuery;
+			}
+		}
+	});
+
+	size_t binaryCount = 0;
+	BinaryRequestParser binaryParser;
+	double binaryTime = MeasureNanoseconds(requestCount, [&]()
+	{
+		for (auto& input : binaryInputs)
+		{
+			if (binaryParser.Parse(input, request))
+			{
+				binaryCount += request.updateData.size() + request.search.size();
+				binaryCount += request.hasConnect + request.hasHeartbeat + request.hasQuery;
+			}
+		}
+	});
+
+	if (jsonCount != binaryCount)
+	{
+		std::cout << "BenchmarkProtocol : results differ" << std::endl;
+	}
+	std::cout << requestCount << " requests : JSON " << jsonSize / requestCount << " bytes in " << jsonTime << " ns, binary "
+		<< binarySize / requestCount << " bytes in " << binaryTime << " ns per request" << std::endl;
+}
+
+
+// A game server proxying 64 players, sending each a heartbeat and an update every tick : one request per
+// operation, against one batch request per tick, through the request handler
+void BenchmarkBatch()
+{
+	const int clientCount = 100000;
+	const int playerCount = 64;
+	const int tickCount = 5000;
+
+	std::shared_ptr<Database> database = std::make_shared<Database>(3600, 3600, 16, 0);
+	for (int i = 0; i < clientCount; i++)
+	{
+		std::string privateId = std::to_string(i);
+		database->ConnectClient(privateId, GetPublicIdFromPrivateId(privateId), "127.0.0.1");
+	}
+
+	// Requests of a tick
+	std::vector<std::string> requests;
+	std::string batch = "{\"batch\":[";
+	for (int i = 0; i < playerCount; i++)
+	{
+		std::string target = "{\"privateId\":\"" + std::to_string(i * (clientCount / playerCount)) + "\"";
+		std::string heartbeat = "{\"heartbeat\":" + target + "}}";
+		std::string update = "{\"update\":" + target + ",\"data\":{\"score\":" + std::to_string(i) + ".5},\"increment\":{\"level\":1}}}";
+		requests.push_back(heartbeat);
+		requests.push_back(update);
+		batch += heartbeat + "," + update + (i + 1 < playerCount ? "," : "]}");
+	}
+
+	// Measure
+	Handler handler(database, "127.0.0.1");
+	std::string reply;
+	size_t failures = 0;
+	double requestTime = MeasureNanoseconds(tickCount * playerCount * 2, [&]()
+	{
+		for (int i = 0; i < tickCount; i++)
+		{
+			for (auto& request : requests)
+			{
+				handler.ProcessClientRequest(request, reply);
+				failures += (reply.find("\"OK\"") == std::string::npos);
+			}
+		}
+	});
+	double batchTime = MeasureNanoseconds(tickCount * playerCount * 2, [&]()
+	{
+		for (int i = 0; i < tickCount; i++)
+		{
+			handler.ProcessClientRequest(batch, reply);
+			failures += (reply.find("Target") != std::string::npos);
+		}
+	});
+
+	if (failures)
+	{
+		std::cout << "BenchmarkBatch : operations failed" << std::endl;
+	}
+	std::cout << playerCount << " players at " << clientCount << " clients : requests " << requestTime << " ns, batch "
+		<< batchTime << " ns per operation" << std::endl;
+}
+
+
+// Presence of friend lists growing up to 400 players, half of them connected : one query per friend, against
+// one multiQuery per list, through the request handler
+void BenchmarkMultiQuery()
+{
+	const int clientCount = 100000;
+	const int lookupCount = 400000;
+
+	AttributeKey levelKey = AttributeKeys::Get().Intern("level");
+	AttributeKey nameKey = AttributeKeys::Get().Intern("name");
+	AttributeKey statusKey = AttributeKeys::Get().Intern("status");
+
+	std::shared_ptr<Database> database = std::make_shared<Database>(3600, 3600, 16, 0);
+	for (int i = 0; i < clientCount; i++)
+	{
+		std::string privateId = std::to_string(i);
+		ClientRecordPtr record = database->ConnectClient(privateId, GetPublicIdFromPrivateId(privateId), "127.0.0.1");
+
+		ClientData data(privateId, "127.0.0.1");
+		data.attributes.Set(levelKey, ClientAttribute(i % 100));
+		data.attributes.Set(nameKey, ClientAttribute("Player " + privateId));
+		data.attributes.Set(statusKey, ClientAttribute(std::string(i % 3 ? "lobby" : "in-game")));
+		database->UpdateClient(record, data);
+	}
+
+	for (int friendCount : { 25, 100, 400 })
+	{
+		// Requests for a friend list, odd friends not being connected
+		std::vector<std::string> requests;
+		std::string multiQuery = "{\"multiQuery\":{\"keys\":[\"status\"],\"targetIds\":[";
+		for (int i = 0; i < friendCount; i++)
+		{
+			std::string privateId = std::to_string(i % 2 ? clientCount + i : i * (clientCount / friendCount));
+			std::string target = "\"" + GetPublicIdFromPrivateId(privateId) + "\"";
+			requests.push_back("{\"query\":{\"targetId\":" + target + "}}");
+			multiQuery += target + (i + 1 < friendCount ? "," : "]}}");
+		}
+
+		// Measure
+		Handler handler(database, "127.0.0.1");
+		std::string reply;
+		size_t queryCount = 0;
+		size_t multiQueryCount = 0;
+		int listCount = lookupCount / friendCount;
+		double queryTime = MeasureNanoseconds(listCount * friendCount, [&]()
+		{
+			for (int i = 0; i < listCount; i++)
+			{
+				for (auto& request : requests)
+				{
+					handler.ProcessClientRequest(request, reply);
+					queryCount += (reply.find("\"data\"") != std::string::npos);
+				}
+			}
+		});
+		double multiQueryTime = MeasureNanoseconds(listCount * friendCount, [&]()
+		{
+			for (int i = 0; i < listCount; i++)
+			{
+				handler.ProcessClientRequest(multiQuery, reply);
+				multiQueryCount += std::count(reply.begin(), reply.end(), '{') - 2;
+			}
+		});
+
+		if (queryCount != multiQueryCount)
+		{
+			std::cout << "BenchmarkMultiQuery : results differ" << std::endl;
+		}
+		std::cout << friendCount << " friends : queries " << queryTime << " ns, multiQuery " << multiQueryTime << " ns per friend" << std::endl;
+	}
+}
+
+
+// Patches of a player followed by up to 10000 subscribers, whose queues are drained every 100 patches as
+// event loops would : the cost of notifications for the writer, that pushes them once the shard is unlocked
+void BenchmarkSubscribe()
+{
+	const int patchCount = 100000;
+	const int drainPeriod = 100;
+
+	AttributeKey levelKey = AttributeKeys::Get().Intern("level");
+	std::vector<ClientNotification> notifications;
+	std::vector<ClientPatch> patches;
+
+	for (int subscriberCount : { 0, 1, 100, 10000 })
+	{
+		Database database(3600, 3600, 16, 0);
+		ClientRecordPtr record = database.ConnectClient("0", GetPublicIdFromPrivateId("0"), "127.0.0.1");
+
+		std::vector<ClientSubscriberPtr> subscribers;
+		std::vector<std::string> publicIds(1, record->publicId);
+		for (int i = 0; i < subscriberCount; i++)
+		{
+			subscribers.push_back(std::make_shared<ClientSubscriber>());
+			database.Subscribe(subscribers.back(), publicIds);
+		}
+
+		// Measure
+		size_t notificationCount = 0;
+		double patchTime = MeasureNanoseconds(patchCount, [&]()
+		{
+			for (int i = 0; i < patchCount; i++)
+			{
+				patches.clear();
+				patches.push_back(ClientPatch(levelKey, ClientPatchOperation::T_SET, ClientAttribute(i)));
+				database.PatchClient(record, patches);
+
+				if (i % drainPeriod == drainPeriod - 1)
+				{
+					for (auto& subscriber : subscribers)
+					{
+						subscriber->Pop(notifications);
+						notificationCount += notifications.size();
+					}
+				}
+			}
+		});
+
+		if (notificationCount != size_t(subscriberCount) * (patchCount / drainPeriod))
+		{
+			std::cout << "BenchmarkSubscribe : notifications were lost" << std::endl;
+		}
+		std::cout << subscriberCount << " subscribers : " << patchTime << " ns per patch" << std::endl;
+	}
+}
+
+
+// Run a benchmark by name
+bool RunBenchmark(const std::string& name)
+{
+	if (name == "index")
+	{
+		BenchmarkIndex();
+	}
+	else if (name == "search")
+	{
+		BenchmarkSearch();
+	}
+	else if (name == "columns")
+	{
+		BenchmarkColumns();
+	}
+	else if (name == "heartbeat")
+	{
+		BenchmarkHeartbeat();
+	}
+	else if (name == "update")
+	{
+		BenchmarkUpdate();
+	}
+	else if (name == "memory")
+	{
+		BenchmarkMemory();
+	}
+	else if (name == "parse")
+	{
+		BenchmarkParse();
+	}
+	else if (name == "reply")
+	{
+		BenchmarkReply();
+	}
+	else if (name == "protocol")
+	{
+		BenchmarkProtocol();
+	}
+	else if (name == "batch")
+	{
+		BenchmarkBatch();
+	}
+	else if (name == "multiquery")
+	{
+		BenchmarkMultiQuery();
+	}
+	else if (name == "subscribe")
+	{
+		BenchmarkSubscribe();
+	}
+	else
+	{
+		std::cout << "Unknown benchmark " << name << std::endl;
+		return false;
+	}
+
+	return true;
+}
@@ -1,5 +1,7 @@
 ﻿#include "player.h"
 #include "utils.h"
+#include "benchmark.h"
+#include "inputparams.h"
 #include "json/json.h"
 #include "network/tcpsocket.h"
 
@@ -13,7 +15,7 @@
 static std::mutex sPrintMutex;
 
 
-void SimulateRandomClient(std::string url, int port, std::string caCertFile, int identifier)
+void SimulateRandomClient(std::string url, int port, std::string caCertFile, int identifier, bool isBinary)
 {
 	// Random
 	std::random_device rd;
@@ -22,7 +24,7 @@ void SimulateRandomClient(std::string url, int port, std::string caCertFile, int
 	std::uniform_int_distribution<int> randomUpdateCount(1, 3);
 
 	// Simulate connection
-	Player player(std::to_string(identifier), url, port, caCertFile);
+	Player player(std::to_string(identifier), url, port, caCertFile, isBinary);
 	std::this_thread::sleep_for(std::chrono::seconds(randomTime(mt)));
 	player.Connect();
 	std::this_thread::sleep_for(std::chrono::seconds(randomTime(mt)));
@@ -98,21 +100,86 @@ void SimulateQueryClient(std::string url, int port, std::string caCertFile, int
 }
 
 
+void SimulateSessionClient(std::string url, int port, std::string caCertFile, int identifier, int sessionCount)
+{
+	// Connect players over one connection, each with its own session
+	TcpSocket socket;
+	if (caCertFile.length())
+	{
+		socket.SetSSLClient(caCertFile.c_str());
+	}
+	socket.Connect(url, port);
+
+	Json::Value reply;
+	for (int session = 0; session < sessionCount; session++)
+	{
+		Json::Value connect;
+		std::string privateId = std::to_string(identifier + session);
+		connect["connect"]["privateId"] = privateId;
+		connect["connect"]["publicId"] = GetPublicIdFromPrivateId(privateId);
+		connect["connect"]["session"] = session;
+		SendCommandReadResult(socket, connect, reply);
+	}
+
+	// Keep them all alive at once
+	Json::Value heartbeat;
+	heartbeat["heartbeat"]["allSessions"] = true;
+	SendCommandReadResult(socket, heartbeat, reply);
+
+	// Only heartbeats target all sessions
+	Json::Value update;
+	update["update"]["allSessions"] = true;
+	update["update"]["data"]["level"] = 1;
+	SendCommandReadResult(socket, update, reply, "Could not parse request");
+
+	Json::Value disconnectAll;
+	disconnectAll["disconnect"]["allSessions"] = true;
+	SendCommandReadResult(socket, disconnectAll, reply, "Could not parse request");
+
+	Json::Value batch;
+	batch["batch"][0]["heartbeat"]["allSessions"] = true;
+	batch["batch"][1]["heartbeat"]["session"] = 0;
+	SendCommandReadResult(socket, batch, reply);
+	assert(reply["reply"]["batch"][0] == "Could not parse request" && reply["reply"]["batch"][1] == "OK");
+
+	// Free the sessions
+	for (int session = 0; session < sessionCount; session++)
+	{
+		Json::Value disconnect;
+		disconnect["disconnect"]["session"] = session;
+		SendCommandReadResult(socket, disconnect, reply);
+	}
+	{
+		std::lock_guard<std::mutex> lock(sPrintMutex);
+		std::cout << "Session client done" << std::endl;
+	}
+}
+
+
 int main(int argc, char** argv)
 {
+	// Run a benchmark instead of the simulation
+	InputParams params(argc, argv);
+	if (params.isSet("--benchmark"))
+	{
+		return RunBenchmark(params.get("--benchmark")) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	// Setup
 	std::string serverAddress = "localhost";
 	std::string caCertFile = "";
 	int serverPort = 8080;
 	int clientCount = 100;
+	bool isBinary = params.isSet("--binary");
 
-	// Create simulated clients
+	// Create simulated clients, speaking the binary protocol if asked, the query client always using JSON
 	std::vector<std::thread> clients;
 	for (int i = 1; i <= clientCount; i++)
 	{
-		clients.push_back(std::thread(SimulateRandomClient, serverAddress, serverPort, caCertFile, i));
+		clients.push_back(std::thread(SimulateRandomClient, serverAddress, serverPort, caCertFile, i, isBinary));
 	}
 	clients.push_back(std::thread(SimulateQueryClient, serverAddress, serverPort, caCertFile, clientCount + 1));
+	clients.push_back(std::thread(SimulateSessionClient, serverAddress, serverPort, caCertFile, clientCount + 2, 4));
 
 	// Wait for clients to finish
 	for (auto& client : clients)
@@ -7,16 +7,18 @@
 #include <memory>
 #include <random>
 #include <cassert>
-#include <openssl/sha.h>
 
 
 class Player
 {
 public:
 
-	Player(std::string privateId, std::string url, int port = 8080, const std::string& caCertFile = "")
+	Player(std::string privateId, std::string url, int port = 8080, const std::string& caCertFile = "", bool isBinary = false)
 	{
 		mPrivateId = privateId;
+		mIsBinary = isBinary;
+		mNameKey = AttributeKeys::cInvalidKey;
+		mLevelKey = AttributeKeys::cInvalidKey;
 
 		std::random_device rd;
 		std::mt19937 mt(rd());
@@ -39,6 +41,34 @@ public:
 
 	void Connect()
 	{
+		// Binary clients learn the identifiers of their keys when connecting
+		if (mIsBinary)
+		{
+			std::string connect;
+			std::string reply;
+			BinaryWriter writer(connect);
+			writer.Byte(cBinaryMagic);
+			writer.Byte(uint8_t(BinaryCommand::T_CONNECT));
+			writer.String(mPrivateId);
+			writer.String(GetPublicIdFromPrivateId(mPrivateId));
+			writer.Varint(0);
+			writer.Byte(uint8_t(BinaryCommand::T_KEYS));
+			writer.Varint(2);
+			writer.String("name");
+			writer.String("level");
+			SendBinaryCommandReadResult(mSocket, connect, reply);
+
+			uint8_t header[3];
+			uint64_t count, nameKey, levelKey;
+			BinaryReader reader(reply.data(), reply.length());
+			reader.Byte(header[0]) && reader.Byte(header[1]) && reader.Byte(header[2]) && reader.Varint(count)
+				&& reader.Varint(nameKey) && reader.Varint(levelKey);
+			mNameKey = AttributeKey(nameKey - 1);
+			mLevelKey = AttributeKey(levelKey - 1);
+			mPublicId = GetPublicIdFromPrivateId(mPrivateId);
+			return;
+		}
+
 		Json::Value connect;
 		Json::Value reply;
 
@@ -50,6 +80,26 @@ public:
 
 	void Update()
 	{
+		if (mIsBinary)
+		{
+			std::string update;
+			std::string reply;
+			BinaryWriter writer(update);
+			writer.Byte(cBinaryMagic);
+			writer.Byte(uint8_t(BinaryCommand::T_UPDATE));
+			writer.Byte(uint8_t(BinaryTarget::T_PRIVATE_ID));
+			writer.String(mPrivateId);
+			writer.Varint(2);
+			writer.Key(mNameKey);
+			writer.Attribute(ClientAttribute(mName));
+			writer.Key(mLevelKey);
+			writer.Attribute(ClientAttribute(mLevel));
+			writer.Varint(0);
+			writer.Varint(0);
+			SendBinaryCommandReadResult(mSocket, update, reply);
+			return;
+		}
+
 		Json::Value update;
 		Json::Value reply;
 
@@ -61,6 +111,12 @@ public:
 
 	void Heartbeat()
 	{
+		if (mIsBinary)
+		{
+			SendBinaryTarget(BinaryCommand::T_HEARTBEAT);
+			return;
+		}
+
 		Json::Value heartbeat;
 		Json::Value reply;
 
@@ -70,6 +126,38 @@ public:
 
 	std::pair<std::string, std::string> Query(std::string targetId)
 	{
+		if (mIsBinary)
+		{
+			std::string query;
+			std::string reply;
+			BinaryWriter writer(query);
+			writer.Byte(cBinaryMagic);
+			writer.Byte(uint8_t(BinaryCommand::T_QUERY));
+			writer.String(targetId);
+			SendBinaryCommandReadResult(mSocket, query, reply);
+
+			// Attributes follow the magic byte, the status and the section tag
+			std::pair<std::string, std::string> result;
+			uint64_t count = 0;
+			BinaryReader reader(reply.data() + 3, reply.length() - 3);
+			reader.Varint(count);
+			for (uint64_t i = 0; i < count; i++)
+			{
+				RequestKey key;
+				RequestValue value;
+				reader.Key(key) && reader.Value(value);
+				if (key.id == mNameKey)
+				{
+					result.first = value.string.ToString();
+				}
+				else if (key.id == mLevelKey)
+				{
+					result.second = std::to_string(value.integer);
+				}
+			}
+			return result;
+		}
+
 		Json::Value query;
 		Json::Value reply;
 
@@ -83,6 +171,12 @@ public:
 
 	void Disconnect()
 	{
+		if (mIsBinary)
+		{
+			SendBinaryTarget(BinaryCommand::T_DISCONNECT);
+			return;
+		}
+
 		Json::Value disconnect;
 		Json::Value reply;
 
@@ -103,6 +197,19 @@ public:
 
 private:
 
+	// Send a binary command targeting this player
+	void SendBinaryTarget(BinaryCommand command)
+	{
+		std::string request;
+		std::string reply;
+		BinaryWriter writer(request);
+		writer.Byte(cBinaryMagic);
+		writer.Byte(uint8_t(command));
+		writer.Byte(uint8_t(BinaryTarget::T_PRIVATE_ID));
+		writer.String(mPrivateId);
+		SendBinaryCommandReadResult(mSocket, request, reply);
+	}
+
 	// Random name
 	void GeneratePlayerName(std::mt19937& mt)
 	{
@@ -123,21 +230,6 @@ private:
 		mLevel = level(mt);
 	}
 
-	// Get public ID as hash of private (not really a good idea in production)
-	std::string GetPublicIdFromPrivateId(const std::string privateId)
-	{
-		uint8_t hash[SHA512_DIGEST_LENGTH];
-		SHA512((const unsigned char*)privateId.c_str(), privateId.length(), hash);
-
-		char hashString[2 * SHA512_DIGEST_LENGTH + 1];
-		for (int i = 0; i < SHA512_DIGEST_LENGTH; i++)
-		{
-			snprintf(hashString + i * 2, 3, "%02x", hash[i]);
-		}
-
-		return std::string(hashString);
-	}
-
 
 private:
 
@@ -147,5 +239,9 @@ private:
 	std::string                                     mPublicId;
 	TcpSocket                                       mSocket;
 
+	bool                                            mIsBinary;
+	AttributeKey                                    mNameKey;
+	AttributeKey                                    mLevelKey;
+
 
 };
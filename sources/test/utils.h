@@ -1,31 +1,71 @@
 #pragma once
 
 #include "network/tcpsocket.h"
+#include "data/binaryprotocol.h"
 
 #include <random>
 #include <iostream>
 #include <cassert>
+#include <openssl/sha.h>
 
 
-void SendCommandReadResult(TcpSocket& socket, const Json::Value& query, Json::Value& reply)
+// Get public ID as hash of private (not really a good idea in production)
+std::string GetPublicIdFromPrivateId(const std::string privateId)
+{
+	uint8_t hash[SHA512_DIGEST_LENGTH];
+	SHA512((const unsigned char*)privateId.c_str(), privateId.length(), hash);
+
+	char hashString[2 * SHA512_DIGEST_LENGTH + 1];
+	for (int i = 0; i < SHA512_DIGEST_LENGTH; i++)
+	{
+		snprintf(hashString + i * 2, 3, "%02x", hash[i]);
+	}
+
+	return std::string(hashString);
+}
+
+
+void SendCommandReadResult(TcpSocket& socket, const Json::Value& query, Json::Value& reply, const std::string& expectedStatus = "OK")
 {
 	Json::Reader reader;
 	Json::StreamWriterBuilder builder;
+	MessageStream stream(MessageFraming::T_LINE);
+	builder["indentation"] = "";
 
 	// Write
-	std::string requestData = Json::writeString(builder, query);
-	socket.Write(requestData);
+	stream.WriteMessage(Json::writeString(builder, query));
+	socket.Write(stream);
 
 	// Read reply
 	std::string replyData;
 	reply = Json::Value();
-	socket.Read(replyData);
+	socket.Read(stream, replyData);
 	reader.parse(replyData, reply);
 
-	if (reply["reply"]["status"] != std::string("OK"))
+	if (reply["reply"]["status"] != expectedStatus)
 	{
 		std::cout << "SendCommandReadResult failed : reply was " << reply["reply"]["status"] << std::endl;
 		assert(false);
 	}
 }
 
+
+
+void SendBinaryCommandReadResult(TcpSocket& socket, const std::string& query, std::string& reply)
+{
+	MessageStream stream(MessageFraming::T_LENGTH);
+
+	// Write
+	stream.WriteMessage(query);
+	socket.Write(stream);
+
+	// Read reply
+	reply.clear();
+	socket.Read(stream, reply);
+
+	if (reply.length() < 2 || uint8_t(reply[0]) != cBinaryMagic || reply[1] != char(RequestStatus::T_OK))
+	{
+		std::cout << "SendBinaryCommandReadResult failed : reply status was " << (reply.length() < 2 ? -1 : int(reply[1])) << std::endl;
+		assert(false);
+	}
+}